@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Tell whether an ext4 filesystem needs to be checked, for fsck_writable()
+// in ubuntu-core-rootfs.
+//
+// usage: ext4-state [-m MOUNTS] DEVICE
+//
+// This reads the superblock of DEVICE and prints "clean" and exits
+// successfully when the filesystem was unmounted cleanly, has no errors
+// recorded and is not due for a periodic check. Otherwise it prints
+// "check: " and the reason and exits unsuccessfully, also when the
+// superblock cannot be read or is damaged.
+//
+// Checks are due when the maximum mount count or the check interval of the
+// superblock are reached. When the superblock has no maximum mount count,
+// as mke2fs makes them by default, a check is due every MOUNTS mounts
+// (default 30). The check interval is ignored while the clock is before
+// the last check, as it is on boards without a battery for the RTC.
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// Offsets in the superblock, see struct ext4_super_block in the kernel.
+enum {
+    EXT4_SB_OFFSET = 1024,
+    EXT4_SB_SIZE = 1024,
+    EXT4_SB_MNT_COUNT = 0x34,
+    EXT4_SB_MAX_MNT_COUNT = 0x36,
+    EXT4_SB_MAGIC = 0x38,
+    EXT4_SB_STATE = 0x3a,
+    EXT4_SB_LASTCHECK = 0x40,
+    EXT4_SB_CHECKINTERVAL = 0x44,
+    EXT4_SB_FEATURE_INCOMPAT = 0x60,
+    EXT4_SB_FEATURE_RO_COMPAT = 0x64,
+    EXT4_SB_LAST_ORPHAN = 0xe8,
+    EXT4_SB_ERROR_COUNT = 0x194,
+    EXT4_SB_CHECKSUM = 0x3fc,
+};
+
+enum {
+    EXT4_SUPER_MAGIC = 0xef53,
+    EXT4_VALID_FS = 0x1,
+    EXT4_ERROR_FS = 0x2,
+    EXT4_ORPHAN_FS = 0x4,
+    EXT4_FEATURE_INCOMPAT_RECOVER = 0x4,
+    EXT4_FEATURE_RO_COMPAT_METADATA_CSUM = 0x400,
+};
+
+static uint16_t ext4_le16(const unsigned char* sb, size_t offset)
+{
+    uint16_t value;
+    memcpy(&value, sb + offset, sizeof value);
+    return le16toh(value);
+}
+
+static uint32_t ext4_le32(const unsigned char* sb, size_t offset)
+{
+    uint32_t value;
+    memcpy(&value, sb + offset, sizeof value);
+    return le32toh(value);
+}
+
+// CRC32C as the kernel computes it for metadata_csum, without the final
+// inversion.
+static uint32_t ext4_crc32c(uint32_t crc, const unsigned char* buf, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= buf[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        }
+    }
+    return crc;
+}
+
+// Get why the filesystem of the superblock sb needs a check, or NULL.
+static const char* ext4_check_reason(const unsigned char* sb, unsigned max_mounts, char* buf, size_t size)
+{
+    if (ext4_le16(sb, EXT4_SB_MAGIC) != EXT4_SUPER_MAGIC) {
+        return "not an ext2/3/4 filesystem";
+    }
+    if ((ext4_le32(sb, EXT4_SB_FEATURE_RO_COMPAT) & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)
+        && ext4_crc32c(~0U, sb, EXT4_SB_CHECKSUM) != ext4_le32(sb, EXT4_SB_CHECKSUM)) {
+        return "bad superblock checksum";
+    }
+    uint16_t state = ext4_le16(sb, EXT4_SB_STATE);
+    // The journal needs recovery after a crash or power loss.
+    if ((ext4_le32(sb, EXT4_SB_FEATURE_INCOMPAT) & EXT4_FEATURE_INCOMPAT_RECOVER) || !(state & EXT4_VALID_FS)) {
+        return "not cleanly unmounted";
+    }
+    if (state & EXT4_ERROR_FS) {
+        return "errors recorded";
+    }
+    if (ext4_le32(sb, EXT4_SB_ERROR_COUNT) != 0) {
+        snprintf(buf, size, "%u errors recorded", ext4_le32(sb, EXT4_SB_ERROR_COUNT));
+        return buf;
+    }
+    if ((state & EXT4_ORPHAN_FS) || ext4_le32(sb, EXT4_SB_LAST_ORPHAN) != 0) {
+        return "orphan inodes";
+    }
+    uint16_t mnt_count = ext4_le16(sb, EXT4_SB_MNT_COUNT);
+    int16_t max_mnt_count = (int16_t)ext4_le16(sb, EXT4_SB_MAX_MNT_COUNT);
+    unsigned limit = max_mnt_count > 0 ? (unsigned)max_mnt_count : max_mounts;
+    if (limit > 0 && mnt_count >= limit) {
+        snprintf(buf, size, "mounted %u times without a check", mnt_count);
+        return buf;
+    }
+    uint32_t lastcheck = ext4_le32(sb, EXT4_SB_LASTCHECK);
+    uint32_t interval = ext4_le32(sb, EXT4_SB_CHECKINTERVAL);
+    time_t now = time(NULL);
+    if (interval > 0 && now >= lastcheck && (uint64_t)now - lastcheck >= interval) {
+        return "check interval reached";
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    uc_init(argv[0]);
+    unsigned max_mounts = 30;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        if (opt != 'm') {
+            return 2;
+        }
+        max_mounts = strtoul(optarg, NULL, 10);
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: %s [-m MOUNTS] DEVICE\n", uc_program);
+        return 2;
+    }
+    const char* device = argv[optind];
+
+    unsigned char sb[EXT4_SB_SIZE];
+    int fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("check: cannot read the superblock: %m\n");
+        return 1;
+    }
+    ssize_t n = pread(fd, sb, sizeof sb, EXT4_SB_OFFSET);
+    if (n != sizeof sb) {
+        if (n < 0) {
+            printf("check: cannot read the superblock: %m\n");
+        } else {
+            printf("check: cannot read the superblock: short read\n");
+        }
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    char buf[64];
+    const char* reason = ext4_check_reason(sb, max_mounts, buf, sizeof buf);
+    if (reason != NULL) {
+        printf("check: %s\n", reason);
+        return 1;
+    }
+    printf("clean\n");
+    return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Write a boot image to a partition, for flash_kernel() in
+// bootloader-script.
+//
+// usage: flash-kernel IMAGE PARTITION
+//
+// The partition is read a chunk at a time and only the 4 KiB blocks that
+// differ from IMAGE are written, so flashing the same kernel again writes
+// nothing and eMMC wears less. The partition is accessed with O_DIRECT,
+// bypassing the page cache, when it supports that. Once the writes are
+// synced the image is read back and its CRC-32 compared to the one of
+// IMAGE; the exit status is unsuccessful if they differ.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+enum {
+    FK_CHUNK = 1 << 20,
+    FK_BLOCK = 4096,
+};
+
+struct fk_partition {
+    const char* path;
+    int fd;
+    bool direct;
+    // Size of the partition and of its logical blocks, which O_DIRECT
+    // lengths and offsets are multiples of.
+    off_t size;
+    size_t sector;
+};
+
+static size_t fk_round_up(size_t n, size_t multiple)
+{
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+static int fk_open(struct fk_partition* part, bool direct)
+{
+    if (part->fd >= 0) {
+        close(part->fd);
+    }
+    part->direct = direct;
+    part->fd = open(part->path, O_RDWR | O_CLOEXEC | (direct ? O_DIRECT : 0));
+    if (part->fd < 0 && direct && errno == EINVAL) {
+        return fk_open(part, false);
+    }
+    if (part->fd < 0) {
+        uc_logf("cannot open %s: %m\n", part->path);
+        return -1;
+    }
+    return 0;
+}
+
+// Read, switching to buffered I/O when the partition rejects direct I/O.
+static ssize_t fk_read(struct fk_partition* part, void* buf, size_t size, off_t offset)
+{
+    ssize_t n = pread(part->fd, buf, size, offset);
+    if (n < 0 && errno == EINVAL && part->direct) {
+        if (fk_open(part, false) < 0) {
+            return -1;
+        }
+        n = pread(part->fd, buf, size, offset);
+    }
+    return n;
+}
+
+static int fk_read_full(struct fk_partition* part, void* buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = fk_read(part, (char*)buf + done, size - done, offset + done);
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            uc_logf("cannot read %s: %m\n", part->path);
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int fk_write_full(struct fk_partition* part, const void* buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(part->fd, (const char*)buf + done, size - done, offset + done);
+        if (n < 0) {
+            uc_logf("cannot write %s: %m\n", part->path);
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int fk_read_image(int fd, const char* path, void* buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, (char*)buf + done, size - done, offset + done);
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            uc_logf("cannot read %s: %m\n", path);
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    uc_init(argv[0]);
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s IMAGE PARTITION\n", uc_program);
+        return 1;
+    }
+    const char* image = argv[1];
+    struct fk_partition part = { .path = argv[2], .fd = -1, .sector = 512 };
+
+    int image_fd = open(image, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (image_fd < 0 || fstat(image_fd, &st) < 0) {
+        uc_dief("cannot open %s: %m\n", image);
+    }
+    if (fk_open(&part, true) < 0) {
+        return 1;
+    }
+    struct stat part_st;
+    if (fstat(part.fd, &part_st) < 0) {
+        uc_dief("cannot stat %s: %m\n", part.path);
+    }
+    part.size = part_st.st_size;
+    if (S_ISBLK(part_st.st_mode)) {
+        uint64_t size;
+        int sector;
+        if (ioctl(part.fd, BLKGETSIZE64, &size) < 0) {
+            uc_dief("cannot get the size of %s: %m\n", part.path);
+        }
+        part.size = size;
+        if (ioctl(part.fd, BLKSSZGET, &sector) == 0 && sector > 0 && sector <= FK_BLOCK) {
+            part.sector = sector;
+        }
+    }
+    if (st.st_size > part.size) {
+        uc_dief("%s does not fit in %s\n", image, part.path);
+    }
+    // A regular file may end mid sector, right after the image.
+    if ((off_t)fk_round_up(st.st_size, part.sector) > part.size) {
+        part.sector = 1;
+        if (fk_open(&part, false) < 0) {
+            return 1;
+        }
+    }
+
+    void* part_buf;
+    void* image_buf;
+    if (posix_memalign(&part_buf, FK_BLOCK, FK_CHUNK) != 0 || posix_memalign(&image_buf, FK_BLOCK, FK_CHUNK) != 0) {
+        uc_dief("cannot allocate memory\n");
+    }
+    uint32_t crc = 0;
+    size_t blocks = 0;
+    size_t written = 0;
+    for (off_t offset = 0; offset < st.st_size; offset += FK_CHUNK) {
+        size_t len = st.st_size - offset < FK_CHUNK ? st.st_size - offset : FK_CHUNK;
+        // Whole sectors are read and written, the bytes past the image are
+        // written back as they were.
+        size_t io_len = fk_round_up(len, part.sector);
+        if (fk_read_image(image_fd, image, image_buf, len, offset) < 0
+            || fk_read_full(&part, part_buf, io_len, offset) < 0) {
+            return 1;
+        }
+        crc = uc_crc32(crc, image_buf, len);
+        // Write each run of blocks that differ with one write.
+        size_t run = 0;
+        bool in_run = false;
+        for (size_t block = 0; block <= len; block += FK_BLOCK) {
+            size_t block_len = block < len ? (len - block < FK_BLOCK ? len - block : FK_BLOCK) : 0;
+            bool differs = block_len > 0 && memcmp((char*)part_buf + block, (char*)image_buf + block, block_len) != 0;
+            if (block_len > 0) {
+                blocks++;
+            }
+            if (differs) {
+                memcpy((char*)part_buf + block, (char*)image_buf + block, block_len);
+                written++;
+                if (!in_run) {
+                    run = block;
+                    in_run = true;
+                }
+                continue;
+            }
+            if (in_run) {
+                if (fk_write_full(&part, (char*)part_buf + run, block - run, offset + run) < 0) {
+                    return 1;
+                }
+                in_run = false;
+            }
+        }
+        if (in_run && fk_write_full(&part, (char*)part_buf + run, io_len - run, offset + run) < 0) {
+            return 1;
+        }
+    }
+    if (fdatasync(part.fd) < 0) {
+        uc_dief("cannot sync %s: %m\n", part.path);
+    }
+    uc_logf("wrote %zu of %zu blocks to %s\n", written, blocks, part.path);
+
+    // Read back what the partition holds now, not what the page cache
+    // remembers.
+    if (!part.direct) {
+        posix_fadvise(part.fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    uint32_t part_crc = 0;
+    for (off_t offset = 0; offset < st.st_size; offset += FK_CHUNK) {
+        size_t len = st.st_size - offset < FK_CHUNK ? st.st_size - offset : FK_CHUNK;
+        if (fk_read_full(&part, part_buf, fk_round_up(len, part.sector), offset) < 0) {
+            return 1;
+        }
+        part_crc = uc_crc32(part_crc, part_buf, len);
+    }
+    if (part_crc != crc) {
+        uc_logf("%s does not match %s after flashing (crc32 %08x, expected %08x)\n", part.path, image, part_crc, crc);
+        return 1;
+    }
+    free(part_buf);
+    free(image_buf);
+    close(part.fd);
+    close(image_fd);
+    return 0;
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Mount snaps over tuned loop devices, for mount_snaps() in
+// ubuntu-core-rootfs.
+//
+// usage: mount-snap [-b | -p LIST] SNAP MOUNTPOINT [[-b | -p LIST] SNAP MOUNTPOINT]...
+//        mount-snap record [-w SECONDS] SNAP [LIST]
+//
+// Every snap is mounted read-only by a thread of its own, so the snaps are
+// set up at the same time. The loop devices are configured in one go with
+// LOOP_CONFIGURE: direct I/O, so that compressed blocks are not cached on
+// top of what squashfs caches decompressed, with a block size of 4 KiB and
+// read-ahead of one squashfs block. Either all snaps are mounted or none
+// is.
+//
+// With -p, the byte ranges of the snap listed in LIST are read ahead
+// before the snap is mounted, and the loop device uses the page cache so
+// that squashfs finds them there. With -b the loop device uses the page
+// cache without reading anything ahead, for a boot that records a list.
+//
+// "record" writes such a list for SNAP to stdout, or to LIST: the ranges
+// that are in the page cache. Direct I/O bypasses it, so only a boot that
+// mounted SNAP with -b or -p leaves something to record. With -w, it opens
+// SNAP and the directory of LIST right away, goes to the background and
+// records after SECONDS, so that the list covers what the system read
+// after the initramfs was gone. LIST is replaced in one go.
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/loop.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// LOOP_CONFIGURE is new in Linux 5.8, headers and kernels may predate it.
+#define MS_LOOP_CONFIGURE 0x4C0A
+
+struct ms_loop_config {
+    uint32_t fd;
+    uint32_t block_size;
+    struct loop_info64 info;
+    uint64_t reserved[8];
+};
+
+struct ms_snap {
+    const char* path;
+    const char* mountpoint;
+    const char* readahead_list;
+    bool buffered;
+    pthread_t thread;
+    bool started;
+    bool mounted;
+};
+
+// Offset of the block size in the squashfs superblock.
+#define MS_SQUASHFS_BLOCK_SIZE 12
+
+static void ms_readahead(struct ms_snap* snap, int fd)
+{
+    char* text = uc_read_file(snap->readahead_list, NULL);
+    if (text == NULL) {
+        uc_logf("cannot read %s: %m\n", snap->readahead_list);
+        return;
+    }
+    char* p = text;
+    for (;;) {
+        char* end;
+        unsigned long long offset = strtoull(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        p = end;
+        unsigned long long length = strtoull(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        p = end;
+        readahead(fd, offset, length);
+    }
+    free(text);
+}
+
+// Attach fd to a free loop device, whose path goes to dev, and get the open
+// device.
+static int ms_attach(struct ms_snap* snap, int fd, bool direct_io, uint32_t block_size, char* dev, size_t dev_size)
+{
+    int control_fd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (control_fd < 0) {
+        uc_logf("cannot open /dev/loop-control: %m\n");
+        return -1;
+    }
+    struct ms_loop_config config = {
+        .fd = fd,
+        .block_size = block_size,
+        .info = { .lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | (direct_io ? LO_FLAGS_DIRECT_IO : 0) },
+    };
+    snprintf((char*)config.info.lo_file_name, sizeof config.info.lo_file_name, "%s", snap->path);
+    // Other threads and processes race for free devices, try the next one
+    // when another one got it first.
+    for (int attempt = 0; attempt < 16; ++attempt) {
+        int n = ioctl(control_fd, LOOP_CTL_GET_FREE);
+        if (n < 0) {
+            uc_logf("cannot get a free loop device: %m\n");
+            break;
+        }
+        snprintf(dev, dev_size, "/dev/loop%d", n);
+        int loop_fd = open(dev, O_RDONLY | O_CLOEXEC);
+        if (loop_fd < 0) {
+            uc_logf("cannot open %s: %m\n", dev);
+            break;
+        }
+        if (ioctl(loop_fd, MS_LOOP_CONFIGURE, &config) == 0) {
+            close(control_fd);
+            return loop_fd;
+        }
+        if (errno == EBUSY) {
+            close(loop_fd);
+            continue;
+        }
+        if (errno != EINVAL && errno != ENOTTY) {
+            uc_logf("cannot configure %s: %m\n", dev);
+            close(loop_fd);
+            break;
+        }
+        // Kernels before 5.8 take the configuration one piece at a time.
+        if (ioctl(loop_fd, LOOP_SET_FD, fd) < 0) {
+            int err = errno;
+            close(loop_fd);
+            if (err == EBUSY) {
+                continue;
+            }
+            errno = err;
+            uc_logf("cannot attach %s to %s: %m\n", snap->path, dev);
+            break;
+        }
+        if (ioctl(loop_fd, LOOP_SET_STATUS64, &config.info) < 0) {
+            uc_logf("cannot set the status of %s: %m\n", dev);
+            ioctl(loop_fd, LOOP_CLR_FD, 0);
+            close(loop_fd);
+            break;
+        }
+        // Tuning is optional, older kernels lack these.
+        ioctl(loop_fd, LOOP_SET_BLOCK_SIZE, (unsigned long)block_size);
+        ioctl(loop_fd, LOOP_SET_DIRECT_IO, (unsigned long)direct_io);
+        close(control_fd);
+        return loop_fd;
+    }
+    close(control_fd);
+    return -1;
+}
+
+static void* ms_mount(void* arg)
+{
+    struct ms_snap* snap = arg;
+    int fd = open(snap->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        uc_logf("cannot open %s: %m\n", snap->path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    uint32_t squashfs_block_size = 0;
+    if (pread(fd, &squashfs_block_size, sizeof squashfs_block_size, MS_SQUASHFS_BLOCK_SIZE) != sizeof squashfs_block_size) {
+        squashfs_block_size = 0;
+    }
+    squashfs_block_size = le32toh(squashfs_block_size);
+    if (snap->readahead_list != NULL) {
+        ms_readahead(snap, fd);
+    }
+    // Snaps are padded to 4 KiB, anything else would lose its tail.
+    uint32_t block_size = st.st_size % 4096 == 0 ? 4096 : 512;
+    char dev[32];
+    int loop_fd = ms_attach(snap, fd, !snap->buffered && snap->readahead_list == NULL, block_size, dev, sizeof dev);
+    close(fd);
+    if (loop_fd < 0) {
+        return NULL;
+    }
+    if (squashfs_block_size >= 4096 && squashfs_block_size <= (1 << 20)) {
+        ioctl(loop_fd, BLKRASET, (unsigned long)(squashfs_block_size / 512));
+    }
+    if (mount(dev, snap->mountpoint, "squashfs", MS_RDONLY, NULL) < 0) {
+        uc_logf("cannot mount %s at %s: %m\n", snap->path, snap->mountpoint);
+    } else {
+        snap->mounted = true;
+    }
+    // The mount keeps the device, which goes away with the mount.
+    close(loop_fd);
+    return NULL;
+}
+
+// Write the ranges of the open snap fd at path that are in the page cache to
+// out.
+static int ms_record_ranges(int fd, const char* path, FILE* out)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        uc_logf("cannot stat %s: %m\n", path);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (st.st_size + page - 1) / page;
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char* resident = malloc(pages);
+    if (map == MAP_FAILED || resident == NULL || mincore(map, st.st_size, resident) < 0) {
+        uc_logf("cannot get the cached pages of %s: %m\n", path);
+        free(resident);
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+        return 1;
+    }
+    for (size_t i = 0; i < pages;) {
+        if (!(resident[i] & 1)) {
+            i++;
+            continue;
+        }
+        size_t first = i;
+        while (i < pages && (resident[i] & 1)) {
+            i++;
+        }
+        fprintf(out, "%ju %ju\n", (uintmax_t)first * page, (uintmax_t)(i - first) * page);
+    }
+    free(resident);
+    munmap(map, st.st_size);
+    return 0;
+}
+
+static int ms_record(const char* path, const char* list, unsigned wait)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        uc_logf("cannot open %s: %m\n", path);
+        return 1;
+    }
+    if (list == NULL) {
+        int result = ms_record_ranges(fd, path, stdout);
+        close(fd);
+        return result;
+    }
+    // The list is written next to its final name and renamed over it, in
+    // a directory that is opened now: the initramfs may be gone when the
+    // list is written, along with the paths.
+    char* dir = uc_strdupf("%s", list);
+    char* slash = strrchr(dir, '/');
+    const char* name = slash != NULL ? slash + 1 : list;
+    if (slash != NULL) {
+        *slash = '\0';
+    }
+    int dir_fd = open(slash == NULL ? "." : slash == dir ? "/" : dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        uc_logf("cannot open the directory of %s: %m\n", list);
+        free(dir);
+        close(fd);
+        return 1;
+    }
+    if (wait > 0) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            uc_logf("cannot fork: %m\n");
+        }
+        if (pid != 0) {
+            free(dir);
+            close(dir_fd);
+            close(fd);
+            return pid < 0 ? 1 : 0;
+        }
+        setsid();
+        if (chdir("/") < 0) {
+            _exit(1);
+        }
+        sleep(wait);
+    }
+    char* tmp = uc_strdupf(".%s.tmp", name);
+    int result = 1;
+    int out_fd = openat(dir_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE* out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (out == NULL) {
+        uc_logf("cannot create %s: %m\n", list);
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+    } else {
+        bool ok = ms_record_ranges(fd, path, out) == 0;
+        ok = fflush(out) == 0 && fsync(out_fd) == 0 && ok;
+        ok = fclose(out) == 0 && ok;
+        if (ok && renameat(dir_fd, tmp, dir_fd, name) == 0) {
+            result = 0;
+        } else {
+            uc_logf("cannot write %s: %m\n", list);
+            unlinkat(dir_fd, tmp, 0);
+        }
+    }
+    free(tmp);
+    free(dir);
+    close(dir_fd);
+    close(fd);
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    uc_init(argv[0]);
+    if (argc >= 3 && strcmp(argv[1], "record") == 0) {
+        unsigned wait = 0;
+        int i = 2;
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            wait = strtoul(argv[i + 1], NULL, 10);
+            i += 2;
+        }
+        // Waiting is only for writing a list.
+        if ((argc - i == 1 && wait == 0) || argc - i == 2) {
+            return ms_record(argv[i], argc - i == 2 ? argv[i + 1] : NULL, wait);
+        }
+        fprintf(stderr, "usage: %s record [-w SECONDS] SNAP [LIST]\n", uc_program);
+        return 1;
+    }
+    struct ms_snap* snaps = calloc(argc, sizeof *snaps);
+    if (snaps == NULL) {
+        uc_dief("cannot allocate memory\n");
+    }
+    size_t n = 0;
+    for (int i = 1; i < argc;) {
+        const char* list = NULL;
+        bool buffered = false;
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            list = argv[i + 1];
+            i += 2;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            buffered = true;
+            i++;
+        }
+        if (i + 1 >= argc) {
+            n = 0;
+            break;
+        }
+        snaps[n++] = (struct ms_snap) { .path = argv[i], .mountpoint = argv[i + 1], .readahead_list = list, .buffered = buffered };
+        i += 2;
+    }
+    if (n == 0) {
+        fprintf(stderr, "usage: %s [-b | -p LIST] SNAP MOUNTPOINT [[-b | -p LIST] SNAP MOUNTPOINT]...\n       %s record [-w SECONDS] SNAP [LIST]\n", uc_program, uc_program);
+        return 1;
+    }
+
+    for (size_t i = 1; i < n; ++i) {
+        snaps[i].started = pthread_create(&snaps[i].thread, NULL, ms_mount, &snaps[i]) == 0;
+        if (!snaps[i].started) {
+            ms_mount(&snaps[i]);
+        }
+    }
+    ms_mount(&snaps[0]);
+    bool all_mounted = snaps[0].mounted;
+    for (size_t i = 1; i < n; ++i) {
+        if (snaps[i].started) {
+            pthread_join(snaps[i].thread, NULL);
+        }
+        all_mounted = all_mounted && snaps[i].mounted;
+    }
+    if (!all_mounted) {
+        for (size_t i = 0; i < n; ++i) {
+            if (snaps[i].mounted && umount(snaps[i].mountpoint) < 0) {
+                uc_logf("cannot unmount %s: %m\n", snaps[i].mountpoint);
+            }
+        }
+    }
+    free(snaps);
+    return all_mounted ? 0 : 1;
+}
@@ -0,0 +1,492 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Grow the writable partition and its filesystem, for the resize script
+// and mountroot() in ubuntu-core-rootfs.
+//
+// usage: resize-writable part DEVICE PARTITION
+//        resize-writable fs MOUNTPOINT
+//
+// "part" grows partition number PARTITION of the disk DEVICE over the free
+// space that follows it, when that is more than a tenth of the disk. It
+// reads and rewrites the GPT or MBR partition table in one pass, moving
+// the backup GPT to the end of the disk, and tells the kernel about the
+// new size of the partition with BLKPG, so nothing has to wait for udev.
+// It exits with 0 when the partition was grown, 2 when there was nothing
+// to do and 1 on errors before anything was written, also when the table
+// isn't one it understands. It exits with 3 when writing the new table
+// started but failed, or the table could not be synced or the kernel not
+// told about it: the table on disk may be new in part or in full, so it
+// must not be grown again then, only reread.
+//
+// "fs" grows the ext4 filesystem mounted at MOUNTPOINT to the size of its
+// partition, online, from a background process. It returns right away, and
+// does nothing when the filesystem fills its partition already, so it runs
+// on every boot.
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/blkpg.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// Not in the headers of the kernel for user space.
+#define EXT4_IOC_RESIZE_FS _IOW('f', 16, uint64_t)
+
+struct rw_disk {
+    int fd;
+    const char* path;
+    bool is_block;
+    uint64_t sector_size;
+    uint64_t sectors;
+};
+
+static int rw_read_at(struct rw_disk* disk, void* buf, size_t size, uint64_t sector)
+{
+    ssize_t n = pread(disk->fd, buf, size, sector * disk->sector_size);
+    if (n != (ssize_t)size) {
+        uc_logf("cannot read sector %ju of %s: %s\n", (uintmax_t)sector, disk->path, n < 0 ? strerror(errno) : "short read");
+        return -1;
+    }
+    return 0;
+}
+
+static int rw_write_at(struct rw_disk* disk, const void* buf, size_t size, uint64_t sector)
+{
+    ssize_t n = pwrite(disk->fd, buf, size, sector * disk->sector_size);
+    if (n != (ssize_t)size) {
+        uc_logf("cannot write sector %ju of %s: %s\n", (uintmax_t)sector, disk->path, n < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t rw_le32(const unsigned char* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof value);
+    return le32toh(value);
+}
+
+static uint64_t rw_le64(const unsigned char* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof value);
+    return le64toh(value);
+}
+
+static void rw_put_le32(unsigned char* p, uint32_t value)
+{
+    value = htole32(value);
+    memcpy(p, &value, sizeof value);
+}
+
+static void rw_put_le64(unsigned char* p, uint64_t value)
+{
+    value = htole64(value);
+    memcpy(p, &value, sizeof value);
+}
+
+// Offsets in the MBR and in a GPT header and entry, see the UEFI
+// specification.
+enum {
+    MBR_ENTRIES = 446,
+    MBR_ENTRY_SIZE = 16,
+    MBR_ENTRY_TYPE = 4,
+    MBR_ENTRY_CHS_END = 5,
+    MBR_ENTRY_START = 8,
+    MBR_ENTRY_SECTORS = 12,
+    MBR_SIGNATURE = 510,
+    MBR_TYPE_EXTENDED = 0x05,
+    MBR_TYPE_EXTENDED_LBA = 0x0f,
+    MBR_TYPE_PROTECTIVE = 0xee,
+    GPT_HEADER_SIZE = 12,
+    GPT_HEADER_CRC = 16,
+    GPT_MY_LBA = 24,
+    GPT_ALTERNATE_LBA = 32,
+    GPT_FIRST_USABLE = 40,
+    GPT_LAST_USABLE = 48,
+    GPT_ENTRIES_LBA = 72,
+    GPT_NUM_ENTRIES = 80,
+    GPT_ENTRY_SIZE = 84,
+    GPT_ENTRIES_CRC = 88,
+    GPT_ENTRY_FIRST_LBA = 32,
+    GPT_ENTRY_LAST_LBA = 40,
+};
+
+// Get the end of the free space that follows the partition starting at
+// start, up to limit: the sector before the next partition.
+static uint64_t rw_free_end(const uint64_t* starts, size_t n, uint64_t start, uint64_t limit)
+{
+    uint64_t end = limit;
+    for (size_t i = 0; i < n; ++i) {
+        if (starts[i] > start && starts[i] - 1 < end) {
+            end = starts[i] - 1;
+        }
+    }
+    return end;
+}
+
+// Get whether growing the partition is worth it: more than a tenth of the
+// disk must be free after it, as the resize script wants.
+static bool rw_worth_growing(struct rw_disk* disk, uint64_t last, uint64_t new_last)
+{
+    return new_last > last && new_last - last > disk->sectors / 10;
+}
+
+static uint32_t rw_gpt_header_crc(unsigned char* header)
+{
+    uint32_t size = rw_le32(header + GPT_HEADER_SIZE);
+    rw_put_le32(header + GPT_HEADER_CRC, 0);
+    return uc_crc32(0, header, size);
+}
+
+static int rw_grow_gpt(struct rw_disk* disk, unsigned partition, uint64_t* start, uint64_t* length)
+{
+    size_t ss = disk->sector_size;
+    unsigned char* header = malloc(ss);
+    unsigned char* backup = malloc(ss);
+    if (header == NULL || backup == NULL) {
+        uc_dief("cannot allocate memory\n");
+    }
+    int result = 1;
+    unsigned char* entries = NULL;
+    if (rw_read_at(disk, header, ss, 1) < 0) {
+        goto out;
+    }
+    uint32_t header_size = rw_le32(header + GPT_HEADER_SIZE);
+    if (memcmp(header, "EFI PART", 8) != 0 || header_size < 92 || header_size > ss) {
+        uc_logf("no GPT header on %s\n", disk->path);
+        goto out;
+    }
+    uint32_t header_crc = rw_le32(header + GPT_HEADER_CRC);
+    if (rw_gpt_header_crc(header) != header_crc) {
+        uc_logf("bad checksum of the GPT header of %s\n", disk->path);
+        goto out;
+    }
+    uint32_t num_entries = rw_le32(header + GPT_NUM_ENTRIES);
+    uint32_t entry_size = rw_le32(header + GPT_ENTRY_SIZE);
+    if (entry_size < 128 || num_entries == 0 || num_entries > 1024 || partition == 0 || partition > num_entries) {
+        uc_logf("unsupported GPT on %s\n", disk->path);
+        goto out;
+    }
+    size_t entries_len = (size_t)num_entries * entry_size;
+    uint64_t entries_sectors = (entries_len + ss - 1) / ss;
+    entries = calloc(entries_sectors, ss);
+    if (entries == NULL) {
+        uc_dief("cannot allocate memory\n");
+    }
+    if (rw_read_at(disk, entries, entries_sectors * ss, rw_le64(header + GPT_ENTRIES_LBA)) < 0) {
+        goto out;
+    }
+    if (uc_crc32(0, entries, entries_len) != rw_le32(header + GPT_ENTRIES_CRC)) {
+        uc_logf("bad checksum of the GPT entries of %s\n", disk->path);
+        goto out;
+    }
+
+    unsigned char* entry = entries + (size_t)(partition - 1) * entry_size;
+    uint64_t first = rw_le64(entry + GPT_ENTRY_FIRST_LBA);
+    uint64_t last = rw_le64(entry + GPT_ENTRY_LAST_LBA);
+    if (first == 0 || last < first) {
+        uc_logf("no partition %u on %s\n", partition, disk->path);
+        goto out;
+    }
+    // The backup entries and header go to the very end of the disk, which
+    // may have been made larger than the image that was flashed on it.
+    uint64_t backup_lba = disk->sectors - 1;
+    uint64_t backup_entries_lba = backup_lba - entries_sectors;
+    uint64_t last_usable = backup_entries_lba - 1;
+    uint64_t* starts = calloc(num_entries, sizeof *starts);
+    if (starts == NULL) {
+        uc_dief("cannot allocate memory\n");
+    }
+    for (uint32_t i = 0; i < num_entries; ++i) {
+        starts[i] = rw_le64(entries + (size_t)i * entry_size + GPT_ENTRY_FIRST_LBA);
+    }
+    uint64_t new_last = rw_free_end(starts, num_entries, first, last_usable);
+    free(starts);
+    if (!rw_worth_growing(disk, last, new_last)) {
+        result = 2;
+        goto out;
+    }
+
+    rw_put_le64(entry + GPT_ENTRY_LAST_LBA, new_last);
+    uint32_t entries_crc = uc_crc32(0, entries, entries_len);
+    rw_put_le64(header + GPT_ALTERNATE_LBA, backup_lba);
+    rw_put_le64(header + GPT_LAST_USABLE, last_usable);
+    rw_put_le32(header + GPT_ENTRIES_CRC, entries_crc);
+    rw_put_le32(header + GPT_HEADER_CRC, rw_gpt_header_crc(header));
+    memcpy(backup, header, ss);
+    rw_put_le64(backup + GPT_MY_LBA, backup_lba);
+    rw_put_le64(backup + GPT_ALTERNATE_LBA, 1);
+    rw_put_le64(backup + GPT_ENTRIES_LBA, backup_entries_lba);
+    rw_put_le32(backup + GPT_HEADER_CRC, rw_gpt_header_crc(backup));
+
+    // Write the backup first, so that there is always one valid table.
+    // Once writing started, the table may be new in part.
+    result = 3;
+    if (rw_write_at(disk, entries, entries_sectors * ss, backup_entries_lba) < 0
+        || rw_write_at(disk, backup, ss, backup_lba) < 0
+        || fdatasync(disk->fd) < 0
+        || rw_write_at(disk, entries, entries_sectors * ss, rw_le64(header + GPT_ENTRIES_LBA)) < 0
+        || rw_write_at(disk, header, ss, 1) < 0) {
+        goto out;
+    }
+    // Make the protective MBR cover the whole disk again.
+    unsigned char mbr[512];
+    if (rw_read_at(disk, mbr, sizeof mbr, 0) == 0 && mbr[MBR_ENTRIES + MBR_ENTRY_TYPE] == MBR_TYPE_PROTECTIVE) {
+        uint64_t sectors = disk->sectors - 1;
+        rw_put_le32(mbr + MBR_ENTRIES + MBR_ENTRY_SECTORS, sectors > UINT32_MAX ? UINT32_MAX : sectors);
+        // The GPT is complete without it, parted fixes it on request.
+        if (rw_write_at(disk, mbr, sizeof mbr, 0) < 0) {
+            uc_logf("cannot grow the protective MBR of %s, the GPT is grown anyway\n", disk->path);
+        }
+    }
+    printf("grew GPT partition %u of %s from %ju to %ju sectors\n", partition, disk->path, (uintmax_t)(last - first + 1), (uintmax_t)(new_last - first + 1));
+    *start = first;
+    *length = new_last - first + 1;
+    result = 0;
+out:
+    free(entries);
+    free(backup);
+    free(header);
+    return result;
+}
+
+static int rw_grow_mbr(struct rw_disk* disk, unsigned char* mbr, unsigned partition, uint64_t* start, uint64_t* length)
+{
+    // Logical partitions would need the chain of extended boot records.
+    if (partition < 1 || partition > 4) {
+        uc_logf("cannot grow logical partition %u of %s\n", partition, disk->path);
+        return 1;
+    }
+    unsigned char* entry = mbr + MBR_ENTRIES + (partition - 1) * MBR_ENTRY_SIZE;
+    uint64_t first = rw_le32(entry + MBR_ENTRY_START);
+    uint64_t sectors = rw_le32(entry + MBR_ENTRY_SECTORS);
+    if (first == 0 || sectors == 0 || entry[MBR_ENTRY_TYPE] == MBR_TYPE_EXTENDED || entry[MBR_ENTRY_TYPE] == MBR_TYPE_EXTENDED_LBA) {
+        uc_logf("no primary partition %u on %s\n", partition, disk->path);
+        return 1;
+    }
+    uint64_t starts[4];
+    for (int i = 0; i < 4; ++i) {
+        starts[i] = rw_le32(mbr + MBR_ENTRIES + i * MBR_ENTRY_SIZE + MBR_ENTRY_START);
+    }
+    // The MBR cannot describe sectors past 2 TiB (of 512 byte sectors).
+    uint64_t limit = disk->sectors - 1;
+    if (limit > (uint64_t)UINT32_MAX) {
+        limit = UINT32_MAX;
+    }
+    uint64_t last = first + sectors - 1;
+    uint64_t new_last = rw_free_end(starts, 4, first, limit);
+    if (new_last - first + 1 > UINT32_MAX) {
+        new_last = first + UINT32_MAX - 1;
+    }
+    if (!rw_worth_growing(disk, last, new_last)) {
+        return 2;
+    }
+    rw_put_le32(entry + MBR_ENTRY_SECTORS, new_last - first + 1);
+    // The end is past what CHS addresses can tell, like parted marks it.
+    memcpy(entry + MBR_ENTRY_CHS_END, "\xfe\xff\xff", 3);
+    if (rw_write_at(disk, mbr, 512, 0) < 0) {
+        return 3;
+    }
+    printf("grew MBR partition %u of %s from %ju to %ju sectors\n", partition, disk->path, (uintmax_t)sectors, (uintmax_t)(new_last - first + 1));
+    *start = first;
+    *length = new_last - first + 1;
+    return 0;
+}
+
+static int rw_part(const char* path, unsigned partition)
+{
+    struct rw_disk disk = { .path = path, .sector_size = 512 };
+    disk.fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (disk.fd < 0 || fstat(disk.fd, &st) < 0) {
+        uc_logf("cannot open %s: %m\n", path);
+        return 1;
+    }
+    disk.is_block = S_ISBLK(st.st_mode);
+    uint64_t bytes = st.st_size;
+    if (disk.is_block) {
+        int sector_size;
+        if (ioctl(disk.fd, BLKSSZGET, &sector_size) < 0 || ioctl(disk.fd, BLKGETSIZE64, &bytes) < 0) {
+            uc_logf("cannot get the size of %s: %m\n", path);
+            return 1;
+        }
+        disk.sector_size = sector_size;
+    }
+    disk.sectors = bytes / disk.sector_size;
+    if (disk.sectors < 64 || disk.sector_size < 512) {
+        uc_logf("%s is too small\n", path);
+        return 1;
+    }
+
+    unsigned char mbr[512];
+    if (rw_read_at(&disk, mbr, sizeof mbr, 0) < 0) {
+        return 1;
+    }
+    if (mbr[MBR_SIGNATURE] != 0x55 || mbr[MBR_SIGNATURE + 1] != 0xaa) {
+        uc_logf("no partition table on %s\n", path);
+        return 1;
+    }
+    uint64_t start = 0, length = 0;
+    int result;
+    if (mbr[MBR_ENTRIES + MBR_ENTRY_TYPE] == MBR_TYPE_PROTECTIVE) {
+        result = rw_grow_gpt(&disk, partition, &start, &length);
+    } else {
+        result = rw_grow_mbr(&disk, mbr, partition, &start, &length);
+    }
+    if (result == 0 && fsync(disk.fd) < 0) {
+        uc_logf("cannot sync %s: %m\n", path);
+        result = 3;
+    }
+    // Tell the kernel about the new size without rereading the whole table,
+    // which fails while other partitions of the disk are in use.
+    if (result == 0 && disk.is_block) {
+        struct blkpg_partition part = {
+            .start = start * disk.sector_size,
+            .length = length * disk.sector_size,
+            .pno = partition,
+        };
+        struct blkpg_ioctl_arg arg = {
+            .op = BLKPG_RESIZE_PARTITION,
+            .datalen = sizeof part,
+            .data = &part,
+        };
+        if (ioctl(disk.fd, BLKPG, &arg) < 0) {
+            uc_logf("cannot resize partition %u of %s in the kernel: %m\n", partition, path);
+            result = 3;
+        }
+    }
+    close(disk.fd);
+    return result;
+}
+
+// Where the ext4 superblock of a device is, and what of it tells its size.
+#define EXT4_SB_OFFSET 1024
+#define EXT4_SB_BLOCKS_COUNT_LO 0x4
+#define EXT4_SB_FEATURE_INCOMPAT 0x60
+#define EXT4_SB_BLOCKS_COUNT_HI 0x150
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x80
+
+// Get the number of blocks of the ext4 filesystem on the device dev, which
+// statfs() leaves out, or 0 when its superblock cannot be read.
+static uint64_t rw_fs_blocks(dev_t dev)
+{
+    char* path = uc_strdupf("/dev/block/%u:%u", major(dev), minor(dev));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0) {
+        return 0;
+    }
+    unsigned char sb[0x158];
+    ssize_t n = pread(fd, sb, sizeof sb, EXT4_SB_OFFSET);
+    close(fd);
+    if (n != sizeof sb) {
+        return 0;
+    }
+    uint64_t blocks = rw_le32(sb + EXT4_SB_BLOCKS_COUNT_LO);
+    if (rw_le32(sb + EXT4_SB_FEATURE_INCOMPAT) & EXT4_FEATURE_INCOMPAT_64BIT) {
+        blocks |= (uint64_t)rw_le32(sb + EXT4_SB_BLOCKS_COUNT_HI) << 32;
+    }
+    return blocks;
+}
+
+static int rw_fs(const char* mountpoint)
+{
+    int fd = open(mountpoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    struct statfs sfs;
+    if (fd < 0 || fstat(fd, &st) < 0 || fstatfs(fd, &sfs) < 0) {
+        uc_logf("cannot open %s: %m\n", mountpoint);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    char* size_path = uc_strdupf("/sys/dev/block/%u:%u/size", major(st.st_dev), minor(st.st_dev));
+    char* size_text = uc_read_file(size_path, NULL);
+    if (size_text == NULL) {
+        uc_logf("cannot read %s: %m\n", size_path);
+        free(size_path);
+        close(fd);
+        return 1;
+    }
+    // The size in sysfs is in 512 byte sectors, whatever the device uses.
+    uint64_t blocks = strtoull(size_text, NULL, 10) * 512 / sfs.f_bsize;
+    free(size_text);
+    free(size_path);
+    // The size statfs() tells leaves out the metadata, the superblock has
+    // the real one. Either way growing is a no-op for the kernel.
+    uint64_t fs_blocks = rw_fs_blocks(st.st_dev);
+    if (blocks <= (fs_blocks != 0 ? fs_blocks : (uint64_t)sfs.f_blocks)) {
+        close(fd);
+        return 0;
+    }
+
+    // Go to the background, the kernel grows the filesystem while it is
+    // in use and boot goes on meanwhile. The open directory keeps working
+    // when the mount is moved to its final place.
+    pid_t pid = fork();
+    if (pid < 0) {
+        uc_logf("cannot fork: %m\n");
+        close(fd);
+        return 1;
+    }
+    if (pid > 0) {
+        close(fd);
+        return 0;
+    }
+    setsid();
+    if (chdir("/") < 0) {
+        _exit(1);
+    }
+    printf("growing %s to %ju blocks of %ju bytes\n", mountpoint, (uintmax_t)blocks, (uintmax_t)sfs.f_bsize);
+    fflush(stdout);
+    if (ioctl(fd, EXT4_IOC_RESIZE_FS, &blocks) < 0) {
+        uc_logf("cannot grow %s: %m\n", mountpoint);
+        exit(1);
+    }
+    printf("grew %s to %ju blocks\n", mountpoint, (uintmax_t)blocks);
+    exit(0);
+}
+
+int main(int argc, char** argv)
+{
+    uc_init(argv[0]);
+    if (argc == 4 && strcmp(argv[1], "part") == 0) {
+        return rw_part(argv[2], strtoul(argv[3], NULL, 10));
+    }
+    if (argc == 3 && strcmp(argv[1], "fs") == 0) {
+        return rw_fs(argv[2]);
+    }
+    fprintf(stderr, "usage: %s part DEVICE PARTITION\n       %s fs MOUNTPOINT\n", uc_program, uc_program);
+    return 1;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Make what the boot scripts wrote durable without a global sync, for
+// sync_path() in ubuntu-core-functions.
+//
+// usage: sync-path [-f|-p] PATH...
+//
+// By default the data of each file or block device PATH is synced, with
+// fdatasync. With -f the whole filesystem that PATH is on is synced, with
+// syncfs. With -p the directory that PATH is in is synced, so that a file
+// created or renamed there is there after a crash too. Each PATH is synced
+// even when another one fails, the exit status tells whether all were.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "util.h"
+
+enum sp_mode {
+    SP_DATA,
+    SP_FILESYSTEM,
+    SP_PARENT,
+};
+
+static int sp_sync(const char* path, enum sp_mode mode)
+{
+    char* parent = NULL;
+    if (mode == SP_PARENT) {
+        char* copy = uc_strdupf("%s", path);
+        parent = uc_strdupf("%s", dirname(copy));
+        free(copy);
+        path = parent;
+    }
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC | (mode == SP_PARENT ? O_DIRECTORY : 0));
+    int rc = -1;
+    if (fd < 0) {
+        uc_logf("cannot open %s: %m\n", path);
+    } else {
+        switch (mode) {
+        case SP_DATA:
+            rc = fdatasync(fd);
+            break;
+        case SP_FILESYSTEM:
+            rc = syncfs(fd);
+            break;
+        case SP_PARENT:
+            rc = fsync(fd);
+            break;
+        }
+        if (rc < 0) {
+            uc_logf("cannot sync %s: %m\n", path);
+        }
+        close(fd);
+    }
+    free(parent);
+    return rc;
+}
+
+int main(int argc, char** argv)
+{
+    uc_init(argv[0]);
+    enum sp_mode mode = SP_DATA;
+    int opt;
+    while ((opt = getopt(argc, argv, "fp")) != -1) {
+        switch (opt) {
+        case 'f':
+            mode = SP_FILESYSTEM;
+            break;
+        case 'p':
+            mode = SP_PARENT;
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-f|-p] PATH...\n", uc_program);
+        return 1;
+    }
+    int status = 0;
+    for (int i = optind; i < argc; ++i) {
+        if (sp_sync(argv[i], mode) < 0) {
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "tree.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// A directory to copy, to sync or to merge. Directories made by the copy or
+// merged get the ownership, mode and times of their source once all of
+// their entries are done, since adding entries changes the times.
+struct uc_tree_job {
+    struct uc_tree_job* next;
+    struct uc_tree_job* parent;
+    char* src;
+    char* dst;
+    // The directory dst was just made and everything in src is copied.
+    bool fresh;
+    // Copy the attributes in st to dst once done.
+    bool attrs;
+    struct stat st;
+    // The job itself and its children that are not done yet.
+    unsigned pending;
+};
+
+struct uc_tree_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int src_dir_fd;
+    int dst_dir_fd;
+    // Entries that exist in both are merged like "cp -a" does rather than
+    // synced.
+    bool merge;
+    // Stack of jobs waiting for a thread. Taking the latest job first keeps
+    // the walk depth-first, so few jobs wait at a time.
+    struct uc_tree_job* jobs;
+    // Number of jobs waiting or running, threads quit once it drops to zero.
+    unsigned busy;
+    bool failed;
+};
+
+unsigned uc_tree_workers()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+static char* uc_tree_join(const char* dir, const char* name)
+{
+    return strcmp(dir, ".") == 0 ? uc_strdupf("%s", name) : uc_strdupf("%s/%s", dir, name);
+}
+
+static void uc_tree_fail(struct uc_tree_pool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->failed = true;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void uc_tree_push(struct uc_tree_pool* pool, struct uc_tree_job* parent, char* src, char* dst, bool fresh, const struct stat* st)
+{
+    struct uc_tree_job* job = calloc(1, sizeof *job);
+    if (job == NULL) {
+        uc_dief("cannot allocate memory\n");
+    }
+    job->parent = parent;
+    job->src = src;
+    job->dst = dst;
+    job->fresh = fresh;
+    if (st != NULL) {
+        job->attrs = true;
+        job->st = *st;
+    }
+    job->pending = 1;
+    pthread_mutex_lock(&pool->lock);
+    if (parent != NULL) {
+        parent->pending++;
+    }
+    job->next = pool->jobs;
+    pool->jobs = job;
+    pool->busy++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Drop a reference to the job, finishing it and its parents as they become
+// done.
+static void uc_tree_done(struct uc_tree_pool* pool, struct uc_tree_job* job)
+{
+    while (job != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        bool done = --job->pending == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (!done) {
+            return;
+        }
+        if (job->attrs) {
+            const struct stat* st = &job->st;
+            const struct timespec times[2] = { st->st_atim, st->st_mtim };
+            if (fchownat(pool->dst_dir_fd, job->dst, st->st_uid, st->st_gid, 0) < 0
+                || fchmodat(pool->dst_dir_fd, job->dst, st->st_mode & 07777, 0) < 0
+                || uc_copy_xattrs(pool->src_dir_fd, job->src, pool->dst_dir_fd, job->dst) < 0
+                || utimensat(pool->dst_dir_fd, job->dst, times, 0) < 0) {
+                uc_logf("cannot copy the attributes of %s to %s: %m\n", job->src, job->dst);
+                uc_tree_fail(pool);
+            }
+        }
+        struct uc_tree_job* parent = job->parent;
+        free(job->src);
+        free(job->dst);
+        free(job);
+        job = parent;
+    }
+}
+
+// Copy the entry name of the directory of job, which is missing in dst.
+static void uc_tree_copy_entry(struct uc_tree_pool* pool, struct uc_tree_job* job, int src_fd, int dst_fd, const char* name)
+{
+    struct stat st;
+    if (fstatat(src_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        uc_logf("cannot stat %s/%s: %m\n", job->src, name);
+        uc_tree_fail(pool);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (uc_copy_at(src_fd, name, dst_fd, name) < 0) {
+            uc_tree_fail(pool);
+        }
+        return;
+    }
+    if (mkdirat(dst_fd, name, 0700) < 0) {
+        uc_logf("cannot create directory %s/%s: %m\n", job->dst, name);
+        uc_tree_fail(pool);
+        return;
+    }
+    uc_tree_push(pool, job, uc_tree_join(job->src, name), uc_tree_join(job->dst, name), true, &st);
+}
+
+static bool uc_tree_same_file(const struct stat* a, const struct stat* b)
+{
+    return S_ISREG(a->st_mode) && S_ISREG(b->st_mode) && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec
+        && a->st_mode == b->st_mode && a->st_uid == b->st_uid && a->st_gid == b->st_gid;
+}
+
+// Merge the entry name of the directory of job, which exists in dst as
+// dst_st, like "cp -a" over an existing tree.
+static void uc_tree_merge_entry(struct uc_tree_pool* pool, struct uc_tree_job* job, int src_fd, int dst_fd, const char* name, const struct stat* dst_st)
+{
+    struct stat st;
+    if (fstatat(src_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        uc_logf("cannot stat %s/%s: %m\n", job->src, name);
+        uc_tree_fail(pool);
+        return;
+    }
+    if (S_ISDIR(st.st_mode) != S_ISDIR(dst_st->st_mode)) {
+        uc_logf("cannot overwrite %s/%s with %s/%s\n", job->dst, name, job->src, name);
+        uc_tree_fail(pool);
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        uc_tree_push(pool, job, uc_tree_join(job->src, name), uc_tree_join(job->dst, name), false, &st);
+        return;
+    }
+    // The attributes of a copy are set after its data, so a file that got
+    // them completed before an interruption.
+    if (uc_tree_same_file(&st, dst_st)) {
+        uc_copy_remember(&st, dst_fd, name);
+        return;
+    }
+    if (unlinkat(dst_fd, name, 0) < 0) {
+        uc_logf("cannot remove %s/%s: %m\n", job->dst, name);
+        uc_tree_fail(pool);
+        return;
+    }
+    if (uc_copy_at(src_fd, name, dst_fd, name) < 0) {
+        uc_tree_fail(pool);
+    }
+}
+
+static void uc_tree_run(struct uc_tree_pool* pool, struct uc_tree_job* job)
+{
+    int src_fd = openat(pool->src_dir_fd, job->src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int dst_fd = openat(pool->dst_dir_fd, job->dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = src_fd >= 0 && dst_fd >= 0 ? fdopendir(src_fd) : NULL;
+    if (dir == NULL) {
+        uc_logf("cannot open %s: %m\n", src_fd < 0 ? job->src : job->dst);
+        uc_tree_fail(pool);
+        if (src_fd >= 0) {
+            close(src_fd);
+        }
+    } else {
+        struct dirent* ent;
+        while ((ent = readdir(dir)) != NULL) {
+            const char* name = ent->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            if (job->fresh) {
+                uc_tree_copy_entry(pool, job, src_fd, dst_fd, name);
+                continue;
+            }
+            // Merging skips hidden entries of the top directory only, as
+            // the shell glob of handle_writable_defaults() does.
+            if (name[0] == '.' && (!pool->merge || job->parent == NULL)) {
+                continue;
+            }
+            struct stat st;
+            if (fstatat(dst_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                uc_tree_copy_entry(pool, job, src_fd, dst_fd, name);
+                continue;
+            }
+            if (pool->merge) {
+                uc_tree_merge_entry(pool, job, src_fd, dst_fd, name, &st);
+                continue;
+            }
+            // Files and links that exist in dst stay as they are.
+            if (fstatat(dst_fd, name, &st, 0) < 0 || !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+            if (fstatat(src_fd, name, &st, 0) < 0 || !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+            uc_tree_push(pool, job, uc_tree_join(job->src, name), uc_tree_join(job->dst, name), false, NULL);
+        }
+        closedir(dir);
+    }
+    if (dst_fd >= 0) {
+        close(dst_fd);
+    }
+    uc_tree_done(pool, job);
+}
+
+static void* uc_tree_worker(void* arg)
+{
+    struct uc_tree_pool* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->jobs == NULL && pool->busy > 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->jobs == NULL) {
+            break;
+        }
+        struct uc_tree_job* job = pool->jobs;
+        pool->jobs = job->next;
+        pthread_mutex_unlock(&pool->lock);
+        uc_tree_run(pool, job);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            pthread_cond_broadcast(&pool->cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int uc_tree_walk(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst, bool fresh, bool merge, const struct stat* st, unsigned workers)
+{
+    struct uc_tree_pool pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .src_dir_fd = src_dir_fd,
+        .dst_dir_fd = dst_dir_fd,
+        .merge = merge,
+    };
+    uc_tree_push(&pool, NULL, uc_strdupf("%s", src), uc_strdupf("%s", dst), fresh, st);
+    // The calling thread is one of the workers.
+    pthread_t threads[workers > 1 ? workers - 1 : 1];
+    unsigned n_threads = 0;
+    for (unsigned i = 1; i < workers; ++i) {
+        if (pthread_create(&threads[n_threads], NULL, uc_tree_worker, &pool) != 0) {
+            break;
+        }
+        n_threads++;
+    }
+    uc_tree_worker(&pool);
+    for (unsigned i = 0; i < n_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    // Hard links are kept within a tree, not across trees.
+    uc_copy_forget_links();
+    return pool.failed ? -1 : 0;
+}
+
+int uc_tree_copy(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst, unsigned workers)
+{
+    struct stat st;
+    if (fstatat(src_dir_fd, src, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        uc_logf("cannot stat %s: %m\n", src);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return uc_copy_at(src_dir_fd, src, dst_dir_fd, dst);
+    }
+    if (mkdirat(dst_dir_fd, dst, 0700) < 0) {
+        uc_logf("cannot create directory %s: %m\n", dst);
+        return -1;
+    }
+    return uc_tree_walk(src_dir_fd, src, dst_dir_fd, dst, true, false, &st, workers);
+}
+
+int uc_tree_sync(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst, unsigned workers)
+{
+    return uc_tree_walk(src_dir_fd, src, dst_dir_fd, dst, false, false, NULL, workers);
+}
+
+int uc_tree_merge(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst, unsigned workers)
+{
+    return uc_tree_walk(src_dir_fd, src, dst_dir_fd, dst, false, true, NULL, workers);
+}
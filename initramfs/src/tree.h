@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Copying of directory trees by a pool of threads. Each directory is a job
+// that any thread can pick up, so a large subtree is spread across all
+// cores instead of being walked by one. Paths are relative to the given
+// directory file descriptors, "." being the directory itself.
+
+#ifndef UC_TREE_H
+#define UC_TREE_H
+
+// Get the number of threads to copy trees with, one per online CPU.
+unsigned uc_tree_workers();
+
+// Copy src to dst, which must not exist, like "cp -a".
+int uc_tree_copy(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst, unsigned workers);
+
+// Copy the entries of the directory src that are missing in the directory
+// dst, going into the directories that exist in both, like sync_dirs() in
+// ubuntu-core-rootfs. Hidden entries of directories that exist in both are
+// skipped, as the shell glob of sync_dirs() does.
+int uc_tree_sync(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst, unsigned workers);
+
+// Copy the entries of the directory src into the directory dst, replacing
+// files and merging directories that exist in both, like "cp -a src/* dst"
+// (so hidden entries of src itself are skipped). Files that match their
+// source in size, modification time, mode and ownership are taken as
+// copied already, so merging again after an interruption picks up where it
+// stopped.
+int uc_tree_merge(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst, unsigned workers);
+
+#endif
@@ -0,0 +1,496 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+const char* uc_program = "ubuntu-core";
+
+void uc_init(const char* argv0)
+{
+    const char* slash = strrchr(argv0, '/');
+    uc_program = slash != NULL ? slash + 1 : argv0;
+}
+
+void uc_logf(const char* fmt, ...)
+{
+    fprintf(stderr, "%s: ", uc_program);
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void uc_dief(const char* fmt, ...)
+{
+    fprintf(stderr, "%s, fatal error: ", uc_program);
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(1);
+}
+
+char* uc_strdupf(const char* fmt, ...)
+{
+    char* str = NULL;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vasprintf(&str, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        uc_dief("cannot allocate memory\n");
+    }
+    return str;
+}
+
+const char* uc_relpath(const char* path)
+{
+    while (*path == '/') {
+        path++;
+    }
+    return *path != '\0' ? path : ".";
+}
+
+uint32_t uc_crc32(uint32_t crc, const void* buf, size_t size)
+{
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                c = (c >> 1) ^ (0xedb88320 & -(c & 1));
+            }
+            table[i] = c;
+        }
+    }
+    const unsigned char* p = buf;
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+char* uc_read_file(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    size_t cap = 4096, len = 0;
+    char* buf = malloc(cap);
+    for (;;) {
+        if (buf == NULL) {
+            uc_dief("cannot allocate memory\n");
+        }
+        ssize_t n = read(fd, buf + len, cap - len - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int err = errno;
+            free(buf);
+            close(fd);
+            errno = err;
+            return NULL;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+        if (cap - len == 1) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    close(fd);
+    buf[len] = '\0';
+    if (size != NULL) {
+        *size = len;
+    }
+    return buf;
+}
+
+int uc_write_all(int fd, const void* buf, size_t size)
+{
+    const char* p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int uc_mkdir_p_at(int dir_fd, const char* path, mode_t mode)
+{
+    char buf[PATH_MAX];
+    if (snprintf(buf, sizeof buf, "%s", path) >= (int)sizeof buf) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    // Create every parent in turn, starting from the top.
+    for (char* p = buf + 1; *p != '\0'; ++p) {
+        if (*p != '/') {
+            continue;
+        }
+        *p = '\0';
+        if (mkdirat(dir_fd, buf, mode) < 0 && errno != EEXIST) {
+            return -1;
+        }
+        *p = '/';
+    }
+    if (mkdirat(dir_fd, buf, mode) == 0) {
+        return 0;
+    }
+    struct stat st;
+    if (errno != EEXIST || fstatat(dir_fd, buf, &st, 0) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    return 0;
+}
+
+// Copy the data of a file. This shares the extents where the filesystem
+// can reflink, lets the kernel do the copy where it can and falls back to
+// reads and writes otherwise.
+static int uc_copy_data(int in_fd, int out_fd)
+{
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+        return 0;
+    }
+    for (;;) {
+        ssize_t n = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0);
+        if (n == 0) {
+            return 0;
+        }
+        if (n > 0) {
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+            return -1;
+        }
+        // copy_file_range() moves the file offsets, so reads and writes go
+        // on from where it stopped.
+        break;
+    }
+    char buf[65536];
+    for (;;) {
+        ssize_t n = read(in_fd, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n;
+        }
+        if (uc_write_all(out_fd, buf, n) < 0) {
+            return -1;
+        }
+    }
+}
+
+// Files with more than one link that were copied, by device and inode, with
+// the absolute paths of their copies. Threads of tree.c share it.
+struct uc_link {
+    dev_t dev;
+    ino_t ino;
+    char* path;
+};
+
+static pthread_mutex_t uc_links_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct uc_link* uc_links;
+static size_t uc_links_size;
+static size_t uc_links_used;
+
+static size_t uc_link_slot(struct uc_link* links, size_t size, dev_t dev, ino_t ino)
+{
+    size_t i = ((size_t)ino * 31 + (size_t)dev) & (size - 1);
+    while (links[i].path != NULL && (links[i].dev != dev || links[i].ino != ino)) {
+        i = (i + 1) & (size - 1);
+    }
+    return i;
+}
+
+void uc_copy_forget_links()
+{
+    pthread_mutex_lock(&uc_links_lock);
+    for (size_t i = 0; i < uc_links_size; ++i) {
+        free(uc_links[i].path);
+    }
+    free(uc_links);
+    uc_links = NULL;
+    uc_links_size = uc_links_used = 0;
+    pthread_mutex_unlock(&uc_links_lock);
+}
+
+// Get the absolute path of dst in dst_dir_fd.
+static char* uc_abspath(int dst_dir_fd, const char* dst)
+{
+    if (dst[0] == '/' || dst_dir_fd == AT_FDCWD) {
+        return uc_strdupf("%s", dst);
+    }
+    char* proc = uc_strdupf("/proc/self/fd/%d", dst_dir_fd);
+    char dir[PATH_MAX];
+    ssize_t n = readlink(proc, dir, sizeof dir - 1);
+    free(proc);
+    if (n < 0) {
+        return NULL;
+    }
+    dir[n] = '\0';
+    return uc_strdupf("%s/%s", dir, dst);
+}
+
+// Get the path of the copy of the file st when it was copied already, or
+// remember dst as its copy and get NULL.
+static char* uc_copy_link(const struct stat* st, int dst_dir_fd, const char* dst)
+{
+    char* path = uc_abspath(dst_dir_fd, dst);
+    if (path == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&uc_links_lock);
+    if (uc_links_used * 2 >= uc_links_size) {
+        size_t size = uc_links_size ? uc_links_size * 2 : 64;
+        struct uc_link* links = calloc(size, sizeof *links);
+        if (links == NULL) {
+            uc_dief("cannot allocate memory\n");
+        }
+        for (size_t i = 0; i < uc_links_size; ++i) {
+            if (uc_links[i].path != NULL) {
+                links[uc_link_slot(links, size, uc_links[i].dev, uc_links[i].ino)] = uc_links[i];
+            }
+        }
+        free(uc_links);
+        uc_links = links;
+        uc_links_size = size;
+    }
+    struct uc_link* link = &uc_links[uc_link_slot(uc_links, uc_links_size, st->st_dev, st->st_ino)];
+    char* found = NULL;
+    if (link->path != NULL) {
+        found = uc_strdupf("%s", link->path);
+        free(path);
+    } else {
+        *link = (struct uc_link) { st->st_dev, st->st_ino, path };
+        uc_links_used++;
+    }
+    pthread_mutex_unlock(&uc_links_lock);
+    return found;
+}
+
+void uc_copy_remember(const struct stat* st, int dst_dir_fd, const char* dst)
+{
+    if (!S_ISDIR(st->st_mode) && st->st_nlink > 1) {
+        free(uc_copy_link(st, dst_dir_fd, dst));
+    }
+}
+
+int uc_copy_xattrs(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst)
+{
+    char* src_path = uc_abspath(src_dir_fd, src);
+    char* dst_path = uc_abspath(dst_dir_fd, dst);
+    int result = 0;
+    char* names = NULL;
+    char* value = NULL;
+    ssize_t size = src_path != NULL && dst_path != NULL ? llistxattr(src_path, NULL, 0) : -1;
+    if (size < 0) {
+        result = src_path != NULL && dst_path != NULL && (errno == ENOTSUP || errno == ENODATA) ? 0 : -1;
+        goto out;
+    }
+    names = malloc(size + 1);
+    if (names == NULL || (size = llistxattr(src_path, names, size)) < 0) {
+        result = -1;
+        goto out;
+    }
+    for (char* name = names; name < names + size; name += strlen(name) + 1) {
+        ssize_t len = lgetxattr(src_path, name, NULL, 0);
+        char* grown = len >= 0 ? realloc(value, len + 1) : NULL;
+        if (grown == NULL || (len = lgetxattr(src_path, name, grown, len)) < 0) {
+            value = grown != NULL ? grown : value;
+            result = -1;
+            continue;
+        }
+        value = grown;
+        if (lsetxattr(dst_path, name, value, len, 0) < 0 && errno != ENOTSUP) {
+            result = -1;
+        }
+    }
+out:
+    free(value);
+    free(names);
+    free(dst_path);
+    free(src_path);
+    return result;
+}
+
+// Copy the entries of a directory, returning 1 when some of them failed.
+static int uc_copy_dir_entries(const char* src, int src_fd, int dst_fd)
+{
+    int dup_fd = dup(src_fd);
+    DIR* dir = dup_fd < 0 ? NULL : fdopendir(dup_fd);
+    if (dir == NULL) {
+        uc_logf("cannot read directory %s: %m\n", src);
+        if (dup_fd >= 0) {
+            close(dup_fd);
+        }
+        return 1;
+    }
+    int result = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (uc_copy_at(src_fd, entry->d_name, dst_fd, entry->d_name) < 0) {
+            result = 1;
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+// Copy the contents of src, whose status is st, to dst, which is created.
+// Returns -1 when dst cannot be made and 1 when a directory was made but
+// some of its entries failed, which are logged already.
+static int uc_copy_contents(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst, const struct stat* st)
+{
+    int result = 0;
+    switch (st->st_mode & S_IFMT) {
+    case S_IFREG: {
+        int in_fd = openat(src_dir_fd, src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (in_fd < 0) {
+            return -1;
+        }
+        int out_fd = openat(dst_dir_fd, dst, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (out_fd < 0) {
+            close(in_fd);
+            return -1;
+        }
+        result = uc_copy_data(in_fd, out_fd);
+        close(in_fd);
+        if (close(out_fd) < 0) {
+            result = -1;
+        }
+        return result;
+    }
+    case S_IFDIR: {
+        if (mkdirat(dst_dir_fd, dst, 0700) < 0) {
+            return -1;
+        }
+        int in_fd = openat(src_dir_fd, src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int out_fd = openat(dst_dir_fd, dst, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (in_fd < 0 || out_fd < 0) {
+            uc_logf("cannot open %s: %m\n", in_fd < 0 ? src : dst);
+            result = 1;
+        } else {
+            result = uc_copy_dir_entries(src, in_fd, out_fd);
+        }
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        return result;
+    }
+    case S_IFLNK: {
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(src_dir_fd, src, target, sizeof target - 1);
+        if (n < 0) {
+            return -1;
+        }
+        target[n] = '\0';
+        return symlinkat(target, dst_dir_fd, dst);
+    }
+    default:
+        return mknodat(dst_dir_fd, dst, st->st_mode & S_IFMT, st->st_rdev);
+    }
+}
+
+int uc_copy_at(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst)
+{
+    struct stat st;
+    if (fstatat(src_dir_fd, src, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        uc_logf("cannot stat %s: %m\n", src);
+        return -1;
+    }
+    // Another link to a file that was copied already is linked again.
+    if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+        char* copy = uc_copy_link(&st, dst_dir_fd, dst);
+        if (copy != NULL) {
+            int linked = linkat(AT_FDCWD, copy, dst_dir_fd, dst, 0);
+            free(copy);
+            if (linked == 0) {
+                return 0;
+            }
+        }
+    }
+    int result = uc_copy_contents(src_dir_fd, src, dst_dir_fd, dst, &st);
+    if (result < 0) {
+        uc_logf("cannot copy %s to %s: %m\n", src, dst);
+        return -1;
+    }
+    result = -result;
+    // Change the owner first, that resets set-user-ID and set-group-ID bits.
+    if (fchownat(dst_dir_fd, dst, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) < 0) {
+        uc_logf("cannot change owner of %s: %m\n", dst);
+        result = -1;
+    }
+    if (!S_ISLNK(st.st_mode) && fchmodat(dst_dir_fd, dst, st.st_mode & 07777, 0) < 0) {
+        uc_logf("cannot change mode of %s: %m\n", dst);
+        result = -1;
+    }
+    // After the owner, which drops capabilities, and the mode, which would
+    // change the mask of ACLs.
+    if (uc_copy_xattrs(src_dir_fd, src, dst_dir_fd, dst) < 0) {
+        uc_logf("cannot copy extended attributes of %s to %s: %m\n", src, dst);
+        result = -1;
+    }
+    const struct timespec times[2] = { st.st_atim, st.st_mtim };
+    if (utimensat(dst_dir_fd, dst, times, AT_SYMLINK_NOFOLLOW) < 0) {
+        uc_logf("cannot set times of %s: %m\n", dst);
+        result = -1;
+    }
+    return result;
+}
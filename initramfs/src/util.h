@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Helpers shared by the native programs that the initramfs scripts run
+// instead of long shell pipelines. The scripts fall back to shell code when
+// a program is missing or fails, so programs report problems on stderr and
+// exit unsuccessfully rather than panic.
+
+#ifndef UC_UTIL_H
+#define UC_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Name of the program, used as the prefix of messages.
+extern const char* uc_program;
+
+void uc_init(const char* argv0);
+void uc_logf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void uc_dief(const char* fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+// Format a string into newly allocated memory, dying when out of memory.
+char* uc_strdupf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Get a path relative to a directory file descriptor for an absolute path
+// below that directory (skipping the leading slashes).
+const char* uc_relpath(const char* path);
+
+// Update a CRC-32 (as used by zlib and GPT) with buf. Start with crc 0.
+uint32_t uc_crc32(uint32_t crc, const void* buf, size_t size);
+
+// Read a whole file into a newly allocated, NUL terminated buffer.
+char* uc_read_file(const char* path, size_t* size);
+
+// Write all of buf to fd, retrying short writes.
+int uc_write_all(int fd, const void* buf, size_t size);
+
+// Create a directory and its missing parents, like "mkdir -p".
+int uc_mkdir_p_at(int dir_fd, const char* path, mode_t mode);
+
+// Copy a file, symbolic link, special file or directory tree along with its
+// ownership, permissions, extended attributes and timestamps, like "cp -a".
+// Files with several links that are copied more than once are linked to
+// their first copy, until uc_copy_forget_links(). The destination must not
+// exist. Errors are logged; copying goes on with the remaining entries and
+// -1 is returned at the end.
+int uc_copy_at(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst);
+
+// Take dst as the copy of the file st for linking, when it is already there.
+void uc_copy_remember(const struct stat* st, int dst_dir_fd, const char* dst);
+
+// Forget the copies of files with several links.
+void uc_copy_forget_links();
+
+// Copy the extended attributes of src to dst: capabilities, ACLs, SELinux
+// labels and so on. Destinations without support for them are fine.
+int uc_copy_xattrs(int src_dir_fd, const char* src, int dst_dir_fd, const char* dst);
+
+#endif
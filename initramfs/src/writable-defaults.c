@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Provision writable with the defaults of the image on first boot, for
+// handle_writable_defaults() in ubuntu-core-rootfs.
+//
+// usage: writable-defaults DEFAULTS DESTINATION
+//
+// This copies the entries of the DEFAULTS directory into DESTINATION like
+// "cp -a DEFAULTS/* DESTINATION" does, with a thread per CPU, and then
+// marks DEFAULTS as done with a .done file. Nothing is synced file by file:
+// the filesystem of DESTINATION is synced once at the end, before .done is
+// made and synced in turn. When a boot is cut short before that, the next
+// one copies again and skips the files that were copied completely.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "tree.h"
+#include "util.h"
+
+#define WD_DONE ".done"
+
+int main(int argc, char** argv)
+{
+    uc_init(argv[0]);
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s DEFAULTS DESTINATION\n", uc_program);
+        return 1;
+    }
+    const char* defaults = argv[1];
+    const char* destination = argv[2];
+    int src_fd = open(defaults, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (src_fd < 0) {
+        uc_dief("cannot open %s: %m\n", defaults);
+    }
+    if (faccessat(src_fd, WD_DONE, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+        return 0;
+    }
+    int dst_fd = open(destination, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dst_fd < 0) {
+        uc_dief("cannot open %s: %m\n", destination);
+    }
+
+    if (uc_tree_merge(src_fd, ".", dst_fd, ".", uc_tree_workers()) < 0) {
+        uc_dief("cannot copy %s to %s\n", defaults, destination);
+    }
+    if (syncfs(dst_fd) < 0) {
+        uc_dief("cannot sync %s: %m\n", destination);
+    }
+    int done_fd = openat(src_fd, WD_DONE, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (done_fd < 0 || fsync(done_fd) < 0 || fsync(src_fd) < 0) {
+        uc_dief("cannot mark %s as done: %m\n", defaults);
+    }
+    close(done_fd);
+    return 0;
+}
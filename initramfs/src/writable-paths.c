@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2017 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Process writable-paths(5) in one pass, for handle_writable_paths() in
+// ubuntu-core-rootfs.
+//
+// usage: writable-paths [-r REVISION] ROOTMNT WRITABLE_PATHS FSTAB
+//
+// This does what the shell loop does, entry by entry: it creates missing
+// persistent and synced paths on the writable partition, syncs existing
+// synced paths, bind mounts /etc paths right away and appends the entries
+// of all other paths to FSTAB. All files are reached relative to ROOTMNT
+// and the whole of FSTAB is appended in one write at the end, before the
+// /etc paths are mounted. Trees are
+// copied and synced by a thread per CPU, see tree.h.
+//
+// With -r, the revision of the core snap, synced paths are synced once per
+// revision. The paths that were synced are recorded in a manifest on the
+// writable partition and skipped while the core snap doesn't change.
+//
+// It exits unsuccessfully only when it cannot read its input or write
+// FSTAB, the shell loop takes over then and finds nothing mounted. Problems
+// with single entries are logged and the remaining entries are processed,
+// like the shell loop does.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tree.h"
+#include "util.h"
+
+struct wp_entry {
+    const char* mount_point;
+    const char* storage;
+    const char* type;
+    const char* action;
+    const char* options;
+};
+
+struct wp_context {
+    const char* rootmnt;
+    int root_fd;
+    FILE* fstab;
+    unsigned workers;
+    // Revision of the core snap, the manifest of synced paths that were
+    // synced from the revisions of the core snap in the past and the new
+    // manifest. Both manifests have a "REVISION MOUNT_POINT" line per path.
+    const char* revision;
+    char* manifest;
+    FILE* new_manifest;
+    // Bind mounts of /etc paths, made once FSTAB is written: a source and a
+    // target for each.
+    char** etc_binds;
+    size_t n_etc_binds;
+};
+
+// Manifest of synced paths, relative to ROOTMNT.
+#define WP_MANIFEST "writable/.synced-paths"
+
+static void wp_process(struct wp_context* ctx, const struct wp_entry* entry);
+static void wp_save_manifest(struct wp_context* ctx, const char* manifest, size_t len);
+static void wp_mount_etc(struct wp_context* ctx);
+
+int main(int argc, char** argv)
+{
+    uc_init(argv[0]);
+    struct wp_context ctx = { .workers = uc_tree_workers() };
+    int opt;
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt != 'r') {
+            return 1;
+        }
+        ctx.revision = optarg[0] != '\0' ? optarg : NULL;
+    }
+    if (argc - optind != 3) {
+        fprintf(stderr, "usage: %s [-r REVISION] ROOTMNT WRITABLE_PATHS FSTAB\n", uc_program);
+        return 1;
+    }
+    ctx.rootmnt = argv[optind];
+    const char* writable_paths = argv[optind + 1];
+    const char* fstab = argv[optind + 2];
+    ctx.root_fd = open(ctx.rootmnt, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (ctx.root_fd < 0) {
+        uc_dief("cannot open %s: %m\n", ctx.rootmnt);
+    }
+    char* text = uc_read_file(writable_paths, NULL);
+    if (text == NULL) {
+        uc_dief("cannot read %s: %m\n", writable_paths);
+    }
+    int fstab_fd = open(fstab, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fstab_fd < 0) {
+        uc_dief("cannot open %s: %m\n", fstab);
+    }
+    char* fstab_buf = NULL;
+    size_t fstab_len = 0;
+    ctx.fstab = open_memstream(&fstab_buf, &fstab_len);
+    char* manifest_buf = NULL;
+    size_t manifest_len = 0;
+    ctx.new_manifest = open_memstream(&manifest_buf, &manifest_len);
+    if (ctx.fstab == NULL || ctx.new_manifest == NULL) {
+        uc_dief("cannot allocate memory\n");
+    }
+    if (ctx.revision != NULL) {
+        char* path = uc_strdupf("%s/" WP_MANIFEST, ctx.rootmnt);
+        ctx.manifest = uc_read_file(path, NULL);
+        free(path);
+    }
+
+    char* line_state = NULL;
+    for (char* line = strtok_r(text, "\n", &line_state); line != NULL; line = strtok_r(NULL, "\n", &line_state)) {
+        // Entries need five fields, more are ignored. Anything that doesn't
+        // start with an absolute path, including comments, is skipped.
+        const char* fields[5];
+        char* field_state = NULL;
+        size_t n = 0;
+        for (char* field = strtok_r(line, " \t", &field_state); field != NULL && n < 5; field = strtok_r(NULL, " \t", &field_state)) {
+            fields[n++] = field;
+        }
+        if (n < 5 || fields[0][0] != '/') {
+            continue;
+        }
+        struct wp_entry entry = { fields[0], fields[1], fields[2], fields[3], fields[4] };
+        wp_process(&ctx, &entry);
+    }
+
+    if (fclose(ctx.fstab) != 0 || fclose(ctx.new_manifest) != 0) {
+        uc_dief("cannot allocate memory\n");
+    }
+    // A write that fails part way is undone, the shell loop appends all of
+    // the entries again.
+    struct stat fstab_st;
+    if (fstat(fstab_fd, &fstab_st) < 0) {
+        uc_dief("cannot stat %s: %m\n", fstab);
+    }
+    if (uc_write_all(fstab_fd, fstab_buf, fstab_len) < 0 || fsync(fstab_fd) < 0) {
+        int err = errno;
+        if (ftruncate(fstab_fd, fstab_st.st_size) < 0) {
+            uc_logf("cannot truncate %s: %m\n", fstab);
+        }
+        errno = err;
+        uc_dief("cannot write %s: %m\n", fstab);
+    }
+    close(fstab_fd);
+    wp_mount_etc(&ctx);
+    if (ctx.revision != NULL) {
+        wp_save_manifest(&ctx, manifest_buf, manifest_len);
+    }
+    free(manifest_buf);
+    free(ctx.manifest);
+    free(fstab_buf);
+    free(text);
+    return 0;
+}
+
+// Replace the manifest of synced paths, unless it is the same already. A
+// lost or stale manifest only makes the next boot sync everything again.
+static void wp_save_manifest(struct wp_context* ctx, const char* manifest, size_t len)
+{
+    if (ctx->manifest != NULL && strlen(ctx->manifest) == len && memcmp(ctx->manifest, manifest, len) == 0) {
+        return;
+    }
+    const char* tmp = WP_MANIFEST ".tmp";
+    int fd = openat(ctx->root_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || uc_write_all(fd, manifest, len) < 0 || close(fd) < 0
+        || renameat(ctx->root_fd, tmp, ctx->root_fd, WP_MANIFEST) < 0) {
+        uc_logf("cannot write %s/" WP_MANIFEST ": %m\n", ctx->rootmnt);
+        unlinkat(ctx->root_fd, tmp, 0);
+    }
+}
+
+// Create the missing persistent or synced path src for the entry, with the
+// contents, ownership and mode of the path dst of the root filesystem.
+static void wp_create(struct wp_context* ctx, const struct wp_entry* entry, const char* src, const char* dst, const struct stat* dst_st)
+{
+    char* parent = strdup(src);
+    char* slash = parent != NULL ? strrchr(parent, '/') : NULL;
+    if (slash != NULL) {
+        *slash = '\0';
+        if (uc_mkdir_p_at(ctx->root_fd, parent, 0755) < 0) {
+            uc_logf("cannot create directory %s/%s: %m\n", ctx->rootmnt, parent);
+        }
+    }
+    free(parent);
+
+    bool transition = strcmp(entry->action, "transition") == 0;
+    bool synced = strcmp(entry->type, "synced") == 0;
+    if (transition || (synced && S_ISDIR(dst_st->st_mode))) {
+        if (uc_tree_copy(ctx->root_fd, dst, ctx->root_fd, src, ctx->workers) == 0 && synced && ctx->revision != NULL) {
+            fprintf(ctx->new_manifest, "%s %s\n", ctx->revision, entry->mount_point);
+        }
+        return;
+    }
+    int fd;
+    if (S_ISDIR(dst_st->st_mode)) {
+        if (mkdirat(ctx->root_fd, src, 0700) < 0) {
+            uc_logf("cannot create directory %s/%s: %m\n", ctx->rootmnt, src);
+            return;
+        }
+        fd = openat(ctx->root_fd, src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+        fd = openat(ctx->root_fd, src, O_WRONLY | O_CREAT | O_NOCTTY | O_CLOEXEC, 0600);
+    }
+    if (fd < 0) {
+        uc_logf("cannot create %s/%s: %m\n", ctx->rootmnt, src);
+        return;
+    }
+    if (fchown(fd, dst_st->st_uid, dst_st->st_gid) < 0) {
+        uc_logf("cannot change owner of %s/%s: %m\n", ctx->rootmnt, src);
+    }
+    if (fchmod(fd, dst_st->st_mode & 07777) < 0) {
+        uc_logf("cannot change mode of %s/%s: %m\n", ctx->rootmnt, src);
+    }
+    close(fd);
+}
+
+// Get whether the synced path at mount_point was synced from the revision
+// of the core snap that is booting. The root filesystem is that snap, so
+// nothing new can have appeared in it since then.
+static bool wp_synced_already(struct wp_context* ctx, const char* mount_point)
+{
+    if (ctx->revision == NULL || ctx->manifest == NULL) {
+        return false;
+    }
+    size_t rev_len = strlen(ctx->revision), path_len = strlen(mount_point);
+    for (const char* line = ctx->manifest; *line != '\0';) {
+        const char* end = strchrnul(line, '\n');
+        if ((size_t)(end - line) == rev_len + 1 + path_len && strncmp(line, ctx->revision, rev_len) == 0
+            && line[rev_len] == ' ' && strncmp(line + rev_len + 1, mount_point, path_len) == 0) {
+            return true;
+        }
+        line = *end != '\0' ? end + 1 : end;
+    }
+    return false;
+}
+
+static void wp_sync(struct wp_context* ctx, const struct wp_entry* entry, const char* src, const char* dst)
+{
+    if (wp_synced_already(ctx, entry->mount_point)) {
+        fprintf(ctx->new_manifest, "%s %s\n", ctx->revision, entry->mount_point);
+        return;
+    }
+    struct stat st;
+    if (fstatat(ctx->root_fd, dst, &st, 0) < 0 || !S_ISDIR(st.st_mode)) {
+        // The shell version only syncs directories, too.
+        return;
+    }
+    if (uc_tree_sync(ctx->root_fd, dst, ctx->root_fd, src, ctx->workers) < 0) {
+        uc_logf("cannot sync all of %s/%s to %s/%s\n", ctx->rootmnt, dst, ctx->rootmnt, src);
+        return;
+    }
+    if (ctx->revision != NULL) {
+        fprintf(ctx->new_manifest, "%s %s\n", ctx->revision, entry->mount_point);
+    }
+}
+
+// Mount /etc paths right now, not later when fstab is processed, as that
+// causes races. The mounts are only queued here, see wp_mount_etc().
+static void wp_bind_etc(struct wp_context* ctx, const struct wp_entry* entry)
+{
+    char* src = uc_strdupf("writable/system-data/%s", uc_relpath(entry->mount_point));
+    if (faccessat(ctx->root_fd, src, F_OK, 0) < 0 && uc_mkdir_p_at(ctx->root_fd, src, 0755) < 0) {
+        uc_logf("cannot create directory %s/%s: %m\n", ctx->rootmnt, src);
+    }
+    char** binds = realloc(ctx->etc_binds, (ctx->n_etc_binds + 2) * sizeof *binds);
+    if (binds == NULL) {
+        uc_dief("cannot allocate memory\n");
+    }
+    ctx->etc_binds = binds;
+    binds[ctx->n_etc_binds++] = uc_strdupf("%s/%s", ctx->rootmnt, src);
+    binds[ctx->n_etc_binds++] = uc_strdupf("%s/%s", ctx->rootmnt, entry->mount_point);
+    free(src);
+}
+
+// Make the queued bind mounts of /etc paths. Nothing fails after FSTAB is
+// written, so that the shell loop never repeats them.
+static void wp_mount_etc(struct wp_context* ctx)
+{
+    for (size_t i = 0; i < ctx->n_etc_binds; i += 2) {
+        const char* source = ctx->etc_binds[i];
+        const char* target = ctx->etc_binds[i + 1];
+        if (mount(source, target, NULL, MS_BIND, NULL) < 0) {
+            uc_logf("cannot bind mount %s at %s: %m\n", source, target);
+        }
+        free(ctx->etc_binds[i]);
+        free(ctx->etc_binds[i + 1]);
+    }
+    free(ctx->etc_binds);
+}
+
+static void wp_process(struct wp_context* ctx, const struct wp_entry* entry)
+{
+    // Skip invalid mount points.
+    const char* dst = uc_relpath(entry->mount_point);
+    struct stat dst_st;
+    if (fstatat(ctx->root_fd, dst, &dst_st, 0) < 0) {
+        return;
+    }
+
+    if (strcmp(entry->type, "temporary") == 0) {
+        // Temporary entries are simple, just mount a tmpfs.
+        fprintf(ctx->fstab, "tmpfs %s tmpfs %s 0 0\n", entry->mount_point, entry->options);
+        return;
+    }
+    if (strcmp(entry->type, "persistent") != 0 && strcmp(entry->type, "synced") != 0) {
+        return;
+    }
+
+    // Figure out the source path.
+    char* path;
+    if (strcmp(entry->storage, "auto") == 0) {
+        path = uc_strdupf("/writable/system-data%s", entry->mount_point);
+    } else {
+        path = uc_strdupf("/writable/%s", entry->storage);
+    }
+    const char* src = uc_relpath(path);
+    if (faccessat(ctx->root_fd, src, F_OK, 0) < 0) {
+        wp_create(ctx, entry, src, dst, &dst_st);
+    } else if (strcmp(entry->type, "synced") == 0) {
+        wp_sync(ctx, entry, src, dst);
+    }
+
+    if (strncmp(entry->mount_point, "/etc", 4) == 0) {
+        wp_bind_etc(ctx, entry);
+    } else if (strcmp(entry->options, "none") == 0) {
+        fprintf(ctx->fstab, "%s %s none bind 0 0\n", path, entry->mount_point);
+    } else {
+        fprintf(ctx->fstab, "%s %s none bind,%s 0 0\n", path, entry->mount_point, entry->options);
+    }
+    free(path);
+}
@@ -15,6 +15,9 @@
 
 """Unit tests for initrd shell scripts."""
 
+import json
+import os
+
 from helpers import VMShellTestCase, main
 
 
@@ -22,6 +25,8 @@ class UbuntuCoreFunctionsTests(VMShellTestCase):
     """Tests for shell code in ubuntu-core-functions."""
 
     MOCK = ("log_begin_msg", "log_end_msg", "run_scripts", "wait-for-root")
+    SH_SERVER_SOURCES = ("/scripts/ubuntu-core-rootfs",)
+    SH_BATCH = True
 
     def setUp(self) -> None:
         """
@@ -131,22 +136,42 @@ class UbuntuCoreFunctionsTests(VMShellTestCase):
         self.assertEqual(returncode, 150)
         self.assertEqual(log, [])
         self.assertEqual(self.sh_mocked_calls(), [
-            ("wait-for-root", "LABEL=", "180"),
-            ("panic", "root device  does not exist"),
+            ("panic", "unable to find root partition LABEL="),
         ])
 
     def test_do_root_mounting__with_failing_wait_for_root(self) -> None:
-        """Test do_root_mounting panics when writable_label is unset."""
+        """Test do_root_mounting panics when the device doesn't show up."""
         self.sh_mock("wait-for-root", returns=10)
+        self.sh_mock("findfs", returns=1)
         self.sh_inject("writable_label=some-label")
         returncode, log = self.sh_run("do_root_mounting")
         self.assertEqual(returncode, 150)
         self.assertEqual(log, [])
         self.assertEqual(self.sh_mocked_calls(), [
             ("wait-for-root", "LABEL=some-label", "180"),
+            ("findfs", "LABEL=some-label"),
             ("panic", "unable to find root partition LABEL=some-label"),
         ])
 
+    def test_do_root_mounting__uses_resolved_device(self) -> None:
+        """Test do_root_mounting doesn't wait again for a resolved device."""
+        self.sh_inject("writable_label=some-label")
+        self.sh_inject("writable_mnt=/fake-writable-mnt")
+        self.sh_mock("findfs", prints="/dev/zero")
+        self.sh_mock("mount")
+        self.sh_mock("modprobe")
+        returncode, log = self.sh_run(
+            "resolve_device LABEL=some-label wait >/dev/null;"
+            " do_root_mounting")
+        self.assertEqual(returncode, 0)
+        self.assertEqual(log, [])
+        self.assertEqual(self.sh_mocked_calls(), [
+            ("wait-for-root", "LABEL=some-label", "180"),
+            ("findfs", "LABEL=some-label"),
+            ("modprobe", "squashfs"),
+            ("mount", "/dev/zero", "/fake-writable-mnt"),
+        ])
+
     def test_do_root_mounting__works(self) -> None:
         """Test do_root_mounting works when writable_label is set correctly."""
         self.sh_inject("writable_label=some-label")
@@ -162,10 +187,96 @@ class UbuntuCoreFunctionsTests(VMShellTestCase):
             ("wait-for-root", "LABEL=some-label", "180"),
             ("findfs", "LABEL=some-label"),
             ("modprobe", "squashfs"),
+            ("mount", "/dev/zero", "/fake-writable-mnt"),
+        ])
+
+    def test_resolve_device__caches(self) -> None:
+        """Test resolve_device waits and probes only the first time."""
+        self.sh_mock("findfs", prints="/dev/zero")
+        returncode, log = self.sh_run(
+            "resolve_device LABEL=some-label wait;"
+            " resolve_device LABEL=some-label wait")
+        self.assertEqual(returncode, 0)
+        self.assertEqual(log, [b"/dev/zero", b"/dev/zero"])
+        self.assertEqual(self.sh_mocked_calls(), [
             ("wait-for-root", "LABEL=some-label", "180"),
-            ("mount", "/dev/null", "/fake-writable-mnt"),
+            ("findfs", "LABEL=some-label"),
         ])
 
+    def test_resolve_device__uses_udev_links(self) -> None:
+        """Test resolve_device prefers the links of udev to probing."""
+        self.sh_inject("mkdir -p /dev/disk/by-partlabel")
+        self.sh_inject("ln -s /dev/null /dev/disk/by-partlabel/some-label")
+        self.sh_mock("findfs")
+        returncode, log = self.sh_run("resolve_device PARTLABEL=some-label")
+        self.assertEqual(returncode, 0)
+        self.assertEqual(log, [b"/dev/null"])
+        self.assertEqual(self.sh_mocked_calls(), [])
+
+    def test_resolve_device__unknown_device(self) -> None:
+        """Test resolve_device fails for missing devices and caches nothing."""
+        self.sh_mock("findfs", returns=1)
+        returncode, log = self.sh_run(
+            "resolve_device LABEL=some-label || resolve_device LABEL=some-label")
+        self.assertEqual(returncode, 1)
+        self.assertEqual(log, [])
+        self.assertEqual(self.sh_mocked_calls(), [
+            ("findfs", "LABEL=some-label"),
+            ("findfs", "LABEL=some-label"),
+        ])
+
+
+class MountrootTimingTests(VMShellTestCase):
+    """Tests for the time that mountroot spends in each boot phase."""
+
+    SH_SERVER_SOURCES = ("/scripts/ubuntu-core-rootfs",)
+
+    # Seconds each phase of boot-timing.json may take, and all of them.
+    BUDGET = os.path.join(os.path.dirname(__file__), "boot-budget.json")
+
+    def setUp(self) -> None:
+        """
+        Prepare for running the real mountroot against a disk fixture.
+
+        Only the scripts of the other initramfs-tools boot stages and the
+        messages are mocked, the devices, filesystems and snaps are real.
+        """
+        super().setUp()
+        if not os.environ.get("TESTVM_FIXTURE"):
+            self.skipTest("needs a disk fixture, see TESTVM_FIXTURE")
+        for fn in ("log_begin_msg", "log_end_msg", "run_scripts"):
+            self.sh_mock(fn)
+        self.sh_mock("panic", exits=150)
+        self.sh_source("/scripts/ubuntu-core-rootfs")
+
+    def test_mountroot__within_budget(self) -> None:
+        """Test no phase of mountroot takes longer than its budget."""
+        with open(self.BUDGET) as stream:
+            budget = json.load(stream)
+        # The fixture has the snaps that "make fixtures" downloaded.
+        for var, snap in (("snap_core", "core.snap"),
+                          ("snap_kernel", "pc-kernel.snap")):
+            self.sh_inject("{}={}".format(
+                var, os.path.basename(os.path.realpath(snap))))
+        self.sh_inject("quiet=y")
+        self.sh_inject("ROOTDELAY=10")
+        self.sh_inject("rootmnt=/root-test && mkdir -p $rootmnt")
+        returncode, log = self.sh_run("mountroot")
+        self.assertEqual(returncode, 0, log)
+        timing = json.loads(
+            self.remote_read("/run/initramfs/boot-timing.json").decode())
+        elapsed = {phase["name"]: phase["end"] - phase["start"]
+                   for phase in timing["phases"]}
+        over = ["{} took {:.2f}s, budget {:.2f}s".format(
+                    name, seconds, budget["phases"].get(name, 0))
+                for name, seconds in sorted(elapsed.items())
+                if seconds > budget["phases"].get(name, 0)]
+        total = timing["phases"][-1]["end"] - timing["phases"][0]["start"]
+        if total > budget["total"]:
+            over.append("mountroot took {:.2f}s, budget {:.2f}s".format(
+                total, budget["total"]))
+        self.assertEqual(over, [])
+
 
 if __name__ == "__main__":
     # logging.basicConfig(level=logging.DEBUG)
@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+# Copyright (C) 2017 Canonical Ltd
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""
+Micro-benchmarks of the virtual machine based testing system.
+
+This measures the boot of the test VM and the cost of the requests that
+tests make, over many iterations. The results are written as JSON, so that
+changes of the transports or of init can be compared between commits.
+"""
+
+import argparse
+import asyncio
+import datetime
+import json
+import logging
+import math
+import os
+import subprocess
+import sys
+import time
+
+from typing import (
+    Any,
+    Awaitable,
+    Callable,
+    Dict,
+    List,
+    Sequence,
+)
+
+from helpers import BadRequest, TestVM
+
+_logger = logging.getLogger("bench")
+
+
+def _now_ns() -> int:
+    """Get the time of the monotonic clock, in nanoseconds."""
+    return int(time.monotonic() * 1e9)
+
+
+def _percentile(samples: Sequence[int], percent: float) -> int:
+    """Get a percentile of sorted samples, by the nearest rank."""
+    rank = max(int(math.ceil(percent / 100 * len(samples))), 1)
+    return samples[rank - 1]
+
+
+def summarize(samples_ns: Sequence[int]) -> Dict[str, int]:
+    """Summarize the durations of iterations, in nanoseconds."""
+    samples = sorted(samples_ns)
+    return {
+        "n": len(samples),
+        "min_ns": samples[0],
+        "mean_ns": sum(samples) // len(samples),
+        "p50_ns": _percentile(samples, 50),
+        "p90_ns": _percentile(samples, 90),
+        "p99_ns": _percentile(samples, 99),
+        "max_ns": samples[-1],
+    }
+
+
+async def _repeat(iterations: int,
+                  fn: Callable[[], Awaitable[Any]]) -> List[int]:
+    """Call fn the given number of times and get the duration of each."""
+    samples = []  # type: List[int]
+    for _ in range(iterations):
+        start = _now_ns()
+        await fn()
+        samples.append(_now_ns() - start)
+    return samples
+
+
+async def bench_boot(args: argparse.Namespace) -> Dict[str, Any]:
+    """Measure cold boots to the boot-ok event."""
+    samples = []  # type: List[int]
+    guest = {}  # type: Dict[str, List[int]]
+    for _ in range(args.boots):
+        tvm = TestVM()
+        try:
+            start = _now_ns()
+            await tvm.boot(transport=args.transport, machine=args.machine)
+            samples.append(_now_ns() - start)
+            for key, value in tvm.boot_timing.items():
+                guest.setdefault(key, []).append(value)
+        finally:
+            await tvm.shutdown()
+            tvm.cleanup()
+    result = summarize(samples)  # type: Dict[str, Any]
+    result["guest"] = {key: summarize(values)
+                       for key, values in sorted(guest.items())}
+    return result
+
+
+async def bench_requests(tvm: TestVM,
+                         args: argparse.Namespace) -> Dict[str, Any]:
+    """Measure the requests made by tests, in a booted machine."""
+    results = {}  # type: Dict[str, Any]
+    results["ping"] = summarize(await _repeat(args.iterations, tvm.ping))
+
+    # Many requests in flight at once, per request.
+    requests = [("ping", b"")] * args.iterations
+    start = _now_ns()
+    await tvm.rpc_pipeline(requests)
+    results["ping_pipelined"] = summarize(
+        [(_now_ns() - start) // len(requests)])
+
+    for size in args.write_sizes:
+        data = os.urandom(size)
+        samples = await _repeat(
+            args.write_iterations,
+            lambda: tvm.remote_write("/tmp/bench.bin", 0o644, data))
+        result = summarize(samples)  # type: Dict[str, Any]
+        result["bytes_per_s"] = int(size * len(samples) / (sum(samples) / 1e9))
+        results["write_{}".format(size)] = result
+
+    results["system"] = summarize(await _repeat(
+        args.iterations, lambda: tvm.remote_system("true")))
+    try:
+        results["exec"] = summarize(await _repeat(
+            args.iterations, lambda: tvm.remote_exec(["true"])))
+    except BadRequest:
+        _logger.warning("init does not support exec")
+
+    await tvm.savevm("bench")
+    results["savevm"] = summarize(await _repeat(
+        args.snapshot_iterations, lambda: tvm.savevm("bench")))
+    results["loadvm"] = summarize(await _repeat(
+        args.snapshot_iterations, lambda: tvm.loadvm("bench")))
+    if await tvm.checkpoint("bench"):
+        results["restore"] = summarize(await _repeat(
+            args.snapshot_iterations, tvm.restore))
+    return results
+
+
+def _git_revision() -> str:
+    """Get the revision of the source tree, if known."""
+    try:
+        return subprocess.check_output(
+            ["git", "describe", "--always", "--dirty"],
+            stderr=subprocess.DEVNULL).decode("utf-8").strip()
+    except (OSError, subprocess.CalledProcessError):
+        return ""
+
+
+def _print_summary(results: Dict[str, Any]) -> None:
+    """Print the results in a table for humans."""
+    print("{:<20} {:>6} {:>10} {:>10} {:>10} {:>10}".format(
+        "benchmark", "n", "p50 [us]", "p90 [us]", "p99 [us]", "max [us]"),
+        file=sys.stderr)
+    for name, result in sorted(results.items()):
+        line = "{:<20} {:>6} {:>10} {:>10} {:>10} {:>10}".format(
+            name, result["n"], result["p50_ns"] // 1000,
+            result["p90_ns"] // 1000, result["p99_ns"] // 1000,
+            result["max_ns"] // 1000)
+        if "bytes_per_s" in result:
+            line += " {:.1f} MB/s".format(result["bytes_per_s"] / 1e6)
+        print(line, file=sys.stderr)
+
+
+def main() -> None:
+    """Run the benchmarks and write the results."""
+    parser = argparse.ArgumentParser(description=__doc__.strip())
+    parser.add_argument("--output", "-o", default="-",
+                        help="file to write JSON results to (default stdout)")
+    parser.add_argument("--transport",
+                        default=os.environ.get("TESTVM_TRANSPORT",
+                                               "isa-serial"),
+                        help="transport of test I/O")
+    parser.add_argument("--machine",
+                        default=os.environ.get("TESTVM_MACHINE", "pc"),
+                        help="type of machine, pc or microvm")
+    parser.add_argument("--boots", type=int, default=3,
+                        help="number of cold boots")
+    parser.add_argument("--iterations", type=int, default=200,
+                        help="number of iterations of cheap requests")
+    parser.add_argument("--write-iterations", type=int, default=10,
+                        help="number of writes of each size")
+    parser.add_argument("--write-sizes", type=int, nargs="+",
+                        default=[4096, 65536, 1048576],
+                        help="sizes of the written files, in bytes")
+    parser.add_argument("--snapshot-iterations", type=int, default=5,
+                        help="number of savevm, loadvm and restore requests")
+    parser.add_argument("-v", "--verbose", action="store_true",
+                        help="log all the requests")
+    args = parser.parse_args()
+    logging.basicConfig(
+        level=logging.INFO if args.verbose else logging.WARNING)
+
+    loop = asyncio.get_event_loop()
+    if loop.run_until_complete(TestVM().make_boot_assets()) != 0:
+        raise SystemError("cannot make boot assets")
+    results = {}  # type: Dict[str, Any]
+    results["boot"] = loop.run_until_complete(bench_boot(args))
+    tvm = TestVM()
+    try:
+        loop.run_until_complete(tvm.boot(transport=args.transport,
+                                         machine=args.machine))
+        results.update(loop.run_until_complete(bench_requests(tvm, args)))
+    finally:
+        loop.run_until_complete(tvm.shutdown())
+        tvm.cleanup()
+
+    report = {
+        "revision": _git_revision(),
+        "date": datetime.datetime.utcnow().isoformat() + "Z",
+        "transport": args.transport,
+        "machine": args.machine,
+        "kvm": os.path.exists("/dev/kvm"),
+        "results": results,
+    }
+    if args.output == "-":
+        json.dump(report, sys.stdout, indent=2, sort_keys=True)
+        sys.stdout.write("\n")
+    else:
+        with open(args.output, "w") as stream:
+            json.dump(report, stream, indent=2, sort_keys=True)
+            stream.write("\n")
+    _print_summary(results)
+
+
+if __name__ == "__main__":
+    main()
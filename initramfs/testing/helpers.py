@@ -17,25 +17,38 @@
 import asyncio
 import datetime
 import errno
+import gzip
 import json
 import logging
+import lzma
 import os
+import random
+import re
 import shlex
+import shutil
 import signal
+import socket
+import struct
 import subprocess
 import sys
 import tempfile
+import time
+import traceback
 import types
 import unittest
 
 from typing import (
     Any,
+    Callable,
     Dict,
+    Iterator,
     List,
     Optional,
     Sequence,
+    Set,
     Tuple,
     Type,
+    Union,
     cast,
 )
 
@@ -46,6 +59,47 @@ _logger = logging.getLogger("qemu")
 
 O_CLOEXEC = 0x80000
 
+# AF_VSOCK constants, missing from the socket module before Python 3.7.
+AF_VSOCK = getattr(socket, "AF_VSOCK", 40)
+VMADDR_CID_ANY = getattr(socket, "VMADDR_CID_ANY", 0xffffffff)
+VMADDR_PORT_ANY = getattr(socket, "VMADDR_PORT_ANY", 0xffffffff)
+
+# Header of each message of the framed test I/O protocol. See the description
+# of struct init_frame_header in init.c for details.
+_FRAME_HEADER = struct.Struct("<IHHII")
+FRAME_REQUEST = 1
+FRAME_REPLY = 2
+FRAME_EVENT = 3
+FRAME_OUTPUT = 4
+# Flags of output frames, telling which stream the output is from.
+STREAM_STDOUT = 1
+STREAM_STDERR = 2
+# Keys of replies with the time and resources it took to handle a request.
+_TIMING_KEYS = ("elapsed_ns", "utime_ns", "stime_ns", "maxrss_kb", "host_ns")
+
+
+def _monotonic_ns() -> int:
+    """Get the time of the monotonic clock, in nanoseconds."""
+    return int(time.monotonic() * 1e9)
+
+
+def compress_data(data: bytes, codec: str) -> bytes:
+    """
+    Compress data for the compressed variant of the write command.
+
+    The gzip and xz formats are handled by the standard library, lz4 and zstd
+    use the command line tools of the same name.
+    """
+    if codec == "gzip":
+        return gzip.compress(data, compresslevel=6)
+    elif codec == "xz":
+        return lzma.compress(data, preset=1)
+    elif codec in ("lz4", "zstd"):
+        return subprocess.run(
+            [codec, "-q", "-c"], input=data, stdout=subprocess.PIPE,
+            check=True).stdout
+    raise ValueError("cannot compress data with codec {!a}".format(codec))
+
 
 class Resource:
     """Host resource that needs cleanup after use."""
@@ -142,8 +196,10 @@ class FIFO(Resource):
                 fd = os.open(
                     self.path, os.O_WRONLY | os.O_NONBLOCK | O_CLOEXEC)
             except OSError as exc:
-                if exc.errno == errno.ENXIO:
-                    await asyncio.sleep(1)
+                # The reader is not there yet.
+                if exc.errno != errno.ENXIO:
+                    raise
+                await asyncio.sleep(0.01)
 
         def proto_factory() -> asyncio.streams.FlowControlMixin:
             return asyncio.streams.FlowControlMixin()
@@ -164,6 +220,121 @@ class FIFO(Resource):
                 pass
 
 
+class SocketListener(Resource):
+    """Listening socket on the host, accepting a single connection."""
+
+    def __init__(self, sock: socket.socket) -> None:
+        self._sock = sock
+        self._sock.listen(1)
+        self._sock.setblocking(False)
+        self._conn = None  # type: Optional[socket.socket]
+        self._reader = None  # type: Optional[asyncio.StreamReader]
+        self._writer = None  # type: Optional[asyncio.StreamWriter]
+
+    @property
+    def reader(self) -> Optional[asyncio.StreamReader]:
+        return self._reader
+
+    @property
+    def writer(self) -> Optional[asyncio.StreamWriter]:
+        return self._writer
+
+    async def open(self) -> None:
+        """Wait for the peer to connect."""
+        if self._conn is not None:
+            return
+        loop = asyncio.get_event_loop()
+        self._conn, _ = await loop.sock_accept(self._sock)
+        self._reader, self._writer = await asyncio.open_connection(
+            sock=self._conn)
+
+    def cleanup(self) -> None:
+        """Close the listening and the connected socket."""
+        if self._writer is not None:
+            self._writer.close()
+            self._writer = None
+        if self._conn is not None:
+            self._conn.close()
+            self._conn = None
+        self._sock.close()
+
+
+class VsockListener(SocketListener):
+    """AF_VSOCK socket on the host, waiting for the guest to connect."""
+
+    def __init__(self, port: int=VMADDR_PORT_ANY) -> None:
+        sock = socket.socket(AF_VSOCK, socket.SOCK_STREAM)
+        sock.bind((VMADDR_CID_ANY, port))
+        super().__init__(sock)
+        self._port = cast(int, sock.getsockname()[1])
+
+    @property
+    def port(self) -> int:
+        """Get the port number the guest should connect to."""
+        return self._port
+
+
+class UnixListener(SocketListener):
+    """
+    Unix socket on the host, waiting for QEMU to connect.
+
+    QEMU connects to it while it starts up, so unlike a FIFO there is no
+    need to wait for the other end to show up.
+    """
+
+    def __init__(self, path: str) -> None:
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.bind(path)
+        self._path = path  # type: Optional[str]
+        super().__init__(sock)
+
+    @property
+    def path(self) -> Optional[str]:
+        """Get the path of the socket."""
+        return self._path
+
+    def cleanup(self) -> None:
+        """Close the sockets and remove the socket from the filesystem."""
+        super().cleanup()
+        if self._path is not None:
+            try:
+                os.unlink(self._path)
+            except FileNotFoundError:
+                pass
+            self._path = None
+
+
+class Overlay(Resource):
+    """Thin qcow2 image that keeps the writes on top of a backing image."""
+
+    @classmethod
+    def create(cls: Type, path: str, backing: str) -> "Overlay":
+        if not os.path.exists(backing):
+            raise FileNotFoundError(
+                "cannot find backing image {!a}".format(backing))
+        subprocess.check_call([
+            "qemu-img", "create", "-q", "-f", "qcow2", "-F", "qcow2",
+            "-b", os.path.abspath(backing), path])
+        return Overlay(path)
+
+    def __init__(self, path: str) -> None:
+        self._path = path  # type: Optional[str]
+
+    @property
+    def path(self) -> Optional[str]:
+        """Get the path of the overlay."""
+        return self._path
+
+    def cleanup(self) -> None:
+        """Remove the overlay from the filesystem."""
+        if self._path is not None:
+            try:
+                os.unlink(self._path)
+            except FileNotFoundError:
+                pass
+            self._path = None
+
+
 class CharDev:
     """QEMU character device."""
 
@@ -185,6 +356,30 @@ class CharDev:
         return ('-chardev', self.qemu_cmd)
 
 
+class SocketCharDev(CharDev):
+    """QEMU character device connected to a Unix socket of the host."""
+
+    def __init__(self, qemu_id: str, listener: UnixListener) -> None:
+        super().__init__(qemu_id, "socket,id={},path={}".format(
+            qemu_id, listener.path), {"listener": listener})
+        self.add_resource(listener)
+        self._listener = listener
+
+    @property
+    def reader(self) -> Optional[asyncio.StreamReader]:
+        """Get the stream reader for reading from the character device."""
+        return self._listener.reader
+
+    @property
+    def writer(self) -> Optional[asyncio.StreamWriter]:
+        """Get the stream writer for writing to the character device."""
+        return self._listener.writer
+
+    async def open(self) -> None:
+        """Accept the connection of QEMU (done by :meth:`Qemu.start`)."""
+        await self._listener.open()
+
+
 class Device:
     """QEMU device."""
 
@@ -254,6 +449,75 @@ class SerialPortFIFOs:
         """Get the stream writer for writing to this serial port."""
         return self.fifo_in.writer
 
+    async def open(self) -> None:
+        """Open the serial port (done by :meth:`Qemu.start`)."""
+        await self.fifo_in.open()
+        await self.fifo_out.open()
+
+
+class SerialPortSocket:
+    """QEMU serial port associated with a Unix socket."""
+
+    def __init__(self, chardev: SocketCharDev, device: Device) -> None:
+        self._chardev = chardev
+        self._device = device
+
+    @property
+    def device(self) -> Device:
+        """Get the QEMU device associated with the serial port."""
+        return self._device
+
+    @property
+    def guest_ttyname(self) -> str:
+        """Get the name of the tty as seen by the guest (e.g. ttyS0)."""
+        return cast(str, self._device.attrs["guest-ttyname"])
+
+    @property
+    def reader(self) -> Optional[asyncio.StreamReader]:
+        """Get the stream reader for reading from this serial port."""
+        return self._chardev.reader
+
+    @property
+    def writer(self) -> Optional[asyncio.StreamWriter]:
+        """Get the stream writer for writing to this serial port."""
+        return self._chardev.writer
+
+    async def open(self) -> None:
+        """Open the serial port (done by :meth:`Qemu.start`)."""
+        await self._chardev.open()
+
+
+class VsockPort:
+    """QEMU vhost-vsock device with a host socket the guest connects to."""
+
+    def __init__(self, listener: VsockListener, device: Device) -> None:
+        self._listener = listener
+        self._device = device
+
+    @property
+    def device(self) -> Device:
+        """Get the QEMU device associated with the vsock port."""
+        return self._device
+
+    @property
+    def guest_ttyname(self) -> str:
+        """Get the name of the port as understood by init (vsock:PORT)."""
+        return "vsock:{}".format(self._listener.port)
+
+    @property
+    def reader(self) -> Optional[asyncio.StreamReader]:
+        """Get the stream reader for reading from the guest."""
+        return self._listener.reader
+
+    @property
+    def writer(self) -> Optional[asyncio.StreamWriter]:
+        """Get the stream writer for writing to the guest."""
+        return self._listener.writer
+
+    async def open(self) -> None:
+        """Wait for the guest to connect."""
+        await self._listener.open()
+
 
 class MonitorFIFOs:
     """QEMU monitor associated with two FIFOs."""
@@ -283,11 +547,132 @@ class MonitorFIFOs:
         return self.fifo_in.writer
 
 
+class QMPClient:
+    """
+    Client of the QEMU machine protocol (QMP), the JSON flavour of the monitor.
+
+    Each command gets a reply with its result or error, matched by an id, so
+    callers know exactly when it completed. Asynchronous events, such as STOP
+    and RESUME, are put on the queues of subscribers.
+    """
+
+    def __init__(self, fifos: Union[MonitorFIFOs, SocketCharDev]) -> None:
+        self._fifos = fifos
+        self._next_id = 1
+        self._pending = {}  # type: Dict[int, asyncio.Future[Any]]
+        self._subscribers = [
+        ]  # type: List[Tuple[Tuple[str, ...], asyncio.Queue[Dict[Any, Any]]]]
+        self._task = None  # type: Optional[asyncio.Future[None]]
+
+    async def open(self) -> None:
+        """Wait for the greeting of QEMU and enter command mode."""
+        greeting = await self._read_message()
+        if greeting is None or "QMP" not in greeting:
+            raise BadRequest(greeting)
+        self._task = asyncio.ensure_future(self._process_messages())
+        await self.execute("qmp_capabilities")
+
+    def close(self) -> None:
+        """Stop processing messages and fail the pending commands."""
+        if self._task is not None:
+            self._task.cancel()
+            self._task = None
+        self._fail_pending()
+
+    async def execute(self, cmd: str, **arguments: Any) -> Any:
+        """
+        Execute a QMP command and return its result.
+
+        :arg cmd:
+            Name of the command, e.g. "stop" or "human-monitor-command".
+        :arg arguments:
+            Arguments of the command.
+        :raises QMPError:
+            If QEMU rejected the command.
+        """
+        writer = self._fifos.writer
+        if writer is None:
+            raise TypeError("QMP is not ready for writing")
+        if self._task is None or self._task.done():
+            raise StateError("QMP is not open")
+        cmd_id = self._next_id
+        self._next_id += 1
+        message = {"execute": cmd, "id": cmd_id}  # type: Dict[str, Any]
+        if arguments:
+            message["arguments"] = arguments
+        future = asyncio.get_event_loop().create_future()
+        self._pending[cmd_id] = future
+        req = json.dumps(message).encode("utf-8") + b"\n"
+        _logger.info("(qmp) -> %s", req.rstrip(b"\n").decode("utf-8"))
+        writer.write(req)
+        await writer.drain()
+        return await future
+
+    def subscribe(self, *names: str) -> "asyncio.Queue[Dict[Any, Any]]":
+        """
+        Get a queue that receives the events with the given names.
+
+        Without names, the queue receives all the events.
+        """
+        queue = asyncio.Queue()  # type: asyncio.Queue[Dict[Any, Any]]
+        self._subscribers.append((names, queue))
+        return queue
+
+    def unsubscribe(self, queue: "asyncio.Queue[Dict[Any, Any]]") -> None:
+        """Stop putting events on a queue returned by subscribe."""
+        self._subscribers = [(names, q) for names, q in self._subscribers
+                             if q is not queue]
+
+    async def _read_message(self) -> Optional[Dict[Any, Any]]:
+        """Read the next message, or None at the end of the stream."""
+        reader = self._fifos.reader
+        if reader is None:
+            raise TypeError("QMP is not ready for reading")
+        while True:
+            line = await reader.readline()
+            if line == b'':
+                return None
+            line = line.strip()
+            if line != b'':
+                _logger.info("(qmp) <- %s", line.decode("utf-8"))
+                return cast(Dict[Any, Any], json.loads(line.decode("utf-8")))
+
+    async def _process_messages(self) -> None:
+        """Resolve pending commands and dispatch events, until EOF."""
+        try:
+            while True:
+                message = await self._read_message()
+                if message is None:
+                    break
+                if "event" in message:
+                    for names, queue in self._subscribers:
+                        if not names or message["event"] in names:
+                            queue.put_nowait(message)
+                    continue
+                future = self._pending.pop(message.get("id"), None)
+                if future is None or future.done():
+                    continue
+                if "error" in message:
+                    future.set_exception(QMPError(message["error"]))
+                else:
+                    future.set_result(message.get("return"))
+        finally:
+            self._fail_pending()
+
+    def _fail_pending(self) -> None:
+        for future in self._pending.values():
+            if not future.done():
+                future.set_exception(StateError("QMP was closed"))
+        self._pending.clear()
+
+
 class Qemu:
     """High-level wrapper around qemu system emulator."""
 
     def __init__(self, exe: str) -> None:
         self._exe = exe
+        # Type of machine to emulate
+        self._machine = "pc"
         self._enable_kvm = False
         self._snapshot = False
         # Memory size in megabytes.
@@ -301,11 +686,33 @@ class Qemu:
         self._display = None  # type: Optional[str]
         # Type of QEMU monitor to use
         self._monitor = None  # type: Optional[str]
+        # Identifier of the character device used for QMP
+        self._qmp = None  # type: Optional[str]
         # Additional character devices
         self._chardevs = {}  # type: Dict[str, CharDev]
         # Additional devices and drives
         self._devices = []  # type: List[Device]
         self._drives = []  # type: List[Drive]
+        # Other host resources owned by the virtual machine.
+        self._resources = []  # type: List[Resource]
+
+    @property
+    def machine(self) -> str:
+        """
+        Get the type of machine to emulate (pc or microvm).
+
+        The microvm machine has no PCI bus and no legacy devices other than
+        the ISA bus, and boots with minimal firmware. Virtio devices use the
+        virtio-mmio transport there, and drives are not attached to any
+        device, though they still hold the snapshots.
+        """
+        return self._machine
+
+    @machine.setter
+    def machine(self, value: str) -> None:
+        if value not in ('pc', 'microvm'):
+            raise ValueError("cannot set machine type {!a}".format(value))
+        self._machine = value
 
     @property
     def enable_kvm(self) -> bool:
@@ -397,6 +804,8 @@ class Qemu:
         for chardev in self._chardevs.values():
             for resource in chardev.resources:
                 resource.cleanup()
+        for resource in self._resources:
+            resource.cleanup()
 
     async def start(self, *extra_args: str) -> asyncio.subprocess.Process:
         """Start QEMU and open all named pipes."""
@@ -404,16 +813,22 @@ class Qemu:
         _logger.info("starting: %r", args)
         # Run qemu in a separate process
         proc = await asyncio.create_subprocess_exec(*args)
-        # Open all the FIFOs associated with any character devices we may have.
+        # Open all the FIFOs associated with any character devices we may have
+        # and accept the connections of the socket character devices.
         for qemu_id in sorted(self._chardevs):
             chardev = self._chardevs[qemu_id]
             for resource in chardev.resources:
-                if isinstance(resource, FIFO):
+                if isinstance(resource, (FIFO, UnixListener)):
                     await resource.open()
         return proc
 
     def _qemu_cmdline(self, extra_args: Sequence[str]) -> List[str]:
         args = [self._exe]
+        # Use the microvm machine if requested. The serial ports are added as
+        # devices, and there are no option ROMs to run.
+        if self.machine == "microvm":
+            args.append("-M")
+            args.append("microvm,x-option-roms=off,isa-serial=off")
         # Enable KVM if requested.
         if self.enable_kvm:
             args.append("-enable-kvm")
@@ -446,10 +861,15 @@ class Qemu:
         if self.monitor is not None:
             args.append("-monitor")
             args.append(self.monitor)
+        if self._qmp is not None:
+            args.append("-mon")
+            args.append("chardev={},mode=control".format(self._qmp))
         # Add command line arguments for all devices.
         for device in self._devices:
             args.extend(device.qemu_options)
         for drive in self._drives:
+            if self.machine == "microvm" and "if" not in drive.options:
+                drive = Drive(dict(drive.options, **{"if": "none"}))
             args.extend(drive.qemu_options)
         # Add any additional arguments
         args.extend(extra_args)
@@ -490,6 +910,29 @@ class Qemu:
         self._chardevs[qemu_id] = chardev
         return chardev
 
+    def add_chardev_socket(self, qemu_id: str) -> SocketCharDev:
+        """
+        Add a character device connected to a Unix socket of the host.
+
+        :arg qemu_id:
+            Internal qemu identifier, can be associated with qemu
+            devices later (such as a isa-serial-port device).
+        :returns:
+            SocketCharDev with the listening socket as resource.
+
+        QEMU connects to the socket as it starts up, the connection is
+        accepted by :meth:`start`. The socket is full-duplex and has flow
+        control, like a pair of FIFOs, but needs no waiting for QEMU to open
+        the other end.
+        """
+        if qemu_id in self._chardevs:
+            raise ValueError(
+                "cannot use identifier {!a}, already used".format(qemu_id))
+        listener = UnixListener(tempfile.mktemp(prefix=qemu_id))
+        chardev = SocketCharDev(qemu_id, listener)
+        self._chardevs[qemu_id] = chardev
+        return chardev
+
     def remove_chardev(self, chardev: CharDev) -> None:
         """
         Remove a character device.
@@ -527,6 +970,61 @@ class Qemu:
         self._devices.append(device)
         return device
 
+    def add_device_virtio_serial_port(self, qemu_chardev_id: str) -> Device:
+        """
+        Add a virtio-serial port to the virtual machine.
+
+        :arg qemu_chardev_id:
+            Internal qemu identifier that must refer to a character device.
+
+        The first port also adds the virtio-serial controller. Ports
+        don't emulate an UART and show up in the guest as /dev/vport0pN.
+        """
+        if qemu_chardev_id not in self._chardevs:
+            raise ValueError(
+                "cannot find chardev {!a}".format(qemu_chardev_id))
+        count = 0
+        for device in self._devices:
+            if device.qemu_type == "virtserialport":
+                count += 1
+        if count == 0:
+            self._devices.append(Device(
+                self._virtio_type("virtio-serial"), "id=virtio-serial0", {}))
+        # Port zero is reserved for a console, start numbering from one.
+        nr = count + 1
+        device = Device(
+            "virtserialport",
+            "bus=virtio-serial0.0,nr={},chardev={},name={}".format(
+                nr, qemu_chardev_id, qemu_chardev_id), {
+                "guest-ttyname": "vport0p{}".format(nr)
+            })
+        self._devices.append(device)
+        return device
+
+    def add_device_vhost_vsock(self, guest_cid: int) -> Device:
+        """
+        Add a vsock device, giving the guest the context identifier guest_cid.
+
+        The context identifier must be unique across all the virtual machines
+        running on the host, and at least three.
+        """
+        qemu_type = self._virtio_type("vhost-vsock")
+        for device in self._devices:
+            if device.qemu_type == qemu_type:
+                raise ValueError("cannot add another {} device".format(
+                    qemu_type))
+        device = Device(qemu_type, "guest-cid={}".format(guest_cid), {
+            "guest-cid": guest_cid,
+        })
+        self._devices.append(device)
+        return device
+
+    def _virtio_type(self, name: str) -> str:
+        """Get the type of a virtio device for the transport of the machine."""
+        if self.machine == "microvm":
+            return "{}-device".format(name)
+        return "{}-pci".format(name)
+
     def add_device_isa_debug_exit(self) -> Device:
         """
         Add a debugging device that can instruct QEMU to exit.
@@ -545,7 +1043,8 @@ class Qemu:
         self._devices.append(device)
         return device
 
-    def add_serial_port_with_fifos(self, qemu_id: str) -> SerialPortFIFOs:
+    def add_serial_port_with_fifos(self, qemu_id: str, *,
+                                   virtio: bool=False) -> SerialPortFIFOs:
         """
         Add a QEMU pipe chardev and associate it with a ISA serial port.
 
@@ -554,18 +1053,58 @@ class Qemu:
         can refer to the `fifo_in` and `fifo_out` properties to interact
         with the serial port. The associated resources are automatically
         managed and are cleaned up when the machine terminates.
+
+        With virtio set, a virtio-serial port is used instead of an emulated
+        UART, for much higher throughput.
         """
         file_name = tempfile.mktemp(prefix=qemu_id)
         chardev = self.add_chardev_pipe(qemu_id, file_name)
         try:
-            device = self.add_device_isa_serial(qemu_id)
+            if virtio:
+                device = self.add_device_virtio_serial_port(qemu_id)
+            else:
+                device = self.add_device_isa_serial(qemu_id)
         except ValueError:
             self.remove_chardev(chardev)
+            raise
         return SerialPortFIFOs(chardev, device, {
             "fifo-in": chardev.attrs["fifo-in"],
             "fifo-out": chardev.attrs["fifo-out"],
         })
 
+    def add_serial_port_with_socket(self, qemu_id: str, *,
+                                    virtio: bool=False) -> SerialPortSocket:
+        """
+        Add a socket chardev and associate it with a ISA serial port.
+
+        This is like :meth:`add_serial_port_with_fifos`, with a Unix socket
+        in place of the two FIFOs.
+        """
+        chardev = self.add_chardev_socket(qemu_id)
+        try:
+            if virtio:
+                device = self.add_device_virtio_serial_port(qemu_id)
+            else:
+                device = self.add_device_isa_serial(qemu_id)
+        except ValueError:
+            self.remove_chardev(chardev)
+            raise
+        return SerialPortSocket(chardev, device)
+
+    def add_vsock_port(self) -> VsockPort:
+        """
+        Add a vsock device and a host socket the guest can connect to.
+
+        The guest gets a random context identifier and the host socket
+        listens on a port picked by the kernel. The socket is automatically
+        closed when the machine terminates.
+        """
+        guest_cid = random.randint(3, 0x7fffffff)
+        device = self.add_device_vhost_vsock(guest_cid)
+        listener = VsockListener()
+        self._resources.append(listener)
+        return VsockPort(listener, device)
+
     def add_monitor_with_fifos(self, qemu_id: str='monitor') -> MonitorFIFOs:
         """Add a QEMU pipe chardev and associate it with the QEMU monitor."""
         file_name = tempfile.mktemp(prefix=qemu_id)
@@ -576,12 +1115,54 @@ class Qemu:
             "fifo-out": chardev.attrs["fifo-out"],
         })
 
+    def add_qmp_with_fifos(self, qemu_id: str='qmp') -> MonitorFIFOs:
+        """Add a QEMU pipe chardev and use it for QMP."""
+        if self._qmp is not None:
+            raise ValueError("cannot add another QMP chardev")
+        file_name = tempfile.mktemp(prefix=qemu_id)
+        chardev = self.add_chardev_pipe(qemu_id, file_name)
+        self._qmp = chardev.qemu_id
+        return MonitorFIFOs(chardev, {
+            "fifo-in": chardev.attrs["fifo-in"],
+            "fifo-out": chardev.attrs["fifo-out"],
+        })
+
+    def add_qmp_with_socket(self, qemu_id: str='qmp') -> SocketCharDev:
+        """Add a socket chardev and use it for QMP."""
+        if self._qmp is not None:
+            raise ValueError("cannot add another QMP chardev")
+        chardev = self.add_chardev_socket(qemu_id)
+        self._qmp = chardev.qemu_id
+        return chardev
+
     def add_drive(self, **opts: str) -> Drive:
         """Add a hard disk drive."""
         drive = Drive(opts)
         self._drives.append(drive)
         return drive
 
+    def add_drive_overlay(self, backing: str, **opts: str) -> Drive:
+        """
+        Add a hard disk drive backed by a qcow2 image that is never written.
+
+        The writes of the guest go to a thin overlay owned by the machine,
+        even in global snapshot mode, so that the same golden image can back
+        any number of machines and be inspected afterwards.
+        """
+        overlay = Overlay.create(
+            tempfile.mktemp(prefix="overlay", suffix=".qcow2"), backing)
+        self._resources.append(overlay)
+        return self.add_drive(**dict(
+            opts, file=cast(str, overlay.path), format="qcow2",
+            snapshot="off"))
+
+    def add_device_virtio_blk(self, qemu_drive_id: str) -> Device:
+        """Add a virtio block device for the drive with the given id."""
+        device = Device(self._virtio_type("virtio-blk"),
+                        "drive={}".format(qemu_drive_id), {})
+        self._devices.append(device)
+        return device
+
 
 class BootError(Exception):
     """Exception raised when we cannot boot successfully."""
@@ -595,6 +1176,209 @@ class BadRequest(Exception):
     """The requested operation cannot be processed."""
 
 
+class QMPError(BadRequest):
+    """QEMU rejected a QMP command."""
+
+
+class LatencyHistogram:
+    """Histogram of latencies, in buckets that double in size."""
+
+    def __init__(self) -> None:
+        # Bucket i counts latencies from 2**i up to 2**(i+1) microseconds.
+        self.buckets = {}  # type: Dict[int, int]
+        self.count = 0
+        self.total_ns = 0
+        self.max_ns = 0
+
+    def add(self, ns: int) -> None:
+        """Add a latency, in nanoseconds."""
+        bucket = max(ns // 1000, 1).bit_length() - 1
+        self.buckets[bucket] = self.buckets.get(bucket, 0) + 1
+        self.count += 1
+        self.total_ns += ns
+        self.max_ns = max(self.max_ns, ns)
+
+    def __str__(self) -> str:
+        if self.count == 0:
+            return "n=0"
+        return "n={} mean={:.0f}us max={:.0f}us [{}]".format(
+            self.count, self.total_ns / self.count / 1000,
+            self.max_ns / 1000, " ".join(
+                "{}us:{}".format(2 ** bucket, self.buckets[bucket])
+                for bucket in sorted(self.buckets)))
+
+
+class RequestLatency:
+    """
+    Latencies of requests of one kind.
+
+    The guest histogram has the time init took to carry out requests, as
+    reported in replies, the host histogram has the time from sending each
+    request to getting the reply. The difference is the cost of transport.
+    """
+
+    def __init__(self) -> None:
+        self.guest = LatencyHistogram()
+        self.host = LatencyHistogram()
+        self.cpu = LatencyHistogram()
+        self.max_rss_kb = 0
+
+
+# Start of PS4 of traced shell scripts, see "sh-run SIZE trace" in init.
+_SH_TRACE_MARKER = "@prof@"
+_SH_TRACE_PS4 = "+{}$LINENO@ ".format(_SH_TRACE_MARKER)
+# A function definition in the style of the scripts, "name()" at the start
+# of a line.
+_SH_FUNCTION_RE = re.compile(r"^(\s*)([A-Za-z_][A-Za-z0-9_]*)\s*\(\s*\)")
+
+
+def sh_instrument(text: str, fname: str) \
+        -> Tuple[str, Dict[str, Tuple[str, int]]]:
+    """
+    Instrument the functions of a shell script for :class:`ShellProfile`.
+
+    Each function NAME is renamed to __prof_NAME and a function NAME that
+    calls it between two no-op commands, which show up in the xtrace of
+    calls, is defined on a new line after the first one. Other lines keep
+    their numbers, plus one.
+
+    :returns:
+        Tuple (text, functions), where functions maps the names of the
+        functions to their file and line in the original script.
+    """
+    lines = text.split("\n")
+    functions = {}  # type: Dict[str, Tuple[str, int]]
+    if "__prof_" in text:
+        # Instrumented already.
+        return text, functions
+    for i, line in enumerate(lines):
+        match = _SH_FUNCTION_RE.match(line)
+        if match is None:
+            continue
+        name = match.group(2)
+        functions[name] = (fname, i + 1)
+        lines[i] = "{}__prof_{}{}".format(
+            match.group(1), name, line[match.end(2):])
+    wrappers = " ".join(
+        "{name}() {{ : {marker}enter {name}; __prof_{name} \"$@\"; "
+        "set -- $?; : {marker}leave {name}; return \"$1\"; }};".format(
+            name=name, marker=_SH_TRACE_MARKER)
+        for name in sorted(functions))
+    lines.insert(1, wrappers)
+    return "\n".join(lines), functions
+
+
+class ShellProfile:
+    """
+    Costs of the lines and functions of traced shell scripts.
+
+    Each command in the xtrace of a script costs the time until the next
+    command is traced. The costs add up per line (per command, where the
+    shell doesn't know line numbers), per function and per stack of calls.
+    The stacks can be saved in the folded format of flame graphs.
+    """
+
+    def __init__(self) -> None:
+        # Functions of instrumented scripts, see sh_instrument().
+        self.functions = {}  # type: Dict[str, Tuple[str, int]]
+        # Total cost, count and a sample command, per line.
+        self.lines = {}  # type: Dict[str, List[Any]]
+        # Total inclusive cost and count, per function.
+        self.calls = {}  # type: Dict[str, List[int]]
+        # Total cost, per stack.
+        self.stacks = {}  # type: Dict[str, int]
+
+    def _where(self, stack: List[str], lineno: Optional[int],
+               cmd: str) -> str:
+        """Get the location of a traced command."""
+        if lineno is None:
+            return cmd.split("\n")[0][:60]
+        if stack and stack[-1] in self.functions:
+            fname, line = self.functions[stack[-1]]
+            # Shells of the ash family count lines from the start of the
+            # function, others from the start of the (instrumented) file.
+            if lineno < line + 1:
+                return "{}:{}".format(fname, line + lineno - 1)
+            return "{}:{}".format(fname, lineno - 1)
+        return "script:{}".format(lineno)
+
+    def add_trace(self, events: Sequence[Tuple[int, str]], end_ns: int,
+                  root: str="sh") -> None:
+        """
+        Add the xtrace of one script.
+
+        :arg events:
+            Sequence of (time_ns, line) tuples, with the lines of xtrace.
+        :arg end_ns:
+            Time the script finished at.
+        :arg root:
+            Name of the bottom frame of stacks.
+        """
+        enter = "{}enter ".format(_SH_TRACE_MARKER)
+        leave = "{}leave ".format(_SH_TRACE_MARKER)
+        parsed = []  # type: List[Tuple[int, Optional[int], str]]
+        for time_ns, line in events:
+            head, _, cmd = line.lstrip("+").partition("@ ")
+            lineno_text = head[len(_SH_TRACE_MARKER):]
+            parsed.append((time_ns, int(lineno_text)
+                           if lineno_text.isdigit() else None, cmd))
+        stack = []  # type: List[str]
+        started = []  # type: List[int]
+        ends = [time_ns for time_ns, _, _ in parsed[1:]] + [end_ns]
+        for i, ((time_ns, lineno, cmd), next_ns) in enumerate(
+                zip(parsed, ends)):
+            cost = next_ns - time_ns
+            # The commands of the wrappers: the markers, the call of the
+            # renamed function and the two commands around leaving it.
+            wrapper = (cmd.startswith(": " + _SH_TRACE_MARKER) or
+                       cmd.startswith("__prof_") or
+                       (i + 1 < len(parsed) and
+                        parsed[i + 1][2].startswith(": " + leave)) or
+                       (i > 0 and parsed[i - 1][2].startswith(": " + leave)))
+            if cmd.startswith(": " + enter):
+                stack.append(cmd[len(enter) + 2:])
+                started.append(time_ns)
+            elif cmd.startswith(": " + leave) and stack:
+                self._add_call(stack.pop(), next_ns - started.pop())
+            where = ("(wrapper)" if wrapper else
+                     self._where(stack, lineno, cmd))
+            entry = self.lines.setdefault(where, [0, 0, cmd])
+            entry[0] += cost
+            entry[1] += 1
+            key = ";".join([root] + stack + [where])
+            self.stacks[key] = self.stacks.get(key, 0) + cost
+        # Functions that never returned, such as after exit.
+        while stack:
+            self._add_call(stack.pop(), end_ns - started.pop())
+
+    def _add_call(self, name: str, cost: int) -> None:
+        entry = self.calls.setdefault(name, [0, 0])
+        entry[0] += cost
+        entry[1] += 1
+
+    def save_folded(self, path: str) -> None:
+        """Append the stacks and their costs, in ns, to a folded file."""
+        with open(path, "a") as stream:
+            stream.write("".join(
+                "{} {}\n".format(stack, cost)
+                for stack, cost in sorted(self.stacks.items())))
+
+    def report(self, limit: int=20) -> str:
+        """Format the most costly functions and lines."""
+        lines = ["{:>12} {:>6}  function".format("total [us]", "calls")]
+        for name, (cost, count) in sorted(
+                self.calls.items(), key=lambda item: -item[1][0])[:limit]:
+            lines.append("{:>12} {:>6}  {}".format(cost // 1000, count, name))
+        lines.append("{:>12} {:>6}  line".format("total [us]", "count"))
+        for where, (cost, count, cmd) in sorted(
+                self.lines.items(), key=lambda item: -item[1][0])[:limit]:
+            sample = cmd.split("\n")[0][:40]
+            lines.append("{:>12} {:>6}  {}".format(
+                cost // 1000, count, where if where.startswith(sample)
+                else "{}  {}".format(where, sample)))
+        return "\n".join(lines)
+
+
 class TestVM:
     """Virtual machine for testing initrd."""
 
@@ -606,9 +1390,40 @@ class TestVM:
         self._booted = asyncio.Event()
         # The asyncio.subprocess.Process representing qemu.
         self._proc = None  # type: Optional[asyncio.subprocess.Process]
-        self._testio = None  # type: Optional[SerialPortFIFOs]
-        self._console = None  # type: Optional[SerialPortFIFOs]
+        self._testio = \
+            None  # type: Optional[Union[SerialPortSocket, VsockPort]]
+        self._console = None  # type: Optional[SerialPortSocket]
+        self._qmp = None  # type: Optional[QMPClient]
         self._qemu = None  # type: Optional[Qemu]
+        # State of the framed test I/O protocol. Once enabled, a background
+        # task reads all the frames and resolves pending requests by id.
+        self._framed = False
+        self._next_request_id = 1
+        self._pending = {}  # type: Dict[int, asyncio.Future[Dict[Any, Any]]]
+        # Output streamed by pending requests, as (stream, data) tuples.
+        self._outputs = {}  # type: Dict[int, List[Tuple[int, bytes]]]
+        # Time when each pending request was sent, in nanoseconds.
+        self._sent_ns = {}  # type: Dict[int, int]
+        # Timing of the boot, as reported by init in the boot-ok event.
+        self.boot_timing = {}  # type: Dict[str, int]
+        # Latencies of requests per scope (test) and command.
+        self.latency = {}  # type: Dict[str, Dict[str, RequestLatency]]
+        self.latency_scope = "boot"
+        # Name of the snapshot that init keeps a file system checkpoint on
+        # top of, if any. Loading a snapshot drops the checkpoint.
+        self.checkpoint_base = None  # type: Optional[str]
+        self._checkpoints = True
+        self._frames_task = None  # type: Optional[asyncio.Future[None]]
+
+    @property
+    def framed(self) -> bool:
+        """Get the flag indicating that the framed protocol is in use."""
+        return self._framed
+
+    @property
+    def running(self) -> bool:
+        """Get the flag indicating that QEMU was started and not stopped."""
+        return self._proc is not None
 
     def cleanup(self) -> None:
         if self._qemu is not None:
@@ -619,11 +1434,43 @@ class TestVM:
         make = await asyncio.create_subprocess_exec("make", "--silent")
         return await make.wait()
 
-    async def boot(self, timeout: int=5) -> None:
-        """Wait until the machine boots and is ready for testing."""
+    async def boot(self, timeout: int=5, *, framed: bool=True,
+                   transport: str="isa-serial", machine: str="pc",
+                   template: Optional[str]=None,
+                   fixture: Optional[str]=None) -> None:
+        """
+        Wait until the machine boots and is ready for testing.
+
+        :arg timeout:
+            Number of seconds to wait for the boot-ok event.
+        :arg framed:
+            Flag indicating that the framed test I/O protocol should be used,
+            when supported by the init process. Otherwise the text protocol
+            is used and each request waits for the previous reply.
+        :arg transport:
+            Transport used for test I/O, one of "isa-serial" (an emulated
+            UART), "virtio-serial" or "vsock". The latter two are much faster
+            but need virtio support in the kernel of the guest.
+        :arg machine:
+            Type of machine, "pc" or "microvm". The microvm machine boots a
+            lot faster, but needs virtio-mmio support in the kernel of the
+            guest for the virtio transports.
+        :arg template:
+            Path of a template saved by :meth:`save_template`, by a machine
+            booted with the same transport and machine type. The machine
+            then resumes from the template instead of booting.
+        :arg fixture:
+            Layout of a disk fixture made by "make fixtures", "gpt" or "mbr",
+            to attach as a virtio disk. The guest finds its system-boot and
+            writable partitions by label.
+        """
+        if template is not None and transport == "vsock":
+            # The context identifier of the guest is part of the template.
+            raise ValueError("cannot clone a template with vsock transport")
         # Use full system emulation of x86_64, with kvm and just enough memory
         # to load our kernel and initrd.
         qemu = self._qemu = Qemu("qemu-system-x86_64")
+        qemu.machine = machine
         if os.path.exists("/dev/kvm"):
             qemu.enable_kvm = True
         qemu.memory = 64
@@ -634,38 +1481,70 @@ class TestVM:
         # Add a small disk and enable global snapshot mode.
         qemu.snapshot = True
         qemu.add_drive(file='disk.img')
+        if fixture is not None:
+            qemu.add_drive_overlay("fixture-{}.qcow2".format(fixture),
+                                   id="fixture", **{"if": "none"})
+            qemu.add_device_virtio_blk("fixture")
 
-        # Redirect QEMU monitor (the human one, not qpm) to another chardev.
-        self._monitor = qemu.add_monitor_with_fifos()
+        # Talk to QEMU over QMP, on another chardev. Unlike the human monitor
+        # it tells exactly when a command, such as savevm, has completed.
+        self._qmp = QMPClient(qemu.add_qmp_with_socket())
 
-        # Add two serial ports backed by local FIFOs:
+        # Add two serial ports backed by local Unix sockets, which QEMU
+        # connects to right away:
         #  - console for observing the boot process and simple interactions
         #  - testio for capturing output from tests, reliably
-        console = self._console = qemu.add_serial_port_with_fifos("console")
-        testio = self._testio = qemu.add_serial_port_with_fifos("testio")
+        # Test I/O can also use a virtio-serial port or a vsock socket.
+        console = self._console = qemu.add_serial_port_with_socket("console")
+        testio = None  # type: Optional[Union[SerialPortSocket, VsockPort]]
+        if transport == "isa-serial":
+            testio = qemu.add_serial_port_with_socket("testio")
+        elif transport == "virtio-serial":
+            testio = qemu.add_serial_port_with_socket("testio", virtio=True)
+        elif transport == "vsock":
+            testio = qemu.add_vsock_port()
+        else:
+            raise ValueError("cannot use transport {!a}".format(transport))
+        self._testio = testio
 
         # Add a special debug device that we can use to exit qemu quickly.
         qemu.add_device_isa_debug_exit()
 
         # Use our kernel and back-to-back initrd and set command line.
         qemu.kernel = "kernel"
-        qemu.initrd = "initrd.back-to-back.cpio.gz"
-        qemu.append = " ".join([
+        qemu.initrd = "initrd"
+        append = [
             # Boot in quiet mode, this is just nicer.
             "quiet",
             # Redirect console to the "consle" serial port.
             "console={}".format(console.guest_ttyname),
+        ]
+        if machine == "microvm":
+            # Don't probe for hardware that the microvm machine doesn't have,
+            # and trust the TSC instead of calibrating it against the PIT.
+            append.extend([
+                "pci=off", "i8042.noaux", "i8042.nomux", "i8042.nopnp",
+                "i8042.dumbkbd", "tsc=reliable", "no_timer_check",
+            ])
+        append.extend([
             "--",
             # Instruct our special init process about testio serial port.
             "testio={}".format(testio.guest_ttyname)
         ])
+        qemu.append = " ".join(append)
+        if template is not None:
+            await self._resume_template(template, timeout)
+            if framed:
+                await self._enable_framed_protocol()
+            return
         # Start qemu and process everything.
         # This should finish in a few seconds.
         self._proc = await qemu.start()
+        # QMP is ready long before the guest.
+        qmp_task = asyncio.ensure_future(self._qmp.open())
         tasks = [
             asyncio.ensure_future(self._booted.wait()),
             asyncio.ensure_future(self._drain_console()),
-            asyncio.ensure_future(self._drain_monitor()),
             asyncio.ensure_future(self._drain_testio()),
         ]  # type: List[asyncio.Future[Any]]
         done, pending = await asyncio.wait(
@@ -674,73 +1553,169 @@ class TestVM:
         for task in pending:
             task.cancel()
         if not self._booted.is_set():
+            qmp_task.cancel()
             raise BootError("test init process did not signal boot-ok")
+        await qmp_task
+        if framed:
+            await self._enable_framed_protocol()
+
+    async def save_template(self, path: str) -> None:
+        """
+        Save the state of a freshly booted machine as a template.
+
+        The machine must have been booted with framed=False and must not have
+        handled any requests yet, so that clones can pick up test I/O as if
+        init had just signalled boot-ok. The state is migrated to the file at
+        path, the boot timing to path.json. The machine keeps running.
+        """
+        if self._framed:
+            raise StateError("cannot save template after enabling framing")
+        await self.qmp("migrate", uri="exec:cat > {}".format(
+            shlex.quote(path)))
+        while True:
+            info = await self.qmp("query-migrate")
+            status = info.get("status")
+            if status == "completed":
+                break
+            if status in ("failed", "cancelled"):
+                raise BadRequest(info)
+            await asyncio.sleep(0.01)
+        await self.qmp("cont")
+        with open(path + ".json", "w") as stream:
+            json.dump(self.boot_timing, stream)
+
+    async def _resume_template(self, template: str, timeout: int) -> None:
+        """Start the machine from a template, see :meth:`save_template`."""
+        if self._qemu is None or self._qmp is None:
+            raise StateError("cannot resume template without a machine")
+        with open(template + ".json") as stream:
+            self.boot_timing = json.load(stream)
+        self._proc = await self._qemu.start("-incoming", "defer")
+        await self._qmp.open()
+        resumed = self._qmp.subscribe("RESUME")
+        try:
+            await self.qmp("migrate-incoming", uri="exec:cat {}".format(
+                shlex.quote(template)))
+            await asyncio.wait_for(resumed.get(), timeout=timeout)
+        except asyncio.TimeoutError:
+            raise BootError("machine did not resume from template")
+        finally:
+            self._qmp.unsubscribe(resumed)
+        self._booted.set()
+
+    async def _enable_framed_protocol(self) -> None:
+        """Switch test I/O to the framed protocol, if supported."""
+        try:
+            await self.rpc("framed")
+        except BadRequest:
+            _logger.warning("init does not support framed protocol")
+            return
+        self._framed = True
+        self._frames_task = asyncio.ensure_future(self._process_frames())
 
     async def savevm(self, name: str) -> None:
         """Save snapshot of the virtual machine."""
-        await self.monitor("savevm {}".format(name))
+        output = await self.monitor("savevm {}".format(name))
+        if output != "":
+            raise BadRequest(output)
 
     async def loadvm(self, name: str) -> None:
         """Load snapshot of the virtual machine."""
-        await self.monitor("loadvm {}".format(name))
+        output = await self.monitor("loadvm {}".format(name))
+        if output != "":
+            raise BadRequest(output)
+        self.checkpoint_base = None
 
-    async def monitor(self, cmd: str) -> None:
+    async def checkpoint(self, base: str) -> bool:
         """
-        Issue a request to the QEMU monitor.
+        Checkpoint the file system of the virtual machine.
 
-        :arg cmd:
-            Command for the QEMU monitor.
-        """
-        reader = self._monitor.reader
-        if reader is None:
-            raise TypeError("monitor is not ready for reading")
-        writer = self._monitor.writer
-        if writer is None:
-            raise TypeError("monitor is not ready for writing")
+        Init moves into an overlay of the file system and :meth:`restore`
+        then drops all changes made since and kills all processes started
+        since. This is a lot faster than loading a snapshot.
 
-        # Write request header and data.
-        req = '{}\n'.format(cmd).encode("utf-8")
-        _logger.info("(monitor) -> %r", req)
-        writer.write(req)
+        :arg base:
+            Name of the snapshot that was loaded last.
+        :returns:
+            True if init supports checkpoints.
+        """
+        if not self._checkpoints:
+            return False
+        try:
+            await self.rpc("checkpoint")
+        except BadRequest:
+            _logger.warning("init does not support checkpoints")
+            self._checkpoints = False
+            return False
+        self.checkpoint_base = base
+        return True
+
+    async def restore(self) -> None:
+        """Restore the file system checkpoint taken by checkpoint."""
+        await self.rpc("restore")
+
+    async def qmp(self, cmd: str, **arguments: Any) -> Any:
+        """
+        Execute a QMP command and return its result.
 
-        # Send request data and process console.
-        request_task = asyncio.ensure_future(writer.drain())
+        The console is processed while QEMU handles the command, so that
+        QEMU is never stuck writing to it.
+        """
+        if self._qmp is None:
+            raise StateError("cannot use QMP of a machine that is not running")
+        qmp_task = asyncio.ensure_future(self._qmp.execute(cmd, **arguments))
         console_task = asyncio.ensure_future(self._drain_console())
         try:
-            while not request_task.done():
-                tasks = [console_task]
-                if not request_task.done():
-                    tasks.append(request_task)
+            while not qmp_task.done():
+                tasks = [qmp_task]  # type: List[asyncio.Future[Any]]
+                if not console_task.done():
+                    tasks.append(console_task)
                 await asyncio.wait(tasks, return_when=asyncio.FIRST_COMPLETED)
         finally:
-            if not request_task.done():
-                request_task.cancel()
+            if not qmp_task.done():
+                qmp_task.cancel()
             if not console_task.done():
                 console_task.cancel()
+        return qmp_task.result()
+
+    async def monitor(self, cmd: str) -> str:
+        """
+        Issue a request to the human QEMU monitor, wrapped in QMP.
 
-        # Read qemu response, this will contain the request as it was "typed",
-        # plus some ANSI escape codes. Just strip those out and ensure the
-        # response is what we expected. This is a poor man's way of handing the
-        # protocol intended for humans but it is good enough for this one thing
-        # we need.
-        resp = await reader.readline()
-        resp = resp[resp.rindex(b"\x1b[D") + 3:]
-        resp = resp[:resp.index(b"\x1b[K")]
-        resp += b"\n"
-        if resp != req:
-            raise BadRequest(resp)
+        :arg cmd:
+            Command for the QEMU monitor.
+        :returns:
+            Output of the command.
+        """
+        output = await self.qmp("human-monitor-command", **{
+            "command-line": cmd})
+        return cast(str, output)
 
     async def shutdown(self) -> int:
         """Stop the virtual machine and return the exit code."""
         if self._proc is None:
             raise StateError(
                 "cannot stop virtual machine that was not started")
-        # If this doesn't complete then just kill qemu.
+        # Ask QEMU to quit and if this doesn't complete then just kill it.
         try:
-            self._proc.kill()
-        except ProcessLookupError:
+            await asyncio.wait_for(self.qmp("quit"), timeout=1)
+        except (asyncio.TimeoutError, BadRequest, StateError):
             pass
+        try:
+            await asyncio.wait_for(self._proc.wait(), timeout=1)
+        except asyncio.TimeoutError:
+            try:
+                self._proc.kill()
+            except ProcessLookupError:
+                pass
         await self._proc.wait()
+        if self._qmp is not None:
+            self._qmp.close()
+            self._qmp = None
+        if self._frames_task is not None:
+            self._frames_task.cancel()
+            self._frames_task = None
+        self._framed = False
         returncode = self._proc.returncode
         self._proc = None
         if self._qemu is not None:
@@ -765,36 +1740,143 @@ class TestVM:
         :returns:
             Tuple (response, console_log)
         """
-        console_log = []  # type: List[bytes]
+        responses, console_log = await self.rpc_pipeline(
+            [(cmd, data)], timeout=timeout, log_output=log_output)
+        return (responses[0], console_log)
+
+    async def rpc_pipeline(self, requests: Sequence[Tuple[str, bytes]], *,
+                           timeout: Optional[int]=None,
+                           log_output: bool=False) \
+            -> Tuple[List[Optional[Dict[Any, Any]]], List[bytes]]:
+        """
+        Make a sequence of RPC requests to the init process in the test VM.
+
+        :arg requests:
+            Sequence of (cmd, data) tuples, as accepted by :meth:`rpc`.
+        :arg timeout:
+            Timeout after which the request fails.
+        :arg log_output:
+            Flag indicating if console output should be collected.
+        :returns:
+            Tuple (responses, console_log)
+
+        With the framed protocol all the requests are sent without waiting for
+        any replies and the replies are matched to requests by identifier,
+        in whatever order they arrive. With the text protocol each request
+        waits for the reply to the previous one.
+
+        With the framed protocol, output of programs is streamed over test
+        I/O rather than printed on the console. The exact output is stored in
+        the "stdout" and "stderr" items of the response, the "output" item
+        has both streams interleaved in the order they were written, and
+        console_log is made of its lines. The console is still read (and
+        logged) but its lines are not collected.
+        """
         if self._testio is None:
             raise TypeError("testio is not ready")
         writer = self._testio.writer
         if writer is None:
             raise TypeError("testio is not ready for writing")
-
-        # Write request header and data.
-        req = '{}\n'.format(cmd).encode("utf-8")
-        _logger.info("(test io) -> %r", req)
-        writer.write(req)
+        console_log = []  # type: List[bytes]
+        if not self._framed:
+            responses = []  # type: List[Optional[Dict[Any, Any]]]
+            for cmd, data in requests:
+                # Write request header and data.
+                req = '{}\n'.format(cmd).encode("utf-8")
+                _logger.info("(test io) -> %r", req)
+                sent_ns = _monotonic_ns()
+                writer.write(req)
+                self._log_request_data(data)
+                writer.write(data)
+                response = await self._wait_for_reply(
+                    self._read_and_decode_testio(), console_log, log_output)
+                if response is not None:
+                    response["host_ns"] = _monotonic_ns() - sent_ns
+                responses.append(response)
+        else:
+            loop = asyncio.get_event_loop()
+            futures = []  # type: List[asyncio.Future[Dict[Any, Any]]]
+            for cmd, data in requests:
+                req_id = self._next_request_id
+                self._next_request_id += 1
+                future = loop.create_future()
+                self._pending[req_id] = future
+                self._sent_ns[req_id] = _monotonic_ns()
+                futures.append(future)
+                # Write request frame, with command and data.
+                head = cmd.encode("utf-8")
+                _logger.info("(test io) -> [%d] %r", req_id, head)
+                writer.write(_FRAME_HEADER.pack(
+                    req_id, FRAME_REQUEST, 0, len(head), len(data)))
+                writer.write(head)
+                self._log_request_data(data)
+                writer.write(data)
+            responses = await self._wait_for_reply(
+                asyncio.gather(*futures), console_log, log_output)
+            if log_output:
+                for response in responses:
+                    if response is not None:
+                        console_log.extend(
+                            response.get("output", b"").splitlines())
+
+        for (cmd, _), response in zip(requests, responses):
+            self._record_latency(cmd, response)
+        # Ensure that all the responses are OK.
+        for response in responses:
+            if response is None or response.get("result") != "ok":
+                raise BadRequest(response)
+
+        return (responses, console_log)
+
+    def _record_latency(self, cmd: str,
+                        response: Optional[Dict[Any, Any]]) -> None:
+        """Add the latency of a request to the statistics of the scope."""
+        if response is None or "host_ns" not in response:
+            return
+        scope = self.latency.setdefault(self.latency_scope, {})
+        stats = scope.setdefault(cmd.split(" ", 1)[0], RequestLatency())
+        stats.host.add(response["host_ns"])
+        if "elapsed_ns" in response:
+            stats.guest.add(response["elapsed_ns"])
+        if "utime_ns" in response:
+            stats.cpu.add(response["utime_ns"] + response["stime_ns"])
+            stats.max_rss_kb = max(stats.max_rss_kb, response["maxrss_kb"])
+
+    def latency_report(self) -> str:
+        """Format the latency statistics, per scope and command."""
+        lines = []  # type: List[str]
+        for scope_name, scope in sorted(self.latency.items()):
+            lines.append("{}:".format(scope_name))
+            for cmd, stats in sorted(scope.items()):
+                lines.append("  {} host: {}".format(cmd, stats.host))
+                if stats.guest.count > 0:
+                    lines.append("  {} guest: {}".format(cmd, stats.guest))
+                if stats.cpu.count > 0:
+                    lines.append("  {} cpu: {} maxrss={}kB".format(
+                        cmd, stats.cpu, stats.max_rss_kb))
+        return "\n".join(lines)
+
+    def _log_request_data(self, data: bytes) -> None:
         if len(data) > 0:
             _logger.info("(test io) -> data (%d bytes)", len(data))
             _logger.debug("(test io) << __DATA__")
             for line in data.splitlines():
                 _logger.debug('(test io) .. %s', line)
             _logger.debug("(test io) __DATA__")
-            writer.write(data)
-
-        # Process all I/O
-        request_task = asyncio.ensure_future(writer.drain())
-        response_task = asyncio.ensure_future(self._read_and_decode_testio())
-        console_task = asyncio.ensure_future(
-            self._drain_console(console_log if log_output else None))
-        monitor_task = asyncio.ensure_future(self._drain_monitor())
+
+    async def _wait_for_reply(self, reply: Any, console_log: List[bytes],
+                              log_output: bool) -> Any:
+        """Send buffered requests and wait for reply, processing all I/O."""
+        if self._testio is None or self._testio.writer is None:
+            raise TypeError("testio is not ready for writing")
+        request_task = asyncio.ensure_future(self._testio.writer.drain())
+        response_task = asyncio.ensure_future(reply)
+        console_task = asyncio.ensure_future(self._drain_console(
+            console_log if log_output and not self._framed else None))
         try:
             while not request_task.done() or not response_task.done():
                 tasks = []  # type: List[asyncio.Future[Any]]
                 tasks.append(console_task)
-                tasks.append(monitor_task)
                 if not request_task.done():
                     tasks.append(request_task)
                 if not response_task.done():
@@ -807,15 +1889,7 @@ class TestVM:
                 response_task.cancel()
             if not console_task.done():
                 console_task.cancel()
-            if not monitor_task.done():
-                monitor_task.cancel()
-
-        # Read response and ensure that it is OK.
-        response = response_task.result()
-        if response is None or response.get("result") != "ok":
-            raise BadRequest(response)
-
-        return (response, console_log)
+        return response_task.result()
 
     async def exit(self) -> None:
         """Issue the exit command."""
@@ -841,17 +1915,149 @@ class TestVM:
         """
         result, console_log = await self.rpc(
                 "system {}".format(cmd), log_output=log_output)
+        return self._returncode(result), console_log
+
+    async def _rpc_os(self, cmd: str, fname: str) -> Dict[Any, Any]:
+        """Make a RPC request, raising OSError if it fails with an errno."""
+        try:
+            result, _ = await self.rpc(cmd)
+        except BadRequest as exc:
+            response = exc.args[0] if exc.args else None
+            if isinstance(response, dict) and "errno" in response:
+                raise OSError(response["errno"], response.get("error"), fname)
+            raise
+        return cast(Dict[Any, Any], result)
+
+    async def remote_read(self, fname: str, offset: int=0,
+                          length: Optional[int]=None) -> bytes:
+        """
+        Read a file from the remote system.
+
+        :arg fname:
+            Name of the file to read.
+        :arg offset, length:
+            Part of the file to read, by default all of it.
+        :returns:
+            Contents of the file.
+
+        The file is read by init directly, without starting any programs.
+        Errors are raised as OSError, such as FileNotFoundError.
+        """
+        cmd = "read {}".format(fname)
+        if offset != 0 or length is not None:
+            cmd += " {} {}".format(offset, length if length is not None
+                                   else 2 ** 64 - 1)
+        result = await self._rpc_os(cmd, fname)
+        return cast(bytes, result["data"])
+
+    async def remote_stat(self, fname: str, *,
+                          follow_symlinks: bool=True) -> os.stat_result:
+        """Get status of a file on the remote system, like os.stat()."""
+        result = await self._rpc_os("{} {}".format(
+            "stat" if follow_symlinks else "lstat", fname), fname)
+        times = [result[key] for key in ("atime_ns", "mtime_ns", "ctime_ns")]
+        return os.stat_result(
+            [result["mode"], result["ino"], result["dev"], result["nlink"],
+             result["uid"], result["gid"], result["size"]] +
+            [ns // 10 ** 9 for ns in times], {
+                "st_atime": times[0] / 1e9,
+                "st_mtime": times[1] / 1e9,
+                "st_ctime": times[2] / 1e9,
+                "st_atime_ns": times[0],
+                "st_mtime_ns": times[1],
+                "st_ctime_ns": times[2],
+                "st_rdev": result["rdev"],
+            })
+
+    async def remote_listdir(self, dname: str) -> List[str]:
+        """List names of entries of a directory on the remote system."""
+        result = await self._rpc_os("listdir {}".format(dname), dname)
+        return [os.fsdecode(name)
+                for name in cast(bytes, result["data"]).split(b"\0")[:-1]]
+
+    async def remote_spawn(self, cmds: Sequence[str]) -> List[int]:
+        """
+        Start shell commands as jobs running concurrently on the remote system.
+
+        :arg cmds:
+            Shell commands to start, each one as a separate job.
+        :returns:
+            List of job identifiers, one for each command.
+
+        The output of jobs goes to the console. Jobs must be waited for with
+        :meth:`remote_wait` or they linger in the init process.
+        """
+        responses, _ = await self.rpc_pipeline(
+            [("spawn {}".format(cmd), b"") for cmd in cmds])
+        return [cast(Dict[Any, Any], response)["job"]
+                for response in responses]
+
+    async def remote_wait(self, jobs: Sequence[int], *,
+                          timeout: Optional[int]=None,
+                          log_output: bool=False) \
+            -> Tuple[List[int], List[bytes]]:
+        """
+        Wait for jobs started with :meth:`remote_spawn` to exit.
+
+        :arg jobs:
+            Identifiers of jobs to wait for.
+        :returns:
+            Tuple (returncodes, console_log), with one return code per job.
+
+        With the framed protocol the jobs are waited for all at once, each
+        reply arriving as soon as the job has exited. With the text protocol
+        they are waited for in order.
+        """
+        responses, console_log = await self.rpc_pipeline(
+            [("wait {}".format(job), b"") for job in jobs],
+            timeout=timeout, log_output=log_output)
+        return [self._returncode(response) for response in responses], \
+            console_log
+
+    async def remote_kill(self, job: int, sig: int=signal.SIGTERM) -> None:
+        """Send a signal to all the processes of a job."""
+        await self.rpc("kill {} {}".format(job, int(sig)))
+
+    async def remote_system_all(self, cmds: Sequence[str], *,
+                                log_output: bool=False) \
+            -> Tuple[List[int], List[bytes]]:
+        """
+        Run shell commands concurrently on the remote system.
+
+        :returns:
+            Tuple (returncodes, console_log), with one return code per command.
+        """
+        jobs = await self.remote_spawn(cmds)
+        return await self.remote_wait(jobs, log_output=log_output)
+
+    async def remote_system_output(self, cmd: str) -> Tuple[int, bytes, bytes]:
+        """
+        Run a command on the remote system, capturing its output exactly.
+
+        :returns:
+            Tuple (returncode, stdout, stderr).
+
+        This needs the framed protocol, since with the text protocol output
+        only reaches the console.
+        """
+        if not self._framed:
+            raise StateError("capturing output needs the framed protocol")
+        result, _ = await self.rpc("system {}".format(cmd))
+        return (self._returncode(result),
+                cast(Dict[Any, Any], result).get("stdout", b""),
+                cast(Dict[Any, Any], result).get("stderr", b""))
+
+    def _returncode(self, result: Optional[Dict[Any, Any]]) -> int:
+        """Compute the return code from the response to running a process."""
         if result is None:
             raise ValueError("expected response object from RPC call")
         status = result["status"]
         if status == "exited":
-            returncode = result["code"]
-            return returncode, console_log
+            return cast(int, result["code"])
         elif status == "signaled":
-            returncode = -result["signal"]
+            return -cast(int, result["signal"])
         else:
             raise BadRequest("unexpected status: {!a}".format(status))
-        return returncode, console_log
 
     async def remote_check_system(self, cmd: str, *, log_output: bool=False) \
             -> List[bytes]:
@@ -876,15 +2082,179 @@ class TestVM:
                 None)
         return console_log
 
-    async def remote_write(self, fname: str, mode: int, data: bytes) \
-            -> Dict[Any, Any]:
-        """Write a file on the remote system."""
-        result, _ = await self.rpc("write {} {:o} {}".format(
-            fname, mode, len(data)), data)
+    async def remote_write(self, fname: str, mode: int, data: bytes, *,
+                           compress: Optional[str]=None) -> Dict[Any, Any]:
+        """
+        Write a file on the remote system.
+
+        :arg compress:
+            Name of the codec (gzip, xz, lz4 or zstd) used to compress the
+            data before sending it. The matching decompressor must be present
+            in the virtual machine. This is worth it for large and repetitive
+            files, such as disk images.
+        """
+        if compress is None:
+            result, _ = await self.rpc("write {} {:o} {}".format(
+                fname, mode, len(data)), data)
+        else:
+            payload = compress_data(data, compress)
+            _logger.info("(test io) compressed %d bytes to %d with %s",
+                         len(data), len(payload), compress)
+            result, _ = await self.rpc("write {} {:o} {} {}".format(
+                fname, mode, len(payload), compress), payload)
         if not isinstance(result, dict):
             raise TypeError("expected RPC call to return a JSON object")
         return result
 
+    async def remote_exec(self, argv: Sequence[str], *, cwd: str="/",
+                          env: Optional[Dict[str, str]]=None,
+                          log_output: bool=False) -> Tuple[int, List[bytes]]:
+        """
+        Run a program on the remote system directly, without the shell.
+
+        :arg argv:
+            Program to run, followed by its arguments. The program is looked
+            up in PATH.
+        :arg cwd:
+            Working directory of the program.
+        :arg env:
+            Environment variables set in addition to the environment of init.
+        :arg log_output:
+            Flag indicating that console log should be collected and returned.
+        :returns:
+            Tuple (returncode, console_log), as for :meth:`remote_system`.
+        """
+        env_entries = ["{}={}".format(name, value)
+                       for name, value in sorted((env or {}).items())]
+        data = b"".join(
+            arg.encode("utf-8") + b"\0"
+            for arg in [cwd] + list(argv) + env_entries)
+        result, console_log = await self.rpc("exec {} {} {}".format(
+            len(argv), len(env_entries), len(data)), data,
+            log_output=log_output)
+        return self._returncode(result), console_log
+
+    async def start_shell_server(self, prelude: str) -> None:
+        """
+        (Re)start the shell server in the virtual machine.
+
+        :arg prelude:
+            Shell code sourced once by the server, before it runs any scripts.
+            Functions and variables it defines are visible to every script.
+        """
+        data = "{}\n".format(prelude).encode("utf-8")
+        await self.rpc("sh-server {}".format(len(data)), data)
+
+    async def remote_sh_run(self, script: str, *,
+                            files: Sequence[Tuple[str, int, bytes]]=(),
+                            log_output: bool=False) -> Tuple[int, List[bytes]]:
+        """
+        Run a shell script in a subshell of the shell server.
+
+        :arg script:
+            Shell code to run, sourced in a fresh subshell.
+        :arg files:
+            Sequence of (fname, mode, data) tuples with files to write first.
+        :returns:
+            Tuple (returncode, console_log), as for :meth:`remote_system`.
+
+        All the requests are pipelined, so with the framed protocol this
+        costs a single round-trip to the virtual machine.
+        """
+        requests = [("write {} {:o} {}".format(fname, mode, len(data)), data)
+                    for fname, mode, data in files]
+        data = "{}\n".format(script).encode("utf-8")
+        requests.append(("sh-run {}".format(len(data)), data))
+        responses, console_log = await self.rpc_pipeline(
+            requests, log_output=log_output)
+        return self._returncode(responses[-1]), console_log
+
+    async def remote_sh_trace(self, script: str, *,
+                              files: Sequence[Tuple[str, int, bytes]]=(),
+                              log_output: bool=False) \
+            -> Tuple[int, List[bytes], List[Tuple[int, str]], int]:
+        """
+        Run a shell script in the shell server, with timestamped xtrace.
+
+        :returns:
+            Tuple (returncode, console_log, events, end_ns), where events is
+            a list of (time_ns, line) tuples, one per line of xtrace, and
+            end_ns is the time the script finished at, on the clock of the
+            guest. See :class:`ShellProfile`.
+        """
+        requests = [("write {} {:o} {}".format(fname, mode, len(data)), data)
+                    for fname, mode, data in files]
+        data = "PS4='{}'\nset -x\n{}\n".format(
+            _SH_TRACE_PS4, script).encode("utf-8")
+        requests.append(("sh-run {} trace".format(len(data)), data))
+        responses, console_log = await self.rpc_pipeline(
+            requests, log_output=log_output)
+        response = responses[-1]
+        events = []  # type: List[Tuple[int, str]]
+        for line in response.get("data", b"").decode(
+                "utf-8", "replace").splitlines():
+            time_ns, _, text = line.partition(" ")
+            events.append((int(time_ns), text))
+        return (self._returncode(response), console_log, events,
+                cast(int, response.get("end_ns", 0)))
+
+    async def remote_sh_batch(self, scripts: Sequence[Tuple[str, str]]) \
+            -> List[Tuple[int, List[bytes], bytes]]:
+        """
+        Run many shell scripts in the shell server, in one request.
+
+        :arg scripts:
+            Sequence of (script, collect) tuples. Before each script init
+            restores the checkpoint, so that scripts don't see the changes of
+            each other. After each script the file at path collect is read.
+        :returns:
+            List of (returncode, output, collected) tuples, one per script,
+            with the lines of the output of the script and the contents of
+            the collected file (empty if the file is missing).
+
+        This needs the framed protocol and a checkpoint.
+        """
+        if not self._framed:
+            raise BadRequest("cannot run a batch without framing")
+        bundle = []  # type: List[bytes]
+        for script, collect in scripts:
+            data = "{}\n".format(script).encode("utf-8")
+            bundle.append("{} {}\n".format(len(data), collect).encode(
+                "utf-8"))
+            bundle.append(data)
+        (response,), _ = await self.rpc_pipeline([
+            ("sh-batch", b"".join(bundle))])
+        data = response.get("data", b"")
+        results = []  # type: List[Tuple[int, List[bytes], bytes]]
+        off = 0
+        for run in response["runs"]:
+            output = data[off:off + run["output_len"]]
+            off += run["output_len"]
+            collected = data[off:off + run["file_len"]]
+            off += run["file_len"]
+            results.append(
+                (self._returncode(run), output.splitlines(), collected))
+        return results
+
+    async def remote_write_and_system(self, script: str, *,
+                                      log_output: bool=False) \
+            -> Tuple[int, List[bytes]]:
+        """
+        Write a shell script and execute it via system(3).
+
+        Both requests are pipelined, so with the framed protocol this costs a
+        single round-trip to the virtual machine.
+        """
+        data = "#!/bin/sh\n{}\n".format(script).encode('utf-8')
+        fname = "/tmp/command.sh"
+        (written, result), console_log = await self.rpc_pipeline([
+            ("write {} {:o} {}".format(fname, 0o755, len(data)), data),
+            ("system {}".format(fname), b''),
+        ], log_output=log_output)
+        if written is None or written.get("size") != len(data):
+            raise BadRequest(written)
+        return self._returncode(result), console_log
+
     async def _drain_console(self, log: Optional[List[bytes]]=None) -> None:
         """Read subsequent console messages until they stop."""
         if self._console is None:
@@ -900,21 +2270,11 @@ class TestVM:
             if log is not None:
                 log.append(line.rstrip(b"\r\n"))
 
-    async def _drain_monitor(self, log: Optional[List[bytes]]=None) -> None:
-        """Read subsequent QEMU monitor messages until they stop."""
-        if self._monitor is None:
-            raise TypeError("monitor is not ready")
-        reader = self._monitor.reader
-        if reader is None:
-            raise TypeError("monitor is not ready for reading")
-        while not reader.at_eof():
-            line = await reader.readline()
-            if line == b'':
-                break
-            _logger.info("(monitor) <- %s", line.rstrip(b"\n").decode("utf-8"))
-
     async def _drain_testio(self) -> None:
         """Read subsequent test I/O responses until they stop."""
+        if self._testio is None:
+            raise TypeError("testio is not ready")
+        await self._testio.open()
         while await self._read_and_decode_testio() is not None:
             pass
 
@@ -923,7 +2283,9 @@ class TestVM:
         Read and decode a single test I/O response.
 
         Responses that contain events are automatically acted upon. This is
-        done so that we can observe the "boot-ok" event easily.
+        done so that we can observe the "boot-ok" event easily. Responses
+        with a "data_len" item are followed by that many bytes of data, which
+        are stored in the "data" item.
         """
         if self._testio is None:
             raise TypeError("testio is not ready")
@@ -933,6 +2295,13 @@ class TestVM:
         response_bytes = await reader.readline()
         if response_bytes == b'':
             return None
+        decoded = self._decode_testio(response_bytes)
+        if "data_len" in decoded:
+            decoded["data"] = await reader.readexactly(decoded["data_len"])
+        return decoded
+
+    def _decode_testio(self, response_bytes: bytes) -> Dict[Any, Any]:
+        """Decode a JSON object sent over test I/O, acting on events."""
         response_text = response_bytes.decode('utf-8')
         _logger.info("(test io) <- %s", response_text.rstrip())
         decoded = json.loads(response_text)
@@ -940,36 +2309,311 @@ class TestVM:
             raise TypeError("expected testio to return serialized JSON object")
         event = decoded.get("event")
         if event == "boot-ok":
+            self.boot_timing = {key: value for key, value in decoded.items()
+                                if key.endswith("_ns")}
             self._booted.set()
         return decoded
 
+    async def _process_frames(self) -> None:
+        """
+        Read and dispatch all frames sent over test I/O.
+
+        Replies resolve the future of the pending request with the same
+        identifier, with output frames of that request attached. Events are
+        acted upon in the same way as in text mode.
+        """
+        if self._testio is None:
+            raise TypeError("testio is not ready")
+        reader = self._testio.reader
+        if reader is None:
+            raise TypeError("testio is not ready for reading")
+        try:
+            while True:
+                header = await reader.readexactly(_FRAME_HEADER.size)
+                req_id, kind, flags, head_len, data_len = \
+                    _FRAME_HEADER.unpack(header)
+                head = await reader.readexactly(head_len)
+                data = await reader.readexactly(data_len)
+                if kind == FRAME_OUTPUT:
+                    _logger.debug("(test io) <- [%d] output %d: %r",
+                                  req_id, flags, data)
+                    if req_id in self._pending:
+                        self._outputs.setdefault(req_id, []).append(
+                            (flags, data))
+                elif kind == FRAME_REPLY:
+                    _logger.debug("(test io) <- [%d]", req_id)
+                    future = self._pending.pop(req_id, None)
+                    sent_ns = self._sent_ns.pop(req_id, None)
+                    decoded = self._decode_testio(head)
+                    if decoded is not None and sent_ns is not None:
+                        decoded["host_ns"] = _monotonic_ns() - sent_ns
+                    if decoded is not None and "data_len" in decoded:
+                        decoded["data"] = data
+                    chunks = self._outputs.pop(req_id, [])
+                    if decoded is not None and chunks:
+                        decoded["stdout"] = b"".join(
+                            chunk for stream, chunk in chunks
+                            if stream == STREAM_STDOUT)
+                        decoded["stderr"] = b"".join(
+                            chunk for stream, chunk in chunks
+                            if stream == STREAM_STDERR)
+                        decoded["output"] = b"".join(
+                            chunk for _, chunk in chunks)
+                    if future is not None and not future.done():
+                        future.set_result(decoded)
+                elif kind == FRAME_EVENT:
+                    self._decode_testio(head)
+                else:
+                    _logger.warning("(test io) unexpected frame kind %d", kind)
+        except asyncio.IncompleteReadError:
+            _logger.info("(test io) EOF")
+        finally:
+            for future in self._pending.values():
+                if not future.done():
+                    future.set_exception(StateError("test I/O was closed"))
+            self._pending.clear()
+            self._outputs.clear()
+            self._sent_ns.clear()
+
 
 _tvm = None  # type: Optional[TestVM]
+# Profile of shell scripts, when TESTVM_SH_PROFILE is set, and its path.
+_sh_profile = None  # type: Optional[ShellProfile]
+_sh_profile_path = ""
+# Ids of the tests that the runner was given, which are all that batches
+# collect, or None for all tests.
+_selected_tests = None  # type: Optional[Set[str]]
+
+
+def _is_sh_name(name: str) -> bool:
+    """Check if name can be used as a name of a shell function."""
+    return (name != "" and not name[0].isdigit() and
+            all(c.isalnum() or c == "_" for c in name))
+
+
+# Script and files of the first sh_run of a test, with the result of running
+# them in a batch: exit code, lines of output and log of mocked calls.
+_ShBatchEntry = Tuple[str, Dict[str, bytes], Tuple[int, List[bytes], bytes]]
+
+
+class _ShCollected(BaseException):
+    """Raised by sh_run while the tests of a batch are collected."""
+
+    def __init__(self, script: str, files: Dict[str, bytes]) -> None:
+        super().__init__()
+        self.script = script
+        self.files = files
+
+
+class _ShNotBatched(BaseException):
+    """Raised by requests other than sh_run while collecting a batch."""
 
 
 class VMShellTestCase(unittest.TestCase):
-    """Test case class for testing shell scripts in a virtual machine."""
+    """
+    Test case class for testing shell scripts in a virtual machine.
+
+    Test classes can set SH_SERVER_SOURCES to a tuple of scripts that are
+    sourced, once, by a shell server started before the first test. Each
+    :meth:`sh_run` then only sends the injected fragments, which run in a
+    forked subshell of the server, and :meth:`sh_source` of those scripts
+    does nothing. Aliases don't apply to functions that were already parsed,
+    so in this mode programs with names that are not valid shell function
+    names are mocked with small scripts put on PATH instead.
+
+    Test classes with a shell server can also set SH_BATCH. Then setUpClass
+    runs setUp and each test that the runner holds (of the shard, with
+    --jobs) up to its first sh_run, without the machine, and sends all those
+    scripts in a single request. Init runs each one on
+    top of a fresh checkpoint and sends back the exit codes, the output and
+    the logs of mocked calls. The tests then get their first sh_run, and
+    sh_mocked_calls right after it, from that batch. A test that makes any
+    other request first, or changes its script, runs as usual. A test that
+    makes more requests afterwards gets the machine in the state left by its
+    first script, which is run again just for that.
+
+    With TESTVM_SH_PROFILE=PATH in the environment of helpers.main(), the
+    functions of SH_PROFILE_SCRIPTS are instrumented and each sh_run in the
+    shell server is traced, see :class:`ShellProfile`. The stacks are saved
+    to PATH, in the folded format of flame graphs, and a table of the most
+    costly functions and lines is logged.
+    """
+
+    SH_SERVER_SOURCES = ()  # type: Tuple[str, ...]
+    SH_BATCH = False
+    SH_PROFILE_SCRIPTS = (
+        "/scripts/ubuntu-core-functions",
+        "/scripts/ubuntu-core-rootfs",
+        "/scripts/local-premount/resize",
+    )
+
+    # Directory with mocks of programs, on PATH in the shell server.
+    _SH_MOCK_BIN = "/tmp/mock-bin"
+
+    # Name of the snapshot loaded before each test, set by setUpClass.
+    _sh_snapshot = 'vanilla'
+    _sh_server = False
+    # Results of the batch, by test id, set by setUpClass with SH_BATCH.
+    _sh_batch = {}  # type: Dict[str, _ShBatchEntry]
+    # Set on the tests that setUpClass runs to collect the batch.
+    _sh_collecting = False
 
     def _tvm(self) -> TestVM:
         global _tvm
+        if self._sh_collecting:
+            raise _ShNotBatched()
         if _tvm is None:
             raise ValueError("use helpers.main() to prepare test VM")
+        if not self._sh_prepared:
+            # Catch up with the batch: restore the checkpoint and run the
+            # script that the batch ran for this test.
+            self._sh_prepared = True
+            self._sh_batched = None
+            self._sh_prepare(_tvm)
+            if self._sh_replay is not None:
+                script, files = self._sh_replay
+                self._sh_replay = None
+                self._sh_remote_run(_tvm, script, files)
         return _tvm
 
+    @classmethod
+    def setUpClass(cls) -> None:
+        """
+        Prepare for executing the test cases of the class.
+
+        When SH_SERVER_SOURCES is set this starts the shell server and keeps
+        it in a snapshot that is loaded before each test. If the init process
+        doesn't support the shell server the scripts are sourced by each test,
+        as usual.
+
+        When profiling, the scripts in SH_PROFILE_SCRIPTS are instrumented
+        first, and each sh_run is traced instead of batched.
+        """
+        super().setUpClass()
+        global _tvm
+        if not cls.SH_SERVER_SOURCES or _tvm is None:
+            return
+        prelude = "\n".join(
+            ["mkdir -p {}".format(cls._SH_MOCK_BIN),
+             "PATH={}:$PATH".format(cls._SH_MOCK_BIN)] +
+            [". {}".format(shlex.quote(fname))
+             for fname in cls.SH_SERVER_SOURCES])
+        snapshot = "sh-server-{}".format(cls.__name__)
+        loop = asyncio.get_event_loop()
+        loop.run_until_complete(_tvm.loadvm('vanilla'))
+        if _sh_profile is not None:
+            cls._sh_instrument_scripts(_tvm, _sh_profile)
+        try:
+            loop.run_until_complete(_tvm.start_shell_server(prelude))
+        except BadRequest:
+            _logger.warning("init does not support the shell server")
+            return
+        loop.run_until_complete(_tvm.savevm(snapshot))
+        cls._sh_snapshot = snapshot
+        cls._sh_server = True
+        if cls.SH_BATCH and _sh_profile is None:
+            cls._sh_run_batch(_tvm)
+
+    @classmethod
+    def _sh_instrument_scripts(cls, tvm: TestVM,
+                               profile: ShellProfile) -> None:
+        """Instrument the functions of the scripts to profile, in place."""
+        loop = asyncio.get_event_loop()
+        for fname in cls.SH_PROFILE_SCRIPTS:
+            try:
+                text = loop.run_until_complete(tvm.remote_read(fname))
+            except FileNotFoundError:
+                continue
+            text, functions = sh_instrument(text.decode("utf-8"), fname)
+            profile.functions.update(functions)
+            loop.run_until_complete(tvm.remote_write(
+                fname, 0o755, text.encode("utf-8")))
+
+    @classmethod
+    def _sh_run_batch(cls, tvm: TestVM) -> None:
+        """Collect the first sh_run of each test and run them all at once."""
+        collected = []  # type: List[Tuple[str, str, Dict[str, bytes], str]]
+        for name in unittest.TestLoader().getTestCaseNames(cls):
+            test = cls(name)
+            if _selected_tests is not None \
+                    and test.id() not in _selected_tests:
+                continue
+            test._sh_collecting = True
+            try:
+                test.setUp()
+                getattr(test, name)()
+            except _ShCollected as exc:
+                collected.append(
+                    (test.id(), exc.script, exc.files, test._sh_mock_log))
+            except (_ShNotBatched, Exception):
+                # The test runs on its own.
+                pass
+        if not collected:
+            return
+        loop = asyncio.get_event_loop()
+        tvm.latency_scope = "{}.batch".format(cls.__name__)
+        loop.run_until_complete(tvm.loadvm(cls._sh_snapshot))
+        if not loop.run_until_complete(tvm.checkpoint(cls._sh_snapshot)):
+            return
+        try:
+            results = loop.run_until_complete(tvm.remote_sh_batch([
+                (cls._sh_batch_text(script, files), mock_log)
+                for _, script, files, mock_log in collected]))
+        except BadRequest:
+            _logger.warning("init does not support batches of shell scripts")
+            return
+        cls._sh_batch = {
+            test_id: (script, files, result)
+            for (test_id, script, files, _), result in zip(
+                collected, results)}
+
+    @classmethod
+    def _sh_batch_text(cls, script: str, files: Dict[str, bytes]) -> str:
+        """Get a script of a batch that writes the files of the mocks too."""
+        lines = []  # type: List[str]
+        for fname, data in sorted(files.items()):
+            lines.append("cat >{} <<'__SH_BATCH_EOF__'".format(
+                shlex.quote(fname)))
+            lines.append(data.decode("utf-8").rstrip("\n"))
+            lines.append("__SH_BATCH_EOF__")
+            lines.append("chmod 755 {}".format(shlex.quote(fname)))
+        lines.append(script)
+        return "\n".join(lines)
+
     def setUp(self) -> None:
         """
         Prepare for executing each test case.
 
-        This loads the vanilla snapshot and re-sets the mocking and shell
-        injection system.
+        This restores the vanilla snapshot and re-sets the mocking and shell
+        injection system. Latencies of requests are recorded per test.
+
+        The snapshot is loaded once and checkpointed by init, later tests
+        just restore the checkpoint. Loading any snapshot in a test drops
+        the checkpoint.
         """
-        self.loadvm('vanilla')
+        # With a batch, the machine is only prepared if the test needs it.
+        self._sh_batched = self._sh_batch.get(self.id())
+        self._sh_replay = None  # type: Optional[Tuple[str, Dict[str, bytes]]]
+        self._sh_prepared = self._sh_batched is None
+        if self._sh_prepared and not self._sh_collecting:
+            self._sh_prepare(self._tvm())
         self._sh_lines = []  # type: List[str]
+        self._sh_files = {}  # type: Dict[str, bytes]
         self._sh_mock_log = "/tmp/mock.log"
         self.sh_inject("rm -f -- {}".format(
             shlex.quote(self._sh_mock_log)))
         super().setUp()
 
+    def _sh_prepare(self, tvm: TestVM) -> None:
+        """Restore the machine for a test, see :meth:`setUp`."""
+        tvm.latency_scope = self.id()
+        loop = asyncio.get_event_loop()
+        if tvm.checkpoint_base == self._sh_snapshot:
+            loop.run_until_complete(tvm.restore())
+        else:
+            loop.run_until_complete(tvm.loadvm(self._sh_snapshot))
+            loop.run_until_complete(tvm.checkpoint(self._sh_snapshot))
+
     def savevm(self, name: str) -> None:
         """Save a VM snapshot with the given name."""
         loop = asyncio.get_event_loop()
@@ -999,24 +2643,95 @@ class VMShellTestCase(unittest.TestCase):
         return loop.run_until_complete(
                 self._tvm().remote_check_system(cmd, log_output=log_output))
 
-    def remote_write(self, fname: str, mode: int, data: bytes) -> None:
+    def remote_write(self, fname: str, mode: int, data: bytes, *,
+                     compress: Optional[str]=None) -> None:
         """Write a file on the remote system."""
         loop = asyncio.get_event_loop()
         resp = loop.run_until_complete(
-                self._tvm().remote_write(fname, mode, data))
-        self.assertEqual(resp, {"result": "ok", "size": len(data)})
+                self._tvm().remote_write(fname, mode, data, compress=compress))
+        self.assertEqual(resp["size"], len(data))
 
     def remote_write_and_system(self, script: str, *, log_output: bool=False) \
             -> Tuple[int, List[bytes]]:
         """Write a shell script and execute it."""
-        self.remote_write("/tmp/command.sh", 0o755,
-                          "#!/bin/sh\n{}\n".format(script).encode('utf-8'))
-        return self.remote_system("/tmp/command.sh", log_output=log_output)
+        loop = asyncio.get_event_loop()
+        return loop.run_until_complete(self._tvm().remote_write_and_system(
+            script, log_output=log_output))
+
+    def remote_exec(self, argv: Sequence[str], *, cwd: str="/",
+                    env: Optional[Dict[str, str]]=None,
+                    log_output: bool=False) -> Tuple[int, List[bytes]]:
+        """Run a program on the remote system, without the shell."""
+        loop = asyncio.get_event_loop()
+        return loop.run_until_complete(self._tvm().remote_exec(
+            argv, cwd=cwd, env=env, log_output=log_output))
+
+    def remote_system_all(self, cmds: Sequence[str], *,
+                          log_output: bool=False) \
+            -> Tuple[List[int], List[bytes]]:
+        """Run shell commands concurrently on the remote system."""
+        loop = asyncio.get_event_loop()
+        return loop.run_until_complete(self._tvm().remote_system_all(
+            cmds, log_output=log_output))
+
+    def remote_system_output(self, cmd: str) -> Tuple[int, bytes, bytes]:
+        """Run a command on the remote system, capturing its output exactly."""
+        loop = asyncio.get_event_loop()
+        return loop.run_until_complete(
+            self._tvm().remote_system_output(cmd))
+
+    def remote_read(self, fname: str, offset: int=0,
+                    length: Optional[int]=None) -> bytes:
+        """Read a file from the remote system."""
+        loop = asyncio.get_event_loop()
+        return loop.run_until_complete(
+            self._tvm().remote_read(fname, offset, length))
+
+    def remote_stat(self, fname: str, *,
+                    follow_symlinks: bool=True) -> os.stat_result:
+        """Get status of a file on the remote system."""
+        loop = asyncio.get_event_loop()
+        return loop.run_until_complete(self._tvm().remote_stat(
+            fname, follow_symlinks=follow_symlinks))
+
+    def remote_listdir(self, dname: str) -> List[str]:
+        """List names of entries of a directory on the remote system."""
+        loop = asyncio.get_event_loop()
+        return loop.run_until_complete(self._tvm().remote_listdir(dname))
 
     def sh_run(self, fn: str) -> Tuple[int, List[bytes]]:
         """Run a shell function."""
+        if self._sh_server:
+            script = self._sh_text(fn)
+            files = dict(self._sh_files)
+            if self._sh_collecting:
+                raise _ShCollected(script, files)
+            if _sh_profile is not None:
+                returncode, log, events, end_ns = \
+                    asyncio.get_event_loop().run_until_complete(
+                        self._tvm().remote_sh_trace(
+                            script, log_output=True, files=[
+                                (fname, 0o755, data)
+                                for fname, data in sorted(files.items())]))
+                _sh_profile.add_trace(events, end_ns, self.id())
+                return returncode, log
+            if self._sh_batched is not None and self._sh_replay is None:
+                batch_script, batch_files, result = self._sh_batched
+                if script == batch_script and files == batch_files:
+                    self._sh_replay = (script, files)
+                    return result[0], result[1]
+            return self._sh_remote_run(self._tvm(), script, files)
         return self.remote_write_and_system(self._sh_text(fn), log_output=True)
 
+    def _sh_remote_run(self, tvm: TestVM, script: str,
+                       files: Dict[str, bytes]) -> Tuple[int, List[bytes]]:
+        """Run a script in the shell server, writing files first."""
+        loop = asyncio.get_event_loop()
+        return loop.run_until_complete(tvm.remote_sh_run(
+            script, log_output=True, files=[
+                (fname, 0o755, data)
+                for fname, data in sorted(files.items())]))
+
     def sh_inject(self, cmd: str) -> None:
         """
         Inject a shell command into the script builder.
@@ -1032,11 +2747,32 @@ class VMShellTestCase(unittest.TestCase):
 
     def sh_source(self, fname: str) -> None:
         """Source another shell script."""
+        if self._sh_server and fname in self.SH_SERVER_SOURCES:
+            # Already sourced by the shell server.
+            return
         self.sh_inject(". {}".format(shlex.quote(fname)))
 
     def sh_mock(self, cmd: str, exits: int=0, returns: int=0,
                 prints: Optional[str]=None) -> None:
         """Override any function or program (buffered until execute)."""
+        if self._sh_server and not _is_sh_name(cmd):
+            self._sh_files["{}/{}".format(self._SH_MOCK_BIN, cmd)] = """\
+#!/bin/sh
+printf '%s' '{cmd}' >>{mock_log}
+for arg in "$@"; do
+    printf " '%s'" "$arg" >>{mock_log}
+done
+printf '\\n' >>{mock_log}
+if [ -n "{prints}" ]; then
+    echo "{prints}"
+fi
+exit {exits}
+""".format(
+                cmd=cmd, exits=exits if exits != 0 else returns,
+                prints=shlex.quote(prints) if prints is not None else "",
+                mock_log=shlex.quote(self._sh_mock_log),
+            ).encode("utf-8")
+            return
         self.sh_inject("""
             {cmd_neutered}() {{
                 printf '%s' '{cmd}' >>{mock_log};
@@ -1063,10 +2799,17 @@ class VMShellTestCase(unittest.TestCase):
 
     def sh_mocked_calls(self) -> List[Tuple[str, ...]]:
         """List of calls and arguments to all mocks."""
+        if self._sh_batched is not None and self._sh_replay is not None:
+            # Right after the sh_run of the batch.
+            log = self._sh_batched[2][2]
+        else:
+            try:
+                log = self.remote_read(self._sh_mock_log)
+            except FileNotFoundError:
+                # None of the mocks was called.
+                return []
         return [tuple(shlex.split(line.decode('utf-8')))
-                for line in self.remote_check_system(
-                    "cat -- {}".format(shlex.quote(self._sh_mock_log)),
-                    log_output=True)]
+                for line in log.splitlines()]
 
     def _sh_text(self, extra_cmds: str="") -> str:
         """
@@ -1093,9 +2836,18 @@ class SmokeTests(VMShellTestCase):
     def test_mount(self) -> None:
         """Check that essential filesystems are mounted."""
         output = self.remote_check_system("mount", log_output=True)
-        self.assertRegex(
-            output.pop(0).decode(),
-            r"rootfs on / type rootfs \(rw,size=[0-9]+k,nr_inodes=[0-9]+\)")
+        checkpoint = self._tvm().checkpoint_base is not None
+        if checkpoint:
+            self.assertRegex(
+                output.pop(0).decode(),
+                r"overlay on / type overlay \(rw,relatime,lowerdir=/,"
+                r"upperdir=/\.checkpoint/root-upper,"
+                r"workdir=/\.checkpoint/root-work.*\)")
+        else:
+            self.assertRegex(
+                output.pop(0).decode(),
+                r"rootfs on / type rootfs \(rw,size=[0-9]+k,"
+                r"nr_inodes=[0-9]+\)")
         self.assertEqual(
             output.pop(0).decode(),
             "sysfs on /sys type sysfs (rw,nosuid,nodev,noexec,relatime)")
@@ -1110,10 +2862,17 @@ class SmokeTests(VMShellTestCase):
             output.pop(0).decode(),
             "devpts on /dev/pts type devpts (rw,nosuid,noexec,relatime,"
             "gid=5,mode=620,ptmxmode=000)")
-        self.assertRegex(
-            output.pop(0).decode(),
-            r"tmpfs on /run type tmpfs \(rw,nosuid,noexec,relatime,"
-            r"size=[0-9]+k,mode=755\)")
+        if checkpoint:
+            self.assertRegex(
+                output.pop(0).decode(),
+                r"overlay on /run type overlay \(rw,nosuid,noexec,relatime,"
+                r"lowerdir=/run,upperdir=/\.checkpoint/run-upper,"
+                r"workdir=/\.checkpoint/run-work.*\)")
+        else:
+            self.assertRegex(
+                output.pop(0).decode(),
+                r"tmpfs on /run type tmpfs \(rw,nosuid,noexec,relatime,"
+                r"size=[0-9]+k,mode=755\)")
         self.assertEqual(output, [])
 
     def test_synchronized_time(self) -> None:
@@ -1133,6 +2892,14 @@ class SmokeTests(VMShellTestCase):
                 "cat /tmp/data | wc -c", log_output=True)
         self.assertEqual(output, [b"256"])
 
+    def test_remote_write_compressed(self) -> None:
+        """Check that we can write compressed data."""
+        self.remote_write("/tmp/data", 0o644, bytes(range(256)) * 1024,
+                          compress="gzip")
+        output = self.remote_check_system(
+                "cat /tmp/data | wc -c", log_output=True)
+        self.assertEqual(output, [b"262144"])
+
     def test_remote_write_and_run(self) -> None:
         """Test we can write remote files."""
         exitcode, output = self.remote_write_and_system("""#!/bin/sh
@@ -1141,6 +2908,60 @@ class SmokeTests(VMShellTestCase):
         self.assertEqual(exitcode, 0)
         self.assertEqual(output, [b"OK"])
 
+    def test_remote_exec(self) -> None:
+        """Check that we can run programs without the shell."""
+        exitcode, output = self.remote_exec(
+            ["sh", "-c", 'echo "$PWD $GREETING"; exit 3'], cwd="/tmp",
+            env={"GREETING": "hello world"}, log_output=True)
+        self.assertEqual(exitcode, 3)
+        self.assertEqual(output, [b"/tmp hello world"])
+
+    def test_output_streams(self) -> None:
+        """Check that output is captured exactly, per stream."""
+        if not self._tvm().framed:
+            self.skipTest("output is only captured with the framed protocol")
+        exitcode, stdout, stderr = self.remote_system_output(
+            r"printf 'a\r\n\000b'; printf err >&2; exit 4")
+        self.assertEqual(exitcode, 4)
+        self.assertEqual(stdout, b"a\r\n\0b")
+        self.assertEqual(stderr, b"err")
+
+    def test_concurrent_jobs(self) -> None:
+        """Check that jobs run concurrently."""
+        # The first job can only finish if the second one runs meanwhile.
+        exitcodes, _ = self.remote_system_all([
+            "while [ ! -e /tmp/flag ]; do sleep 0.1; done; exit 1",
+            "touch /tmp/flag; exit 2",
+        ])
+        self.assertEqual(exitcodes, [1, 2])
+
+    def test_remote_read_and_stat(self) -> None:
+        """Check that we can inspect remote files without the shell."""
+        data = bytes(range(256)) * 64
+        self.remote_write("/tmp/data", 0o640, data)
+        self.assertEqual(self.remote_read("/tmp/data"), data)
+        self.assertEqual(self.remote_read("/tmp/data", 5000, 10),
+                         data[5000:5010])
+        self.assertEqual(self.remote_read("/proc/self/comm"), b"init\n")
+        st = self.remote_stat("/tmp/data")
+        self.assertEqual(st.st_mode, 0o100640)
+        self.assertEqual(st.st_size, len(data))
+        self.assertIn("data", self.remote_listdir("/tmp"))
+        with self.assertRaises(FileNotFoundError):
+            self.remote_read("/tmp/does-not-exist")
+
+    def test_checkpoint_works(self) -> None:
+        """Test we can revert to the checkpoint of the vanilla snapshot."""
+        tvm = self._tvm()
+        if tvm.checkpoint_base is None:
+            self.skipTest("init does not support checkpoints")
+        self.remote_write("/checkpoints-are-fun", 0o644, b"")
+        self.remote_stat("/checkpoints-are-fun")
+        loop = asyncio.get_event_loop()
+        loop.run_until_complete(tvm.restore())
+        with self.assertRaises(FileNotFoundError):
+            self.remote_stat("/checkpoints-are-fun")
+
     def test_snapshot_works(self) -> None:
         """Test we can revert to the vanilla snapshot."""
         self.remote_write("/snapshots-are-fun", 0o644, b"")
@@ -1157,6 +2978,27 @@ class SmokeTests(VMShellTestCase):
             output.pop().decode(),
             'ls: /snapshots-are-fun: No such file or directory')
 
+    def test_rpc_pipeline(self) -> None:
+        """Check that pipelined requests get their own replies."""
+        loop = asyncio.get_event_loop()
+        responses, _ = loop.run_until_complete(self._tvm().rpc_pipeline([
+            ("ping", b""),
+            ("write /tmp/data 644 3", b"abc"),
+            ("system test -s /tmp/data", b""),
+            ("ping", b""),
+        ]))
+        # Leave out the timing of each request.
+        responses = [
+            {key: value for key, value in response.items()
+             if key not in _TIMING_KEYS}
+            for response in responses]
+        self.assertEqual(responses, [
+            {"result": "ok"},
+            {"result": "ok", "size": 3},
+            {"result": "ok", "status": "exited", "code": 0},
+            {"result": "ok"},
+        ])
+
     def test_mocking_works(self) -> None:
         self.sh_mock("foo")
         self.sh_run("foo 1 2 3")
@@ -1165,38 +3007,321 @@ class SmokeTests(VMShellTestCase):
         ])
 
 
-def main() -> None:
-    """Run unit tests of the current module."""
-    # Enable verbose logging if requested
-    verbose = False
-    for arg in sys.argv:
-        if arg == "-v" or arg == "--verbose":
-            verbose = True
-    logging.basicConfig(level=logging.INFO if verbose else logging.WARNING)
-    # Prepare a VM for testing
+# Memory each virtual machine takes on the host: the guest memory and
+# roughly as much again for qemu itself.
+_TVM_HOST_MEMORY = 2 * 64 * 1024 * 1024
+
+
+def _default_jobs() -> int:
+    """Get the number of virtual machines the host can run at once."""
+    jobs = os.cpu_count() or 1
+    try:
+        with open("/proc/meminfo") as stream:
+            for line in stream:
+                if line.startswith("MemAvailable:"):
+                    available = int(line.split()[1]) * 1024
+                    jobs = min(jobs, available // _TVM_HOST_MEMORY)
+    except OSError:
+        pass
+    return max(jobs, 1)
+
+
+def _parse_jobs(argv: List[str]) -> int:
+    """
+    Parse and remove the --jobs option from argv.
+
+    The number of virtual machines defaults to TESTVM_JOBS from the
+    environment, or to one. The value "auto" picks a number suitable for
+    the host.
+    """
+    value = os.environ.get("TESTVM_JOBS", "1")
+    for i, arg in enumerate(argv):
+        if arg in ("-j", "--jobs") and i + 1 < len(argv):
+            value = argv[i + 1]
+            del argv[i:i + 2]
+            break
+        if arg.startswith("--jobs="):
+            value = arg[len("--jobs="):]
+            del argv[i]
+            break
+    if value == "auto":
+        return _default_jobs()
+    try:
+        jobs = int(value)
+    except ValueError:
+        raise SystemExit("cannot use {!a} virtual machines".format(value))
+    return max(jobs, 1)
+
+
+def _run_with_tvm(boot_options: Dict[str, Any], fn: Callable[[], Any]) -> Any:
+    """
+    Boot a virtual machine for testing and call fn while it runs.
+
+    :arg boot_options:
+        Keyword arguments of :meth:`TestVM.boot`.
+    """
     loop = asyncio.get_event_loop()
-    loop.add_signal_handler(signal.SIGINT, lambda: None)
     tvm = TestVM()
     try:
-        # Make everything
-        if loop.run_until_complete(tvm.make_boot_assets()) != 0:
-            raise SystemError("cannot make boot assets")
         # Boot the VM
         try:
-            loop.run_until_complete(tvm.boot())
-        except BootError as exc:
-            raise SystemExit(str(exc))
+            loop.run_until_complete(tvm.boot(**boot_options))
+        except (BootError, BadRequest, OSError) as exc:
+            if boot_options.get("template") is None:
+                raise SystemExit(str(exc))
+            # Boot from scratch if the template cannot be cloned.
+            _logger.warning("cannot clone template: %s", exc)
+            if tvm.running:
+                loop.run_until_complete(tvm.shutdown())
+            tvm.cleanup()
+            tvm = TestVM()
+            try:
+                loop.run_until_complete(tvm.boot(**dict(
+                    boot_options, template=None)))
+            except BootError as exc:
+                raise SystemExit(str(exc))
         # Save snapshot after boot
         loop.run_until_complete(tvm.savevm('vanilla'))
         # We are now ready to run tests :-)
         global _tvm
         _tvm = tvm
-        unittest.main()
-        _tvm = None
+        try:
+            return fn()
+        finally:
+            _tvm = None
+            _logger.info("boot timing: %s", tvm.boot_timing)
+            _logger.info("request latency:\n%s", tvm.latency_report())
+            if _sh_profile is not None:
+                _sh_profile.save_folded(_sh_profile_path)
+                print("shell profile:\n{}".format(_sh_profile.report()),
+                      file=sys.stderr)
     finally:
         loop.run_until_complete(tvm.shutdown())
         tvm.cleanup()
 
 
+def _make_template(boot_options: Dict[str, Any], path: str) -> bool:
+    """
+    Boot a virtual machine and save it as a template for cloning.
+
+    :returns:
+        True if the template was saved to path.
+    """
+    if boot_options.get("transport") == "vsock":
+        return False
+    loop = asyncio.get_event_loop()
+    tvm = TestVM()
+    try:
+        loop.run_until_complete(tvm.boot(framed=False, **boot_options))
+        loop.run_until_complete(tvm.save_template(path))
+        return True
+    except (BootError, BadRequest, OSError) as exc:
+        _logger.warning("cannot make template: %s", exc)
+        return False
+    finally:
+        if tvm.running:
+            loop.run_until_complete(tvm.shutdown())
+        tvm.cleanup()
+
+
+def _iter_tests(suite: unittest.TestSuite) -> Iterator[unittest.TestCase]:
+    """Iterate over the test cases of a suite, in order."""
+    for test in suite:
+        if isinstance(test, unittest.TestSuite):
+            yield from _iter_tests(test)
+        else:
+            yield test
+
+
+def _select_tests(tests: Sequence[unittest.TestCase]) -> None:
+    """Limit the batches of setUpClass to the given tests."""
+    global _selected_tests
+    _selected_tests = {test.id() for test in tests}
+
+
+class ShardedTestRunner(unittest.TextTestRunner):
+    """
+    Test runner that shards tests across a pool of virtual machines.
+
+    The tests are split, in order, into one contiguous shard per virtual
+    machine, so that tests of one class mostly share a machine and its
+    setUpClass. Each shard runs in a forked process with its own machine,
+    sockets and vsock context identifier. Unless test I/O uses vsock, one
+    machine is booted up front and saved as a template, and the machines of
+    the shards are cloned from it instead of booting the kernel and initrd
+    each. The output and logs of the shards are printed one after another,
+    followed by the merged result.
+    """
+
+    def __init__(self, jobs: int, boot_options: Dict[str, Any],
+                 **kwargs: Any) -> None:
+        super().__init__(**kwargs)
+        self.jobs = jobs
+        self.boot_options = boot_options
+
+    def run(self, test: Union[unittest.TestSuite, unittest.TestCase]) \
+            -> unittest.TestResult:
+        if isinstance(test, unittest.TestCase):
+            tests = [test]
+        else:
+            tests = list(_iter_tests(test))
+        jobs = min(self.jobs, len(tests))
+        if jobs <= 1:
+            _select_tests(tests)
+            return _run_with_tvm(self.boot_options, lambda: super(
+                ShardedTestRunner, self).run(test))
+        shards = [tests[len(tests) * i // jobs:len(tests) * (i + 1) // jobs]
+                  for i in range(jobs)]
+        start = time.monotonic()
+        template_dir = tempfile.mkdtemp(prefix="testvm-template-")
+        try:
+            template = os.path.join(template_dir, "state")
+            boot_options = self.boot_options
+            if _make_template(boot_options, template):
+                boot_options = dict(boot_options, template=template)
+            result = self._run_shards(shards, boot_options)
+        finally:
+            shutil.rmtree(template_dir)
+        self.stream.writeln(result.separator2)
+        elapsed = time.monotonic() - start
+        self.stream.writeln("Ran {} test{} in {:.3f}s on {} machines".format(
+            result.testsRun, "" if result.testsRun == 1 else "s", elapsed,
+            jobs))
+        self.stream.writeln()
+        infos = ["{}={}".format(name, len(items)) for name, items in (
+            ("failures", result.failures), ("errors", result.errors),
+            ("skipped", result.skipped)) if items]
+        status = "OK" if result.wasSuccessful() else "FAILED"
+        self.stream.writeln("{} ({})".format(status, ", ".join(infos))
+                            if infos else status)
+        return result
+
+    def _run_shards(self, shards: List[List[unittest.TestCase]],
+                    boot_options: Dict[str, Any]) -> unittest.TestResult:
+        """Run all shards in parallel and merge their results."""
+        jobs = len(shards)
+        children = []  # type: List[Tuple[int, Any, Any]]
+        for shard in shards:
+            log = tempfile.TemporaryFile(mode="w+")
+            report = tempfile.TemporaryFile(mode="w+")
+            sys.stdout.flush()
+            sys.stderr.flush()
+            pid = os.fork()
+            if pid == 0:
+                self._run_shard(shard, boot_options, log, report)
+            children.append((pid, log, report))
+        result = self._makeResult()
+        for i, (shard, (pid, log, report)) in enumerate(zip(shards, children)):
+            os.waitpid(pid, 0)
+            self.stream.writeln("{}\nshard {}/{}: {} tests\n{}".format(
+                result.separator1, i + 1, jobs, len(shard),
+                result.separator2))
+            log.seek(0)
+            self.stream.write(log.read())
+            report.seek(0)
+            self._merge_report(result, shard, report.read())
+        return result
+
+    def _run_shard(self, shard: List[unittest.TestCase],
+                   boot_options: Dict[str, Any], log: Any,
+                   report: Any) -> None:
+        """Run one shard in a forked child process and exit."""
+        code = 1
+        try:
+            os.dup2(log.fileno(), sys.stdout.fileno())
+            os.dup2(log.fileno(), sys.stderr.fileno())
+            # The event loop of the parent must not be shared.
+            asyncio.set_event_loop(asyncio.new_event_loop())
+            _select_tests(shard)
+            runner = unittest.TextTestRunner(
+                stream=sys.stderr, verbosity=self.verbosity,
+                failfast=self.failfast, buffer=self.buffer)
+            result = _run_with_tvm(
+                boot_options,
+                lambda: runner.run(unittest.TestSuite(shard)))
+            json.dump({
+                "run": result.testsRun,
+                "failures": [(t.id(), text) for t, text in result.failures],
+                "errors": [(t.id(), text) for t, text in result.errors],
+                "skipped": [(t.id(), text) for t, text in result.skipped],
+                "expected_failures": [
+                    (t.id(), text) for t, text in result.expectedFailures],
+                "unexpected_successes": [
+                    t.id() for t in result.unexpectedSuccesses],
+            }, report)
+            report.flush()
+            code = 0
+        except BaseException:
+            traceback.print_exc()
+        finally:
+            sys.stderr.flush()
+            os._exit(code)
+
+    def _merge_report(self, result: unittest.TestResult,
+                      shard: List[unittest.TestCase], data: str) -> None:
+        """Add the results of a shard to result."""
+        by_id = {test.id(): test for test in shard}
+        try:
+            report = json.loads(data)
+        except ValueError:
+            # The shard died without a report, blame all of its tests.
+            for test in shard:
+                result.errors.append((test, "virtual machine of the shard "
+                                      "failed, see its output"))
+            result.testsRun += len(shard)
+            return
+        result.testsRun += report["run"]
+        for key, items in (("failures", result.failures),
+                           ("errors", result.errors),
+                           ("skipped", result.skipped),
+                           ("expected_failures", result.expectedFailures)):
+            items.extend((by_id[test_id], text)
+                         for test_id, text in report[key])
+        result.unexpectedSuccesses.extend(
+            by_id[test_id] for test_id in report["unexpected_successes"])
+
+
+def main() -> None:
+    """
+    Run unit tests of the current module.
+
+    With --jobs N (or TESTVM_JOBS=N in the environment) the tests are
+    sharded across N virtual machines booted in parallel, "auto" sizes the
+    pool to the CPUs and memory of the host. TESTVM_SH_PROFILE=PATH
+    profiles the shell scripts under test, see :class:`VMShellTestCase`.
+    TESTVM_FIXTURE=gpt|mbr attaches that disk fixture to every machine.
+    """
+    # Enable verbose logging if requested
+    verbose = False
+    for arg in sys.argv:
+        if arg == "-v" or arg == "--verbose":
+            verbose = True
+    logging.basicConfig(level=logging.INFO if verbose else logging.WARNING)
+    jobs = _parse_jobs(sys.argv)
+    # Profile shell scripts if requested, appending the stacks of each
+    # machine to the same file.
+    global _sh_profile, _sh_profile_path
+    _sh_profile_path = os.environ.get("TESTVM_SH_PROFILE", "")
+    if _sh_profile_path:
+        _sh_profile = ShellProfile()
+        open(_sh_profile_path, "w").close()
+    # Prepare a VM for testing
+    loop = asyncio.get_event_loop()
+    loop.add_signal_handler(signal.SIGINT, lambda: None)
+    # The transport used for test I/O and the type of machine can be selected
+    # from the environment.
+    boot_options = {
+        "transport": os.environ.get("TESTVM_TRANSPORT", "isa-serial"),
+        "machine": os.environ.get("TESTVM_MACHINE", "pc"),
+    }  # type: Dict[str, Any]
+    if os.environ.get("TESTVM_FIXTURE"):
+        boot_options["fixture"] = os.environ["TESTVM_FIXTURE"]
+    # Make everything, once for all the machines.
+    if loop.run_until_complete(TestVM().make_boot_assets()) != 0:
+        raise SystemError("cannot make boot assets")
+    unittest.main(testRunner=ShardedTestRunner(
+        jobs, boot_options, verbosity=2 if verbose else 1))
+
+
 if __name__ == "__main__":
     main()
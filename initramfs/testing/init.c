@@ -15,189 +15,1847 @@
  *
  */
 
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <linux/kdev_t.h>
+#include <linux/vm_sockets.h>
 #include <mntent.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/io.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+// Test I/O can use one of two protocols. The text protocol, used right after
+// boot, exchanges one command per line and one JSON reply per line. The
+// framed protocol, enabled with the "framed" command, wraps each message in
+// a frame that starts with init_frame_header. Every reply carries the id of
+// the request so that many requests can be in flight at the same time.
+//
+// The header is followed by head_len bytes of header text (the command line
+// of a request or the JSON object of a reply) and data_len bytes of raw data
+// (for example the contents of a file sent with the "write" command). All
+// fields use the byte order of the guest, which is little-endian on x86.
+struct init_frame_header {
+    uint32_t id;
+    uint16_t kind;
+    uint16_t flags;
+    uint32_t head_len;
+    uint32_t data_len;
+};
+
+enum {
+    INIT_FRAME_REQUEST = 1,
+    INIT_FRAME_REPLY = 2,
+    INIT_FRAME_EVENT = 3,
+    INIT_FRAME_OUTPUT = 4,
+};
+
+// Output frames carry output of a child process, sent while the request that
+// started it is running. The flags of the frame tell which stream it is from.
+enum {
+    INIT_STREAM_STDOUT = 1,
+    INIT_STREAM_STDERR = 2,
+};
+
+struct init_testio {
+    FILE* in;
+    FILE* out;
+    bool framed;
+    // Pipe used to splice request data without copying it through user space
+    // and a flag that is set when test I/O cannot be spliced.
+    int splice_pipe[2];
+    bool no_splice;
+};
+
+struct init_request {
+    uint32_t id;
+    char* cmd;
+    // Number of bytes of request data still waiting to be read from test I/O.
+    // This is only known in framed mode, in text mode commands carry
+    // the length of their data in the command line.
+    size_t data_len;
+    // CLOCK_MONOTONIC time at which the request was read.
+    int64_t start_ns;
+};
+
 static void init_logf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
 static void init_dief(const char* fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
 static void init_exit_qemu(int code) __attribute__((noreturn));
 static void init_early_mount();
+static void init_mkdir(const char* dir, mode_t mode);
 static FILE* init_open_testio(const char* testio_devname);
-static void init_process_commands(FILE* testio_in, FILE* testio_out);
+static void init_write_frame(struct init_testio* io, uint32_t id, uint16_t kind, uint16_t flags, const void* head, size_t head_len, const void* data, size_t data_len);
+static void init_replyf(struct init_testio* io, const struct init_request* req, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+static void init_reply_dataf(struct init_testio* io, const struct init_request* req, const void* data, size_t data_len, const char* fmt, ...) __attribute__((format(printf, 5, 6)));
+static void init_process_commands(struct init_testio* io);
+static int64_t init_clock_ns(clockid_t clock);
 
 int main(int argc, char** argv)
 {
     // Parse command line arguments to find the name of the test I/O serial
     // port. It should be of the form "testio=ttyS1" and can be provided by
-    // appending "-- testio=ttyS1" to the kernel command line.
+    // appending "-- testio=ttyS1" to the kernel command line. A virtio-serial
+    // port can be used in the same way ("testio=vport0p1"), while
+    // "testio=vsock:PORT" connects to the given AF_VSOCK port of the host.
     const char* testio_devname = NULL;
     for (int i = 0; i < argc; ++i) {
         if (strstr(argv[i], "testio=") == argv[i]) {
             testio_devname = argv[i] + sizeof "testio=" - 1;
         }
     }
-    // Prepare testio_in and testio_out that map either to the serial port
+    // Prepare test I/O streams that map either to the serial port
     // (when used in python-init testing inside the virtual machine) or to
     // stdin and stdout (respecitvely) when just invoked locally from the build
     // tree.
-    FILE* testio_in;
-    FILE* testio_out;
+    struct init_testio io = { .splice_pipe = { -1, -1 } };
+    int64_t early_mount_ns = 0;
     if (testio_devname != NULL) {
+        early_mount_ns = init_clock_ns(CLOCK_MONOTONIC);
         init_early_mount();
-        testio_in = testio_out = init_open_testio(testio_devname);
+        early_mount_ns = init_clock_ns(CLOCK_MONOTONIC) - early_mount_ns;
+        io.in = io.out = init_open_testio(testio_devname);
     } else {
-        testio_in = stdin;
-        testio_out = stdout;
+        io.in = stdin;
+        io.out = stdout;
+        // Request data is read past the stream, keep it unbuffered.
+        setvbuf(io.in, NULL, _IONBF, 0);
         init_logf("cannot find name of test I/O serial port\n"
                   "please pass it to init using 'testio=ttySxxx' argument\n");
     }
     // Write an event to test I/O to notify python side that we managed to boot
     // successfully. Tests will fail unless this shows up relatively quickly
-    // after starting qemu.
-    fprintf(testio_out, "{\"event\": \"boot-ok\"}\n");
+    // after starting qemu. The event tells how long it took to get here since
+    // the kernel started, and how much of that was spent mounting things.
+    fprintf(io.out, "{\"event\": \"boot-ok\", \"boottime_ns\": %jd, \"monotonic_ns\": %jd, \"early_mount_ns\": %jd}\n",
+        (intmax_t)init_clock_ns(CLOCK_BOOTTIME), (intmax_t)init_clock_ns(CLOCK_MONOTONIC), (intmax_t)early_mount_ns);
+    fflush(io.out);
     // Process commands sent over the test I/O.
-    init_process_commands(testio_in, testio_out);
+    init_process_commands(&io);
     // Wrap up and close everything.
     fflush(stdout);
-    fflush(testio_out);
+    fflush(io.out);
     // Use a special device mapped to the I/O port to tell qemu to exit.
     init_exit_qemu(0);
     return 0;
 }
 
-static void init_cmd_system(const char* cmd, FILE* testio_in, FILE* testio_out)
+static int64_t init_clock_ns(clockid_t clock)
 {
-    int status = system(cmd + strlen("system "));
-    if (WIFEXITED(status)) {
-        fprintf(testio_out, "{\"result\": \"ok\", \"status\": \"exited\", \"code\": %d}\n", WEXITSTATUS(status));
-    } else if (WIFSIGNALED(status)) {
-        fprintf(testio_out, "{\"result\": \"ok\", \"status\": \"signaled\", \"signal\": %d}\n", WTERMSIG(status));
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) < 0) {
+        init_dief("cannot get time: %m\n");
+    }
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t init_timeval_ns(const struct timeval* tv)
+{
+    return (int64_t)tv->tv_sec * 1000000000 + (int64_t)tv->tv_usec * 1000;
+}
+
+// Format the items of a reply that tell how long it took, since start_ns, to
+// carry out the request and, if ru is not NULL, the CPU time and peak memory
+// used by the child process that did the work.
+static void init_format_usage(char* buf, size_t size, int64_t start_ns, const struct rusage* ru)
+{
+    int n = snprintf(buf, size, ", \"elapsed_ns\": %jd", (intmax_t)(init_clock_ns(CLOCK_MONOTONIC) - start_ns));
+    if (ru != NULL && n >= 0 && (size_t)n < size) {
+        snprintf(buf + n, size - n, ", \"utime_ns\": %jd, \"stime_ns\": %jd, \"maxrss_kb\": %ld",
+            (intmax_t)init_timeval_ns(&ru->ru_utime), (intmax_t)init_timeval_ns(&ru->ru_stime), ru->ru_maxrss);
     }
 }
 
-static void init_cmd_write(const char* cmd, FILE* testio_in, FILE* testio_out)
+static void init_read_exactly(FILE* stream, void* buf, size_t size)
+{
+    if (size > 0 && fread(buf, size, 1, stream) != 1) {
+        init_dief("cannot read %zu bytes from test I/O: %m\n", size);
+    }
+}
+
+// Read and throw away size bytes from test I/O.
+static void init_testio_discard(struct init_testio* io, size_t size)
+{
+    char buf[1 << 12];
+    while (size > 0) {
+        size_t n = size < sizeof buf ? size : sizeof buf;
+        init_read_exactly(io->in, buf, n);
+        size -= n;
+    }
+}
+
+// Copy size bytes of request data from test I/O to the file descriptor fd.
+//
+// The data is spliced from test I/O into a pipe and from there into fd, so
+// that it never has to be copied through user space. When fd is a pipe the
+// intermediate pipe is not needed at all. If test I/O does not support splice
+// the data is copied with read and write instead. All the data is always
+// consumed from test I/O, even if writing to fd fails, so that the next
+// request can be read. Returns the number of bytes written to fd.
+static size_t init_testio_copy(struct init_testio* io, int fd, size_t size, bool fd_is_pipe)
+{
+    int in_fd = fileno(io->in);
+    size_t done = 0;
+    size_t wrote = 0;
+    bool failed = false;
+    char buf[1 << 16];
+    if (!fd_is_pipe && !io->no_splice && io->splice_pipe[0] < 0) {
+        if (pipe2(io->splice_pipe, O_CLOEXEC) < 0) {
+            init_dief("cannot create pipe: %m\n");
+        }
+        // Use a large pipe, if allowed, to splice more data per system call.
+        fcntl(io->splice_pipe[1], F_SETPIPE_SZ, 1 << 20);
+    }
+    while (done < size && !io->no_splice && !failed) {
+        size_t chunk = size - done < (1 << 20) ? size - done : (1 << 20);
+        ssize_t n = splice(in_fd, NULL, fd_is_pipe ? fd : io->splice_pipe[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EINVAL) {
+            // Test I/O cannot be spliced, use the fallback below.
+            io->no_splice = true;
+            break;
+        } else if (n < 0 && fd_is_pipe && errno == EPIPE) {
+            failed = true;
+            break;
+        } else if (n < 0) {
+            init_dief("cannot splice data from test I/O: %m\n");
+        } else if (n == 0) {
+            init_dief("cannot read data from test I/O: unexpected end of file\n");
+        }
+        done += n;
+        if (fd_is_pipe) {
+            wrote += n;
+            continue;
+        }
+        // Move the data out of the intermediate pipe. If that fails throw
+        // away whatever is left in the pipe.
+        while (n > 0) {
+            ssize_t m = splice(io->splice_pipe[0], NULL, fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR) {
+                continue;
+            } else if (m <= 0) {
+                failed = true;
+                m = read(io->splice_pipe[0], buf, (size_t)n < sizeof buf ? (size_t)n : sizeof buf);
+                if (m <= 0) {
+                    init_dief("cannot drain pipe: %m\n");
+                }
+            } else {
+                wrote += m;
+            }
+            n -= m;
+        }
+    }
+    while (done < size) {
+        size_t chunk = size - done < sizeof buf ? size - done : sizeof buf;
+        ssize_t n = read(in_fd, buf, chunk);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            init_dief("cannot read data from test I/O: %m\n");
+        } else if (n == 0) {
+            init_dief("cannot read data from test I/O: unexpected end of file\n");
+        }
+        done += n;
+        for (ssize_t off = 0; off < n && !failed;) {
+            ssize_t m = write(fd, buf + off, n - off);
+            if (m < 0 && errno == EINTR) {
+                continue;
+            } else if (m < 0) {
+                failed = true;
+            } else {
+                off += m;
+                wrote += m;
+            }
+        }
+    }
+    return wrote;
+}
+
+// Restore the default signal mask in a new child process. The event loop of
+// init blocks SIGCHLD, and programs started by init must not inherit that.
+static void init_child_reset_signals()
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+// Get the program that can decompress data in the given format.
+static const char* init_decompressor(const char* codec)
+{
+    static const char* const codecs[] = { "gzip", "xz", "lz4", "zstd" };
+    for (size_t i = 0; i < sizeof codecs / sizeof *codecs; ++i) {
+        if (strcmp(codec, codecs[i]) == 0) {
+            return codecs[i];
+        }
+    }
+    return NULL;
+}
+
+// Decompress size bytes of request data into file_fd, using an external
+// decompressor fed directly from test I/O. Returns the wait status of the
+// decompressor and stores its resource usage in ru.
+static int init_write_decompressed(struct init_testio* io, int file_fd, size_t size, const char* prog, struct rusage* ru)
+{
+    int pipe_fd[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) < 0) {
+        init_dief("cannot create pipe: %m\n");
+    }
+    pid_t child = fork();
+    if (child < 0) {
+        init_dief("cannot fork decompressor: %m\n");
+    } else if (child == 0) {
+        init_child_reset_signals();
+        if (dup2(pipe_fd[0], 0) < 0 || dup2(file_fd, 1) < 0) {
+            _exit(127);
+        }
+        execlp(prog, prog, "-dc", NULL);
+        _exit(127);
+    }
+    close(pipe_fd[0]);
+    // If decompression fails we get EPIPE, don't get killed by SIGPIPE.
+    struct sigaction sa_ign = { .sa_handler = SIG_IGN };
+    struct sigaction sa_old;
+    sigaction(SIGPIPE, &sa_ign, &sa_old);
+    init_testio_copy(io, pipe_fd[1], size, true);
+    close(pipe_fd[1]);
+    sigaction(SIGPIPE, &sa_old, NULL);
+    int status;
+    if (wait4(child, &status, 0, ru) < 0) {
+        init_dief("cannot wait for decompressor: %m\n");
+    }
+    return status;
+}
+
+static void init_cmd_write(struct init_testio* io, struct init_request* req)
 {
     char name[PATH_MAX];
+    char codec[16] = "";
     mode_t mode;
     size_t size;
-    if (sscanf(cmd, "write %s %o %zu", name, &mode, &size) < 3) {
+    if (sscanf(req->cmd, "write %s %o %zu %15s", name, &mode, &size, codec) < 3) {
         init_dief("cannot parse write command\n");
     }
+    if (io->framed && size != req->data_len) {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
+    // The optional codec argument selects the format of compressed data.
+    const char* prog = NULL;
+    if (codec[0] != '\0' && (prog = init_decompressor(codec)) == NULL) {
+        if (!io->framed) {
+            init_testio_discard(io, size);
+        }
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
 
     int file_fd = open(name, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, mode);
     if (file_fd < 0) {
         init_dief("cannot open file descriptor %s: %m\n", name);
     }
 
-    FILE* file_stream = fdopen(file_fd, "w");
-    if (file_stream == NULL) {
-        init_dief("cannot open file stream: %m\n");
+    int status = 0;
+    struct rusage ru;
+    if (prog == NULL) {
+        size_t wrote = init_testio_copy(io, file_fd, size, false);
+        if (wrote != size) {
+            init_dief("cannot write everything (wrote %zu but expected %zu): %m\n", wrote, size);
+        }
+    } else {
+        status = init_write_decompressed(io, file_fd, size, prog, &ru);
+    }
+    if (io->framed) {
+        req->data_len -= size;
     }
 
-    size_t total_read = 0;
-    size_t total_wrote = 0;
-    char buf[1 << 16];
-    while (total_wrote < size) {
-        size_t remaining = size - total_wrote;
-        size_t to_read = remaining < sizeof buf ? remaining : sizeof buf;
-        size_t n_r = fread(buf, 1, to_read, testio_in);
-        size_t n_w = fwrite(buf, 1, n_r, file_stream);
-        if (n_r != n_w) {
-            init_dief("cannot write everything (wrote %zd but expected %zd): %m\n", n_w, n_r);
+    struct stat st;
+    if (fstat(file_fd, &st) < 0) {
+        init_dief("cannot stat output file: %m\n");
+    }
+    if (close(file_fd) < 0) {
+        init_dief("cannot close output file: %m\n");
+    }
+    char usage[160];
+    init_format_usage(usage, sizeof usage, req->start_ns, prog != NULL ? &ru : NULL);
+    if (prog == NULL) {
+        init_replyf(io, req, "{\"result\": \"ok\", \"size\": %zu%s}", size, usage);
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        init_replyf(io, req, "{\"result\": \"ok\", \"size\": %jd, \"transferred\": %zu%s}", (intmax_t)st.st_size, size, usage);
+    } else if (WIFEXITED(status)) {
+        init_replyf(io, req, "{\"result\": \"error\", \"status\": \"exited\", \"code\": %d%s}", WEXITSTATUS(status), usage);
+    } else {
+        init_replyf(io, req, "{\"result\": \"error\", \"status\": \"signaled\", \"signal\": %d%s}", WTERMSIG(status), usage);
+    }
+}
+
+static void init_reply_errno(struct init_testio* io, const struct init_request* req, int err)
+{
+    init_replyf(io, req, "{\"result\": \"error\", \"errno\": %d, \"error\": \"%s\"}", err, strerror(err));
+}
+
+// Read a whole file that cannot be mapped, such as files in /proc, into a
+// newly allocated buffer.
+static char* init_read_fd(int fd, size_t* size)
+{
+    size_t cap = 1 << 12;
+    char* buf = malloc(cap);
+    *size = 0;
+    for (;;) {
+        if (buf == NULL) {
+            init_dief("cannot allocate memory for file: %m\n");
+        }
+        ssize_t n = read(fd, buf + *size, cap - *size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            free(buf);
+            return NULL;
+        } else if (n == 0) {
+            return buf;
+        }
+        *size += n;
+        if (*size == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
         }
-        total_read += n_r;
-        total_wrote += n_w;
     }
+}
 
-    if (fclose(file_stream) < 0) {
-        init_dief("cannot close output file: %m\n");
+static void init_cmd_read(struct init_testio* io, const struct init_request* req)
+{
+    char name[PATH_MAX];
+    size_t offset = 0;
+    size_t len = SIZE_MAX;
+    int n = sscanf(req->cmd, "read %s %zu %zu", name, &offset, &len);
+    if (n != 1 && n != 3) {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        init_reply_errno(io, req, errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    // Regular files are mapped and sent straight from the page cache. Other
+    // files are read, all the way, into memory.
+    char* map = MAP_FAILED;
+    size_t map_len = 0;
+    size_t map_skew = 0;
+    char* buf = NULL;
+    const char* data = NULL;
+    size_t size = 0;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        size = st.st_size;
+        offset = offset < size ? offset : size;
+        len = len < size - offset ? len : size - offset;
+        // The mapping must start at a page boundary.
+        map_skew = offset % (size_t)sysconf(_SC_PAGESIZE);
+        map_len = map_skew + len;
+        if (len > 0) {
+            map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, offset - map_skew);
+        }
+        data = map != MAP_FAILED ? map + map_skew : NULL;
+    }
+    if (data == NULL && len > 0) {
+        if (lseek(fd, 0, SEEK_SET) < 0 && errno != ESPIPE) {
+            init_reply_errno(io, req, errno);
+            close(fd);
+            return;
+        }
+        if ((buf = init_read_fd(fd, &size)) == NULL) {
+            init_reply_errno(io, req, errno);
+            close(fd);
+            return;
+        }
+        offset = offset < size ? offset : size;
+        len = len < size - offset ? len : size - offset;
+        data = buf + offset;
+    }
+    len = data != NULL ? len : 0;
+    init_reply_dataf(io, req, data, len, "{\"result\": \"ok\", \"data_len\": %zu}", len);
+    if (map != MAP_FAILED) {
+        munmap(map, map_len);
+    }
+    free(buf);
+    close(fd);
+}
+
+static void init_cmd_stat(struct init_testio* io, const struct init_request* req)
+{
+    char name[PATH_MAX];
+    char cmd[6];
+    if (sscanf(req->cmd, "%5s %s", cmd, name) != 2) {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
+    // lstat does not follow a symbolic link at the end of the path.
+    struct stat st;
+    if (fstatat(AT_FDCWD, name, &st, strcmp(cmd, "lstat") == 0 ? AT_SYMLINK_NOFOLLOW : 0) < 0) {
+        init_reply_errno(io, req, errno);
+        return;
+    }
+    init_replyf(io, req,
+        "{\"result\": \"ok\", \"mode\": %u, \"ino\": %ju, \"dev\": %ju, \"nlink\": %ju, "
+        "\"uid\": %u, \"gid\": %u, \"size\": %jd, \"rdev\": %ju, "
+        "\"atime_ns\": %jd, \"mtime_ns\": %jd, \"ctime_ns\": %jd}",
+        (unsigned int)st.st_mode, (uintmax_t)st.st_ino, (uintmax_t)st.st_dev, (uintmax_t)st.st_nlink,
+        (unsigned int)st.st_uid, (unsigned int)st.st_gid, (intmax_t)st.st_size, (uintmax_t)st.st_rdev,
+        (intmax_t)st.st_atim.tv_sec * 1000000000 + st.st_atim.tv_nsec,
+        (intmax_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec,
+        (intmax_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec);
+}
+
+// List a directory. The names of the entries, except "." and "..", are sent
+// as data, each one terminated by a NUL byte, so that any name can be sent.
+static void init_cmd_listdir(struct init_testio* io, const struct init_request* req)
+{
+    char name[PATH_MAX];
+    if (sscanf(req->cmd, "listdir %s", name) != 1) {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
+    int fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        init_reply_errno(io, req, errno);
+        return;
+    }
+    size_t names_cap = 1 << 12;
+    size_t names_len = 0;
+    char* names = malloc(names_cap);
+    if (names == NULL) {
+        init_dief("cannot allocate memory for directory entries: %m\n");
+    }
+    char buf[1 << 15];
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof buf)) > 0) {
+        for (long off = 0; off < n;) {
+            struct dirent64* ent = (struct dirent64*)(buf + off);
+            off += ent->d_reclen;
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            size_t len = strlen(ent->d_name) + 1;
+            while (names_len + len > names_cap) {
+                names_cap *= 2;
+                if ((names = realloc(names, names_cap)) == NULL) {
+                    init_dief("cannot allocate memory for directory entries: %m\n");
+                }
+            }
+            memcpy(names + names_len, ent->d_name, len);
+            names_len += len;
+        }
+    }
+    if (n < 0) {
+        init_reply_errno(io, req, errno);
+    } else {
+        init_reply_dataf(io, req, names, names_len, "{\"result\": \"ok\", \"data_len\": %zu}", names_len);
+    }
+    free(names);
+    close(fd);
+}
+
+// Reply with the wait status of a process that was started at start_ns and
+// used the resources in ru.
+static void init_reply_status(struct init_testio* io, const struct init_request* req, int status, int64_t start_ns, const struct rusage* ru)
+{
+    char usage[160];
+    init_format_usage(usage, sizeof usage, start_ns, ru);
+    if (WIFEXITED(status)) {
+        init_replyf(io, req, "{\"result\": \"ok\", \"status\": \"exited\", \"code\": %d%s}", WEXITSTATUS(status), usage);
+    } else if (WIFSIGNALED(status)) {
+        init_replyf(io, req, "{\"result\": \"ok\", \"status\": \"signaled\", \"signal\": %d%s}", WTERMSIG(status), usage);
+    } else if (WIFSTOPPED(status)) {
+        init_replyf(io, req, "{\"result\": \"ok\", \"status\": \"stopped\", \"signal\": %d%s}", WSTOPSIG(status), usage);
+    }
+}
+
+// Read size bytes of request data into a newly allocated, NUL-terminated
+// buffer.
+static char* init_read_request_data(struct init_testio* io, struct init_request* req, size_t size)
+{
+    char* buf = malloc(size + 1);
+    if (buf == NULL) {
+        init_dief("cannot allocate memory for request data: %m\n");
+    }
+    init_read_exactly(io->in, buf, size);
+    buf[size] = '\0';
+    if (io->framed) {
+        req->data_len -= size;
+    }
+    return buf;
+}
+
+// Build the environment of a child process. The entries in extra, in the
+// form NAME=VALUE, replace or extend the environment of init. The entries
+// are borrowed, only the returned array must be freed.
+static char** init_make_environ(char** extra, size_t n_extra)
+{
+    size_t n = 0;
+    while (environ[n] != NULL) {
+        ++n;
+    }
+    char** envp = calloc(n + n_extra + 1, sizeof *envp);
+    if (envp == NULL) {
+        init_dief("cannot allocate memory for environment: %m\n");
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i) {
+        bool replaced = false;
+        for (size_t j = 0; j < n_extra && !replaced; ++j) {
+            size_t name_len = strcspn(extra[j], "=");
+            replaced = strncmp(environ[i], extra[j], name_len + 1) == 0;
+        }
+        if (!replaced) {
+            envp[k++] = environ[i];
+        }
+    }
+    for (size_t j = 0; j < n_extra; ++j) {
+        envp[k++] = extra[j];
+    }
+    return envp;
+}
+
+// Write output of a child process. In framed mode the output is sent as an
+// output frame of the request req, otherwise (or when req is NULL) it is
+// written to the console.
+static void init_write_output(struct init_testio* io, uint16_t stream, const struct init_request* req, const char* buf, size_t n)
+{
+    if (io->framed && req != NULL) {
+        init_write_frame(io, req->id, INIT_FRAME_OUTPUT, stream, NULL, 0, buf, n);
+        return;
+    }
+    for (size_t off = 0; off < n;) {
+        ssize_t m = write(STDOUT_FILENO, buf + off, n - off);
+        if (m < 0 && errno == EINTR) {
+            continue;
+        } else if (m < 0) {
+            // Don't let a broken console stop the child.
+            break;
+        }
+        off += m;
+    }
+}
+
+// Copy output of a child process from fd, once or, when drain is set, until
+// nothing more can be read without blocking, see init_write_output(). Returns
+// false at end of file.
+static bool init_copy_output(struct init_testio* io, int fd, uint16_t stream, const struct init_request* req, bool drain)
+{
+    char buf[1 << 12];
+    do {
+        ssize_t n = read(fd, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            return true;
+        } else if (n <= 0) {
+            return false;
+        }
+        init_write_output(io, stream, req, buf, n);
+    } while (drain);
+    return true;
+}
+
+// The shell server is a long-lived shell that sources a prelude, such as the
+// scripts under test, once. Each script it is asked to run is then sourced in
+// a subshell, which costs a fork but no exec and no parsing of the prelude.
+// Scripts are passed by path, one per line, on the stdin of the server and the
+// exit status of each subshell is written back, one per line, to fd 9.
+// The output of the scripts is read from pipes, while waiting for the status.
+// The prelude is kept so that the server can be restarted after a restore.
+struct init_sh_server {
+    pid_t pid;
+    int request_fd;
+    FILE* status;
+    int out_fds[2];
+    unsigned int counter;
+    char* prelude;
+    size_t prelude_len;
+};
+
+static struct init_sh_server init_sh_server = { .pid = -1, .request_fd = -1, .out_fds = { -1, -1 } };
+
+#define INIT_SH_SERVER_DIR "/tmp/sh-server"
+
+static const char init_sh_server_loop[] = ". " INIT_SH_SERVER_DIR "/prelude.sh\n"
+                                          "while read -r script; do\n"
+                                          "    (. \"$script\") </dev/null 9>&-\n"
+                                          "    echo $? >&9\n"
+                                          "done\n";
+
+// Forget the shell server after it exited and was reaped.
+static void init_sh_server_reaped()
+{
+    close(init_sh_server.request_fd);
+    fclose(init_sh_server.status);
+    close(init_sh_server.out_fds[0]);
+    close(init_sh_server.out_fds[1]);
+    init_sh_server.pid = -1;
+    init_sh_server.request_fd = -1;
+    init_sh_server.status = NULL;
+    init_sh_server.out_fds[0] = init_sh_server.out_fds[1] = -1;
+}
+
+static void init_sh_server_stop()
+{
+    if (init_sh_server.pid < 0) {
+        return;
+    }
+    // Closing stdin of the server makes it exit, once it is done with the
+    // script at hand. Its output is not wanted any more.
+    close(init_sh_server.request_fd);
+    init_sh_server.request_fd = -1;
+    close(init_sh_server.out_fds[0]);
+    close(init_sh_server.out_fds[1]);
+    init_sh_server.out_fds[0] = init_sh_server.out_fds[1] = -1;
+    if (waitpid(init_sh_server.pid, NULL, 0) < 0) {
+        init_dief("cannot wait for shell server: %m\n");
+    }
+    init_sh_server_reaped();
+}
+
+// Write request data to a new file at path.
+static void init_write_request_data_to(struct init_testio* io, struct init_request* req, const char* path, size_t size)
+{
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        init_dief("cannot open %s: %m\n", path);
+    }
+    if (init_testio_copy(io, fd, size, false) != size) {
+        init_dief("cannot write everything to %s: %m\n", path);
+    }
+    if (io->framed) {
+        req->data_len -= size;
+    }
+    if (close(fd) < 0) {
+        init_dief("cannot close %s: %m\n", path);
+    }
+}
+
+// Start the shell server with the prelude kept in init_sh_server.
+static void init_sh_server_start()
+{
+    init_mkdir(INIT_SH_SERVER_DIR, 0755);
+    int fd = open(INIT_SH_SERVER_DIR "/prelude.sh", O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        init_dief("cannot open prelude of shell server: %m\n");
+    }
+    for (size_t off = 0; off < init_sh_server.prelude_len;) {
+        ssize_t n = write(fd, init_sh_server.prelude + off, init_sh_server.prelude_len - off);
+        if (n < 0 && errno != EINTR) {
+            init_dief("cannot write prelude of shell server: %m\n");
+        }
+        off += n > 0 ? n : 0;
+    }
+    if (close(fd) < 0) {
+        init_dief("cannot close prelude of shell server: %m\n");
+    }
+
+    int request_pipe[2];
+    int status_pipe[2];
+    int stdout_pipe[2];
+    int stderr_pipe[2];
+    if (pipe2(request_pipe, O_CLOEXEC) < 0 || pipe2(status_pipe, O_CLOEXEC) < 0
+        || pipe2(stdout_pipe, O_CLOEXEC) < 0 || pipe2(stderr_pipe, O_CLOEXEC) < 0) {
+        init_dief("cannot create pipe: %m\n");
+    }
+    pid_t child = fork();
+    if (child < 0) {
+        init_dief("cannot fork shell server: %m\n");
+    } else if (child == 0) {
+        init_child_reset_signals();
+        if (dup2(request_pipe[0], 0) < 0 || dup2(stdout_pipe[1], 1) < 0
+            || dup2(stderr_pipe[1], 2) < 0) {
+            _exit(127);
+        }
+        // The pipe may already be fd 9, then dup2 leaves close-on-exec set.
+        if (status_pipe[1] == 9 ? fcntl(9, F_SETFD, 0) < 0 : dup2(status_pipe[1], 9) < 0) {
+            _exit(127);
+        }
+        execl("/bin/sh", "sh", "-c", init_sh_server_loop, NULL);
+        _exit(127);
+    }
+    close(request_pipe[0]);
+    close(status_pipe[1]);
+    close(stdout_pipe[1]);
+    close(stderr_pipe[1]);
+    fcntl(stdout_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(stderr_pipe[0], F_SETFL, O_NONBLOCK);
+    init_sh_server.pid = child;
+    init_sh_server.request_fd = request_pipe[1];
+    init_sh_server.out_fds[0] = stdout_pipe[0];
+    init_sh_server.out_fds[1] = stderr_pipe[0];
+    init_sh_server.status = fdopen(status_pipe[0], "r");
+    if (init_sh_server.status == NULL) {
+        init_dief("cannot open status stream: %m\n");
+    }
+}
+
+static void init_cmd_sh_server(struct init_testio* io, struct init_request* req)
+{
+    size_t size;
+    if (sscanf(req->cmd, "sh-server %zu", &size) < 1) {
+        init_dief("cannot parse sh-server command\n");
+    }
+    if (io->framed && size != req->data_len) {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
+    init_sh_server_stop();
+    free(init_sh_server.prelude);
+    init_sh_server.prelude = init_read_request_data(io, req, size);
+    init_sh_server.prelude_len = size;
+    init_sh_server_start();
+    init_replyf(io, req, "{\"result\": \"ok\", \"pid\": %d}", (int)init_sh_server.pid);
+}
+
+// Append output of a child process from fd to capture, until nothing more can
+// be read without blocking. Returns false at end of file.
+static bool init_capture_output(int fd, FILE* capture)
+{
+    char buf[1 << 12];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            return true;
+        } else if (n <= 0) {
+            return false;
+        }
+        if (fwrite(buf, n, 1, capture) != 1) {
+            init_dief("cannot capture output: %m\n");
+        }
+    }
+}
+
+// Scripts run with "sh-run SIZE trace" set PS4 to start with this marker,
+// after any number of '+' characters, and turn on xtrace. Such lines of the
+// standard error are not output; each one is kept in the trace instead, after
+// the time it was read at. Init reads the pipe as soon as the shell writes to
+// it, so the difference between the times of two lines is about the time the
+// first command took.
+#define INIT_TRACE_MARKER "@prof@"
+
+struct init_trace {
+    FILE* stream;
+    char line[1 << 12];
+    size_t len;
+};
+
+// Act on the line of standard error buffered in trace.
+static void init_trace_line(struct init_testio* io, const struct init_request* req, FILE* capture, struct init_trace* trace, int64_t now_ns)
+{
+    size_t skip = 0;
+    while (skip < trace->len && trace->line[skip] == '+') {
+        ++skip;
+    }
+    static const size_t marker_len = sizeof INIT_TRACE_MARKER - 1;
+    if (trace->len - skip >= marker_len && memcmp(trace->line + skip, INIT_TRACE_MARKER, marker_len) == 0) {
+        bool newline = trace->line[trace->len - 1] == '\n';
+        fprintf(trace->stream, "%jd %.*s%s", (intmax_t)now_ns, (int)trace->len, trace->line, newline ? "" : "\n");
+    } else if (capture != NULL) {
+        fwrite(trace->line, trace->len, 1, capture);
+    } else {
+        init_write_output(io, INIT_STREAM_STDERR, req, trace->line, trace->len);
+    }
+    trace->len = 0;
+}
+
+// Read all of the standard error of a traced script from fd, splitting it into
+// lines for init_trace_line().
+static void init_trace_output(struct init_testio* io, int fd, const struct init_request* req, FILE* capture, struct init_trace* trace)
+{
+    char buf[1 << 12];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return;
+        }
+        int64_t now_ns = init_clock_ns(CLOCK_MONOTONIC);
+        for (ssize_t i = 0; i < n; ++i) {
+            trace->line[trace->len++] = buf[i];
+            if (buf[i] == '\n' || trace->len == sizeof trace->line) {
+                init_trace_line(io, req, capture, trace, now_ns);
+            }
+        }
+    }
+}
+
+// Run the script at path in the shell server and store its exit status in
+// code. The output is appended to capture or, when capture is NULL, copied as
+// for the request req. With trace, xtrace lines of the standard error go to
+// the trace instead. Returns false, after stopping the server, if the server
+// went away.
+static bool init_sh_server_run(struct init_testio* io, const struct init_request* req, const char* path, FILE* capture, struct init_trace* trace, int* code)
+{
+    // Ask the server to run the script and wait for the exit status. If the
+    // server went away, don't get killed by SIGPIPE.
+    struct sigaction sa_ign = { .sa_handler = SIG_IGN };
+    struct sigaction sa_old;
+    sigaction(SIGPIPE, &sa_ign, &sa_old);
+    bool sent = dprintf(init_sh_server.request_fd, "%s\n", path) > 0;
+    sigaction(SIGPIPE, &sa_old, NULL);
+    // Copy output of the script until the status shows up. By then all of
+    // the output is in the pipes.
+    struct pollfd fds[] = {
+        { .fd = fileno(init_sh_server.status), .events = POLLIN },
+        { .fd = init_sh_server.out_fds[0], .events = POLLIN },
+        { .fd = init_sh_server.out_fds[1], .events = POLLIN },
+    };
+    static const uint16_t streams[] = { 0, INIT_STREAM_STDOUT, INIT_STREAM_STDERR };
+    while (sent && fds[0].revents == 0) {
+        if (poll(fds, sizeof fds / sizeof *fds, -1) < 0 && errno != EINTR) {
+            init_dief("cannot wait for shell server: %m\n");
+        }
+        for (size_t i = 1; i < sizeof fds / sizeof *fds; ++i) {
+            if (fds[i].revents == 0 && fds[0].revents == 0) {
+                continue;
+            }
+            if (trace != NULL && streams[i] == INIT_STREAM_STDERR) {
+                init_trace_output(io, fds[i].fd, req, capture, trace);
+            } else if (capture != NULL) {
+                init_capture_output(fds[i].fd, capture);
+            } else {
+                init_copy_output(io, fds[i].fd, streams[i], req, fds[0].revents != 0);
+            }
+        }
+    }
+    if (trace != NULL && trace->len > 0) {
+        init_trace_line(io, req, capture, trace, init_clock_ns(CLOCK_MONOTONIC));
+    }
+    if (sent && fscanf(init_sh_server.status, "%d", code) == 1) {
+        return true;
+    }
+    init_sh_server_stop();
+    return false;
+}
+
+static void init_cmd_sh_run(struct init_testio* io, struct init_request* req)
+{
+    size_t size;
+    char mode[6] = "";
+    if (sscanf(req->cmd, "sh-run %zu %5s", &size, mode) < 1) {
+        init_dief("cannot parse sh-run command\n");
+    }
+    if ((io->framed && size != req->data_len) || init_sh_server.pid < 0) {
+        if (!io->framed) {
+            init_testio_discard(io, size);
+        }
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, INIT_SH_SERVER_DIR "/%u.sh", init_sh_server.counter++);
+    init_write_request_data_to(io, req, path, size);
+
+    struct init_trace* trace = NULL;
+    char* trace_data = NULL;
+    size_t trace_len = 0;
+    if (strcmp(mode, "trace") == 0) {
+        trace = calloc(1, sizeof *trace);
+        if (trace == NULL || (trace->stream = open_memstream(&trace_data, &trace_len)) == NULL) {
+            init_dief("cannot allocate memory for trace: %m\n");
+        }
+    }
+    int code;
+    bool ran = init_sh_server_run(io, req, path, NULL, trace, &code);
+    if (trace != NULL) {
+        fclose(trace->stream);
+        free(trace);
+    }
+    if (ran && trace != NULL) {
+        char usage[160];
+        init_format_usage(usage, sizeof usage, req->start_ns, NULL);
+        init_reply_dataf(io, req, trace_data, trace_len,
+            "{\"result\": \"ok\", \"status\": \"exited\", \"code\": %d, \"end_ns\": %jd, \"data_len\": %zu%s}",
+            code, (intmax_t)init_clock_ns(CLOCK_MONOTONIC), trace_len, usage);
+    } else if (ran) {
+        char usage[160];
+        init_format_usage(usage, sizeof usage, req->start_ns, NULL);
+        init_replyf(io, req, "{\"result\": \"ok\", \"status\": \"exited\", \"code\": %d%s}", code, usage);
+    } else {
+        init_replyf(io, req, "{\"result\": \"error\", \"error\": \"shell server exited\"}");
+    }
+    free(trace_data);
+    unlink(path);
+}
+
+// Jobs are processes started by init that run concurrently with each other
+// and with the processing of further commands, and that are reaped by the
+// event loop when SIGCHLD arrives on a signalfd. The "spawn" command starts a
+// shell command as a job; in framed mode "system" and "exec" run their
+// programs as jobs too, so that requests don't wait for each other.
+//
+// The stdout and stderr of a job are pipes read by the event loop. Output that
+// belongs to a request waiting for the job is sent on test I/O as output
+// frames of that request, with the exit status in the reply at the end. In
+// text mode the output is copied to the console instead. In framed mode,
+// output of a job that nobody is waiting for yet stays in the pipes, so a job
+// that writes a lot blocks until it is waited for.
+struct init_job {
+    struct init_job* next;
+    unsigned int id;
+    pid_t pid;
+    // Read ends of the stdout and stderr pipes, -1 once closed.
+    int out_fds[2];
+    bool watched;
+    bool exited;
+    int status;
+    int64_t start_ns;
+    struct rusage ru;
+    // The request waiting for the job to exit, if any.
+    bool waited;
+    struct init_request wait_req;
+};
+
+struct init_events {
+    int epoll_fd;
+    int signal_fd;
+    int testio_fd;
+    // Test I/O cannot be polled when it is a regular file, always read it.
+    bool testio_polled;
+    unsigned int next_job_id;
+    struct init_job* jobs;
+};
+
+static struct init_events init_events = { .epoll_fd = -1, .signal_fd = -1, .testio_fd = -1, .next_job_id = 1 };
+
+static const uint16_t init_job_streams[] = { INIT_STREAM_STDOUT, INIT_STREAM_STDERR };
+
+static void init_events_setup(struct init_testio* io)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        init_dief("cannot block SIGCHLD: %m\n");
+    }
+    init_events.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (init_events.signal_fd < 0) {
+        init_dief("cannot create signalfd: %m\n");
+    }
+    init_events.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (init_events.epoll_fd < 0) {
+        init_dief("cannot create epoll instance: %m\n");
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = init_events.signal_fd };
+    if (epoll_ctl(init_events.epoll_fd, EPOLL_CTL_ADD, init_events.signal_fd, &ev) < 0) {
+        init_dief("cannot watch signalfd: %m\n");
+    }
+    init_events.testio_fd = fileno(io->in);
+    ev.data.fd = init_events.testio_fd;
+    if (epoll_ctl(init_events.epoll_fd, EPOLL_CTL_ADD, init_events.testio_fd, &ev) == 0) {
+        init_events.testio_polled = true;
+    } else if (errno != EPERM) {
+        init_dief("cannot watch test I/O: %m\n");
+    }
+}
+
+// Start or stop waiting for requests on test I/O.
+static void init_events_watch_testio(bool watch)
+{
+    if (!init_events.testio_polled) {
+        return;
+    }
+    struct epoll_event ev = { .events = watch ? EPOLLIN : 0, .data.fd = init_events.testio_fd };
+    if (epoll_ctl(init_events.epoll_fd, EPOLL_CTL_MOD, init_events.testio_fd, &ev) < 0) {
+        init_dief("cannot watch test I/O: %m\n");
+    }
+}
+
+static struct init_job* init_job_find(unsigned int id)
+{
+    for (struct init_job* job = init_events.jobs; job != NULL; job = job->next) {
+        if (job->id == id) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// Start reading output of the job in the event loop.
+static void init_job_watch(struct init_job* job)
+{
+    for (int i = 0; i < 2 && !job->watched; ++i) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = job->out_fds[i] };
+        if (job->out_fds[i] >= 0 && epoll_ctl(init_events.epoll_fd, EPOLL_CTL_ADD, job->out_fds[i], &ev) < 0) {
+            init_dief("cannot watch output of job: %m\n");
+        }
     }
-    fprintf(testio_out, "{\"result\": \"ok\", \"size\": %zu}\n", total_wrote);
+    job->watched = true;
 }
 
-static void init_cmd_shell(const char* cmd, FILE* testio_in, FILE* testio_out)
+static void init_job_close_output(struct init_job* job, int i)
+{
+    if (job->watched) {
+        epoll_ctl(init_events.epoll_fd, EPOLL_CTL_DEL, job->out_fds[i], NULL);
+    }
+    close(job->out_fds[i]);
+    job->out_fds[i] = -1;
+}
+
+// Copy available output of the job to wherever it should go.
+static void init_job_copy_output(struct init_testio* io, struct init_job* job, int i, bool drain)
+{
+    const struct init_request* req = job->waited ? &job->wait_req : NULL;
+    if (!init_copy_output(io, job->out_fds[i], init_job_streams[i], req, drain)) {
+        init_job_close_output(job, i);
+    }
+}
+
+static void init_job_free(struct init_job* job)
+{
+    for (struct init_job** p = &init_events.jobs; *p != NULL; p = &(*p)->next) {
+        if (*p == job) {
+            *p = job->next;
+            break;
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (job->out_fds[i] >= 0) {
+            init_job_close_output(job, i);
+        }
+    }
+    free(job);
+}
+
+// Send the rest of the output and the exit status of a job that exited to the
+// request waiting for it, and forget the job.
+static void init_job_finish(struct init_testio* io, struct init_job* job)
+{
+    // Anything the job wrote is in the pipes by now. Background processes
+    // that keep the pipes open are cut off.
+    for (int i = 0; i < 2; ++i) {
+        if (job->out_fds[i] >= 0) {
+            init_job_copy_output(io, job, i, true);
+        }
+    }
+    init_reply_status(io, &job->wait_req, job->status, job->start_ns, &job->ru);
+    fflush(io->out);
+    init_job_free(job);
+}
+
+// Reap all the children that exited, or with options set to 0, all the
+// children. These are jobs, the shell server, or orphans that were reparented
+// to init.
+static void init_events_reap(struct init_testio* io, int options)
+{
+    struct signalfd_siginfo si;
+    while (read(init_events.signal_fd, &si, sizeof si) == sizeof si) {
+    }
+    pid_t pid;
+    int status;
+    struct rusage ru;
+    while ((pid = wait4(-1, &status, options, &ru)) > 0) {
+        if (pid == init_sh_server.pid) {
+            init_sh_server_reaped();
+            continue;
+        }
+        struct init_job* job = init_events.jobs;
+        while (job != NULL && (job->pid != pid || job->exited)) {
+            job = job->next;
+        }
+        if (job == NULL) {
+            continue;
+        }
+        job->exited = true;
+        job->status = status;
+        job->ru = ru;
+        if (job->waited) {
+            init_job_finish(io, job);
+        } else if (job->watched) {
+            // The output goes to the console, get rid of it now.
+            for (int i = 0; i < 2; ++i) {
+                if (job->out_fds[i] >= 0) {
+                    init_job_copy_output(io, job, i, true);
+                    init_job_close_output(job, i);
+                }
+            }
+        }
+    }
+}
+
+// Wait for and handle one batch of events. Returns true if a request can be
+// read from test I/O.
+static bool init_events_poll(struct init_testio* io)
+{
+    struct epoll_event events[16];
+    int n = epoll_wait(init_events.epoll_fd, events, sizeof events / sizeof *events, init_events.testio_polled ? -1 : 0);
+    if (n < 0 && errno != EINTR) {
+        init_dief("cannot wait for events: %m\n");
+    }
+    bool testio_ready = !init_events.testio_polled;
+    for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == init_events.signal_fd) {
+            init_events_reap(io, WNOHANG);
+        } else if (fd == init_events.testio_fd) {
+            testio_ready = true;
+        } else {
+            // Jobs may have been finished by the reaper in this batch.
+            for (struct init_job* job = init_events.jobs; job != NULL; job = job->next) {
+                if (job->out_fds[0] == fd || job->out_fds[1] == fd) {
+                    init_job_copy_output(io, job, job->out_fds[0] == fd ? 0 : 1, false);
+                    break;
+                }
+            }
+        }
+    }
+    return testio_ready;
+}
+
+// Start a job running a program in the given working directory, with the
+// given environment (that of init when envp is NULL).
+static struct init_job* init_job_start(struct init_testio* io, const char* cwd, char* const argv[], char* const envp[])
+{
+    int stdout_pipe[2];
+    int stderr_pipe[2];
+    if (pipe2(stdout_pipe, O_CLOEXEC) < 0 || pipe2(stderr_pipe, O_CLOEXEC) < 0) {
+        init_dief("cannot create pipe: %m\n");
+    }
+    pid_t child = fork();
+    if (child < 0) {
+        init_dief("cannot fork job: %m\n");
+    } else if (child == 0) {
+        init_child_reset_signals();
+        // Put the job in its own process group, so that "kill" reaches all
+        // of its processes. Jobs must not read requests from test I/O.
+        setpgid(0, 0);
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd < 0 || dup2(null_fd, 0) < 0 || dup2(stdout_pipe[1], 1) < 0 || dup2(stderr_pipe[1], 2) < 0) {
+            _exit(127);
+        }
+        if (chdir(cwd) == 0) {
+            execvpe(argv[0], argv, envp != NULL ? envp : environ);
+        }
+        _exit(127);
+    }
+    setpgid(child, child);
+    close(stdout_pipe[1]);
+    close(stderr_pipe[1]);
+    struct init_job* job = calloc(1, sizeof *job);
+    if (job == NULL) {
+        init_dief("cannot allocate memory for job: %m\n");
+    }
+    job->id = init_events.next_job_id++;
+    job->pid = child;
+    job->start_ns = init_clock_ns(CLOCK_MONOTONIC);
+    job->out_fds[0] = stdout_pipe[0];
+    job->out_fds[1] = stderr_pipe[0];
+    for (int i = 0; i < 2; ++i) {
+        fcntl(job->out_fds[i], F_SETFL, O_NONBLOCK);
+        // Let the job get ahead of a slow consumer, if allowed.
+        fcntl(job->out_fds[i], F_SETPIPE_SZ, 1 << 20);
+    }
+    job->next = init_events.jobs;
+    init_events.jobs = job;
+    if (!io->framed) {
+        init_job_watch(job);
+    }
+    return job;
+}
+
+// Reply to req with the exit status of the job once it exits, and forget the
+// job. In framed mode the reply is deferred and other requests are processed
+// meanwhile. Replies in text mode come in order of requests, so no more
+// requests are read until the job exits, while other jobs keep running.
+static void init_job_wait(struct init_testio* io, const struct init_request* req, struct init_job* job)
+{
+    job->waited = true;
+    job->wait_req = *req;
+    job->wait_req.cmd = NULL;
+    init_job_watch(job);
+    if (io->framed && !job->exited) {
+        return;
+    }
+    if (!job->exited) {
+        init_events_watch_testio(false);
+        while (!job->exited) {
+            init_events_poll(io);
+        }
+        init_events_watch_testio(true);
+    } else {
+        init_job_finish(io, job);
+    }
+}
+
+static void init_cmd_spawn(struct init_testio* io, const struct init_request* req)
+{
+    char* argv[] = { "sh", "-c", req->cmd + strlen("spawn "), NULL };
+    struct init_job* job = init_job_start(io, "/", argv, NULL);
+    init_replyf(io, req, "{\"result\": \"ok\", \"job\": %u, \"pid\": %d}", job->id, (int)job->pid);
+}
+
+static void init_cmd_wait(struct init_testio* io, const struct init_request* req)
+{
+    unsigned int id;
+    struct init_job* job = NULL;
+    if (sscanf(req->cmd, "wait %u", &id) == 1) {
+        job = init_job_find(id);
+    }
+    if (job == NULL || job->waited) {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
+    init_job_wait(io, req, job);
+}
+
+static void init_cmd_kill(struct init_testio* io, const struct init_request* req)
+{
+    unsigned int id;
+    int sig = SIGTERM;
+    struct init_job* job = NULL;
+    if (sscanf(req->cmd, "kill %u %d", &id, &sig) >= 1) {
+        job = init_job_find(id);
+    }
+    if (job == NULL) {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+    } else if (job->exited) {
+        init_replyf(io, req, "{\"result\": \"error\", \"error\": \"job is not running\"}");
+    } else if (kill(-job->pid, sig) < 0) {
+        init_replyf(io, req, "{\"result\": \"error\", \"error\": \"%s\"}", strerror(errno));
+    } else {
+        init_replyf(io, req, "{\"result\": \"ok\"}");
+    }
+}
+
+static void init_cmd_system(struct init_testio* io, const struct init_request* req)
+{
+    char* argv[] = { "sh", "-c", req->cmd + strlen("system "), NULL };
+    init_job_wait(io, req, init_job_start(io, "/", argv, NULL));
+}
+
+static void init_cmd_exec(struct init_testio* io, struct init_request* req)
+{
+    unsigned int argc;
+    unsigned int envc;
+    size_t size;
+    if (sscanf(req->cmd, "exec %u %u %zu", &argc, &envc, &size) < 3) {
+        init_dief("cannot parse exec command\n");
+    }
+    if ((io->framed && size != req->data_len) || argc == 0) {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
+    // The data contains NUL-terminated strings: the working directory, argc
+    // arguments and envc environment entries.
+    char* data = init_read_request_data(io, req, size);
+    size_t n_strs = 1 + (size_t)argc + envc;
+    char** strs = calloc(n_strs + 1, sizeof *strs);
+    if (strs == NULL) {
+        init_dief("cannot allocate memory for arguments: %m\n");
+    }
+    size_t n = 0;
+    for (size_t off = 0; off < size && n < n_strs; off += strlen(data + off) + 1) {
+        strs[n++] = data + off;
+    }
+    if (n != n_strs || size == 0 || data[size - 1] != '\0') {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        free(strs);
+        free(data);
+        return;
+    }
+    const char* cwd = strs[0];
+    char** argv = strs + 1;
+    char** envp = init_make_environ(argv + argc, envc);
+    // Arguments are followed by environment entries, terminate the list.
+    argv[argc] = NULL;
+
+    // Run the program directly, without going through the shell.
+    init_job_wait(io, req, init_job_start(io, cwd, argv, envp));
+    free(envp);
+    free(strs);
+    free(data);
+}
+
+// A checkpoint makes the state of the file system cheap to throw away. All
+// the changes made after the "checkpoint" command land in a tmpfs, mounted on
+// INIT_CHECKPOINT_DIR, as the upper layers of overlays over "/" (which covers
+// /tmp) and over /run. /dev, /proc and /sys are bind-mounted into the new root
+// and init, together with everything it starts, runs chrooted into it. The
+// "restore" command kills all the other processes, leaves the chroot through
+// a file descriptor of the real root, drops the tmpfs and starts over with a
+// fresh one. The shell server, if it was running, is started again.
+//
+// Since every process but init is killed, checkpoints are only supported when
+// init is running as PID 1, that is, in the virtual machine.
+#define INIT_CHECKPOINT_DIR "/.checkpoint"
+
+struct init_checkpoint {
+    bool active;
+    // The root directory of the initramfs, the lower layer of the overlay.
+    int root_fd;
+};
+
+static struct init_checkpoint init_checkpoint = { .root_fd = -1 };
+
+// Mount an overlay of lower with upper and work directories in the
+// checkpoint tmpfs, named after name.
+static int init_checkpoint_overlay(const char* lower, const char* name, const char* target, unsigned long flags)
+{
+    char upper[PATH_MAX];
+    char work[PATH_MAX];
+    char options[3 * PATH_MAX];
+    snprintf(upper, sizeof upper, INIT_CHECKPOINT_DIR "/%s-upper", name);
+    snprintf(work, sizeof work, INIT_CHECKPOINT_DIR "/%s-work", name);
+    snprintf(options, sizeof options, "lowerdir=%s,upperdir=%s,workdir=%s", lower, upper, work);
+    init_mkdir(upper, 0755);
+    init_mkdir(work, 0755);
+    return mount("overlay", target, "overlay", flags, options);
+}
+
+// Build the overlays for a new checkpoint and move into them. Returns 0 on
+// success or an errno value.
+static int init_checkpoint_enter()
+{
+    init_mkdir(INIT_CHECKPOINT_DIR, 0700);
+    if (mount("tmpfs", INIT_CHECKPOINT_DIR, "tmpfs", MS_NOSUID, "mode=0700") < 0) {
+        return errno;
+    }
+    const char* root = INIT_CHECKPOINT_DIR "/root";
+    init_mkdir(root, 0755);
+    int err = 0;
+    int rc = init_checkpoint_overlay("/", "root", root, 0);
+    if (rc < 0 && errno == ENODEV) {
+        // The overlay file system may be a module.
+        if (system("modprobe -q overlay") != 0) {
+            init_logf("cannot load overlay module\n");
+        }
+        rc = init_checkpoint_overlay("/", "root", root, 0);
+    }
+    if (rc < 0) {
+        err = errno;
+    }
+    // In the order of init_early_mount().
+    static const char* const binds[] = { "/sys", "/proc", "/dev" };
+    char target[PATH_MAX];
+    for (size_t i = 0; i < sizeof binds / sizeof *binds && err == 0; ++i) {
+        snprintf(target, sizeof target, "%s%s", root, binds[i]);
+        if (mount(binds[i], target, NULL, MS_BIND | MS_REC, NULL) < 0) {
+            err = errno;
+        }
+    }
+    snprintf(target, sizeof target, "%s/run", root);
+    if (err == 0 && init_checkpoint_overlay("/run", "run", target, MS_NOEXEC | MS_NOSUID) < 0) {
+        err = errno;
+    }
+    if (err == 0 && (chdir(root) < 0 || chroot(".") < 0 || chdir("/") < 0)) {
+        err = errno;
+    }
+    if (err != 0) {
+        umount2(INIT_CHECKPOINT_DIR, MNT_DETACH);
+        return err;
+    }
+    init_checkpoint.active = true;
+    return 0;
+}
+
+// Leave the chroot of the current checkpoint and drop all of its changes.
+static void init_checkpoint_leave()
+{
+    if (fchdir(init_checkpoint.root_fd) < 0 || chroot(".") < 0) {
+        init_dief("cannot leave checkpoint: %m\n");
+    }
+    // This takes the bind mounts and the overlay of /run along.
+    if (umount2(INIT_CHECKPOINT_DIR "/root", MNT_DETACH) < 0 || umount2(INIT_CHECKPOINT_DIR, MNT_DETACH) < 0) {
+        init_dief("cannot unmount checkpoint: %m\n");
+    }
+    init_checkpoint.active = false;
+}
+
+// Kill all the processes except init and reap them. Nothing may keep using
+// files of a checkpoint that is about to go away.
+static void init_kill_all(struct init_testio* io)
+{
+    if (kill(-1, SIGKILL) < 0 && errno != ESRCH) {
+        init_dief("cannot kill processes: %m\n");
+    }
+    init_events_reap(io, 0);
+    // Jobs nobody waited for are gone for good.
+    struct init_job* job = init_events.jobs;
+    while (job != NULL) {
+        struct init_job* next = job->next;
+        init_job_free(job);
+        job = next;
+    }
+}
+
+// Take a new checkpoint, after dropping the current one when restore is set.
+// The shell server, if any, is started again on top of the checkpoint. Returns
+// 0 on success or an errno value.
+static int init_checkpoint_reset(struct init_testio* io, bool restore)
+{
+    if (init_checkpoint.root_fd < 0) {
+        init_checkpoint.root_fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (init_checkpoint.root_fd < 0) {
+            init_dief("cannot open root directory: %m\n");
+        }
+    }
+    bool sh_server = init_sh_server.pid >= 0;
+    init_kill_all(io);
+    if (restore) {
+        init_checkpoint_leave();
+    }
+    int err = init_checkpoint_enter();
+    if (sh_server) {
+        init_sh_server_start();
+    }
+    return err;
+}
+
+static void init_cmd_checkpoint(struct init_testio* io, const struct init_request* req)
+{
+    bool restore = strcmp(req->cmd, "restore") == 0;
+    if (getpid() != 1 || init_checkpoint.active != restore) {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
+    int err = init_checkpoint_reset(io, restore);
+    if (err != 0) {
+        init_reply_errno(io, req, err);
+    } else {
+        char usage[160];
+        init_format_usage(usage, sizeof usage, req->start_ns, NULL);
+        init_replyf(io, req, "{\"result\": \"ok\"%s}", usage);
+    }
+}
+
+// Run a batch of scripts in the shell server, each one on top of a fresh copy
+// of the checkpoint. The data is a sequence of entries, each one a line with
+// the size of the script and the path of a file to collect after it ran (such
+// as a log of mocked calls), followed by the script. The reply has one item
+// per script in "runs", with the exit status and the sizes of the output of
+// the script and of the collected file, which follow each other in the data
+// of the reply. Only the framed protocol can carry such a reply.
+static void init_cmd_sh_batch(struct init_testio* io, struct init_request* req)
+{
+    if (!io->framed || !init_checkpoint.active || init_sh_server.pid < 0) {
+        init_replyf(io, req, "{\"result\": \"bad-request\"}");
+        return;
+    }
+    size_t bundle_len = req->data_len;
+    char* bundle = init_read_request_data(io, req, bundle_len);
+    char* runs = NULL;
+    size_t runs_len = 0;
+    char* data = NULL;
+    size_t data_len = 0;
+    FILE* runs_stream = open_memstream(&runs, &runs_len);
+    FILE* data_stream = open_memstream(&data, &data_len);
+    if (runs_stream == NULL || data_stream == NULL) {
+        init_dief("cannot allocate memory for batch: %m\n");
+    }
+    const char* error = NULL;
+    for (size_t off = 0; off < bundle_len && error == NULL;) {
+        size_t script_len;
+        char collect[PATH_MAX];
+        int header_len;
+        if (sscanf(bundle + off, "%zu %4095s%n", &script_len, collect, &header_len) != 2
+            || bundle[off + header_len] != '\n' || script_len > bundle_len - off - header_len - 1) {
+            error = "bad entry";
+            break;
+        }
+        off += header_len + 1;
+        int err = init_checkpoint_reset(io, true);
+        if (err != 0) {
+            error = strerror(err);
+            break;
+        }
+        const char* path = INIT_SH_SERVER_DIR "/batch.sh";
+        int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+        if (fd < 0 || write(fd, bundle + off, script_len) != (ssize_t)script_len || close(fd) < 0) {
+            init_dief("cannot write %s: %m\n", path);
+        }
+        off += script_len;
+        long output_start = ftell(data_stream);
+        int code;
+        if (!init_sh_server_run(io, req, path, data_stream, NULL, &code)) {
+            error = "shell server exited";
+            break;
+        }
+        long output_end = ftell(data_stream);
+        size_t file_len = 0;
+        char* file = NULL;
+        fd = open(collect, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            file = init_read_fd(fd, &file_len);
+            close(fd);
+        }
+        if (file_len > 0 && fwrite(file, file_len, 1, data_stream) != 1) {
+            init_dief("cannot capture %s: %m\n", collect);
+        }
+        free(file);
+        fprintf(runs_stream, "%s{\"status\": \"exited\", \"code\": %d, \"output_len\": %ld, \"file_len\": %zu}",
+            ftell(runs_stream) > 0 ? ", " : "", code, output_end - output_start, file_len);
+    }
+    free(bundle);
+    fclose(runs_stream);
+    fclose(data_stream);
+    if (error != NULL) {
+        init_replyf(io, req, "{\"result\": \"error\", \"error\": \"%s\"}", error);
+    } else {
+        char usage[160];
+        init_format_usage(usage, sizeof usage, req->start_ns, NULL);
+        init_reply_dataf(io, req, data, data_len, "{\"result\": \"ok\", \"runs\": [%s], \"data_len\": %zu%s}", runs, data_len, usage);
+    }
+    free(runs);
+    free(data);
+}
+
+static void init_cmd_shell(struct init_testio* io, const struct init_request* req)
 {
     pid_t child = fork();
     if (child == 0) {
+        init_child_reset_signals();
         execl("/bin/sh", "sh", NULL);
         exit(1);
     } else {
         int status;
-        if (waitpid(child, &status, 0) < 0) {
+        struct rusage ru;
+        if (wait4(child, &status, 0, &ru) < 0) {
             init_dief("cannot wait for child process: %m\n");
         }
-        if (WIFEXITED(status)) {
-            fprintf(testio_out, "{\"result\": \"ok\", \"status\": \"exited\", \"code\": %d}\n", WEXITSTATUS(status));
-        } else if (WIFSIGNALED(status)) {
-            fprintf(testio_out, "{\"result\": \"ok\", \"status\": \"signaled\", \"signal\": %d}\n", WTERMSIG(status));
-        } else if (WIFSTOPPED(status)) {
-            fprintf(testio_out, "{\"result\": \"ok\", \"status\": \"stopped\", \"signal\": %d}\n", WSTOPSIG(status));
+        init_reply_status(io, req, status, req->start_ns, &ru);
+        if (WIFSTOPPED(status)) {
             // We don't want stopped processes, kill them.
             kill(child, SIGKILL);
-            wait(NULL);
+            waitpid(child, NULL, 0);
         }
     }
 }
 
-static void init_process_commands(FILE* testio_in, FILE* testio_out)
+// Discard request data that the command did not consume.
+static void init_skip_request_data(struct init_testio* io, struct init_request* req)
 {
-    char* cmd = NULL;
-    size_t cmd_cap = 0;
-    ssize_t cmd_len = 0;
-    bool again = true;
-    while (again) {
+    init_testio_discard(io, req->data_len);
+    req->data_len = 0;
+}
+
+// Read one request, in either text or framed mode. The command is stored in
+// req->cmd, which is reallocated as needed and must be freed by the caller.
+static void init_read_request(struct init_testio* io, struct init_request* req, size_t* cmd_cap)
+{
+    req->id = 0;
+    req->data_len = 0;
+    if (!io->framed) {
         // Get a command and chomp the trailing newline.
-        if ((cmd_len = getline(&cmd, &cmd_cap, testio_in)) < 0) {
+        ssize_t cmd_len = getline(&req->cmd, cmd_cap, io->in);
+        if (cmd_len < 0) {
             init_dief("cannot read command: %m\n");
         }
-        if (cmd_len > 0 && cmd[cmd_len - 1] == '\n') {
-            cmd[cmd_len - 1] = '\0';
-            cmd_len -= 1;
+        if (cmd_len > 0 && req->cmd[cmd_len - 1] == '\n') {
+            req->cmd[cmd_len - 1] = '\0';
+        }
+        req->start_ns = init_clock_ns(CLOCK_MONOTONIC);
+        return;
+    }
+    struct init_frame_header hdr;
+    init_read_exactly(io->in, &hdr, sizeof hdr);
+    req->start_ns = init_clock_ns(CLOCK_MONOTONIC);
+    if (hdr.kind != INIT_FRAME_REQUEST) {
+        init_dief("cannot handle frame of kind %u\n", hdr.kind);
+    }
+    if (*cmd_cap < (size_t)hdr.head_len + 1) {
+        *cmd_cap = (size_t)hdr.head_len + 1;
+        if ((req->cmd = realloc(req->cmd, *cmd_cap)) == NULL) {
+            init_dief("cannot allocate memory for command: %m\n");
+        }
+    }
+    init_read_exactly(io->in, req->cmd, hdr.head_len);
+    req->cmd[hdr.head_len] = '\0';
+    req->id = hdr.id;
+    req->data_len = hdr.data_len;
+}
+
+static void init_write_frame(struct init_testio* io, uint32_t id, uint16_t kind, uint16_t flags, const void* head, size_t head_len, const void* data, size_t data_len)
+{
+    struct init_frame_header hdr = {
+        .id = id,
+        .kind = kind,
+        .flags = flags,
+        .head_len = head_len,
+        .data_len = data_len,
+    };
+    if (fwrite(&hdr, sizeof hdr, 1, io->out) != 1
+        || (head_len > 0 && fwrite(head, head_len, 1, io->out) != 1)
+        || (data_len > 0 && fwrite(data, data_len, 1, io->out) != 1)) {
+        init_dief("cannot write frame to test I/O: %m\n");
+    }
+}
+
+static void init_vreplyf(struct init_testio* io, const struct init_request* req, const void* data, size_t data_len, const char* fmt, va_list ap)
+{
+    char* reply = NULL;
+    int reply_len = vasprintf(&reply, fmt, ap);
+    if (reply_len < 0) {
+        init_dief("cannot format reply: %m\n");
+    }
+    if (io->framed) {
+        init_write_frame(io, req->id, INIT_FRAME_REPLY, 0, reply, reply_len, data, data_len);
+    } else {
+        fprintf(io->out, "%s\n", reply);
+        if (data_len > 0 && fwrite(data, data_len, 1, io->out) != 1) {
+            init_dief("cannot write reply data to test I/O: %m\n");
+        }
+    }
+    free(reply);
+}
+
+static void init_replyf(struct init_testio* io, const struct init_request* req, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    init_vreplyf(io, req, NULL, 0, fmt, ap);
+    va_end(ap);
+}
+
+// Reply with data. In framed mode the data is the data of the reply frame, in
+// text mode it follows the reply line. Either way the reply must have the
+// length of the data in the "data_len" item.
+static void init_reply_dataf(struct init_testio* io, const struct init_request* req, const void* data, size_t data_len, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    init_vreplyf(io, req, data, data_len, fmt, ap);
+    va_end(ap);
+}
+
+static void init_process_commands(struct init_testio* io)
+{
+    struct init_request req = { 0 };
+    size_t cmd_cap = 0;
+    bool again = true;
+    init_events_setup(io);
+    while (again) {
+        if (!init_events_poll(io)) {
+            continue;
         }
+        init_read_request(io, &req, &cmd_cap);
+        const char* cmd = req.cmd;
         // Process commands:
-        if (strcmp(cmd, "") == 0) {
+        if (strcmp(cmd, "") == 0 && !io->framed) {
         } else if (strcmp(cmd, "exit") == 0) {
-            // exit  - stop the command parse
+            // exit   - stop the command parse
             again = false;
-            fprintf(testio_out, "{\"result\": \"ok\"}\n");
+            init_replyf(io, &req, "{\"result\": \"ok\"}");
         } else if (strcmp(cmd, "ping") == 0) {
-            // ping  - reply with a pong
-            fprintf(testio_out, "{\"result\": \"ok\"}\n");
+            // ping   - reply with a pong
+            init_replyf(io, &req, "{\"result\": \"ok\"}");
+        } else if (strcmp(cmd, "framed") == 0) {
+            // framed - switch to the framed protocol, after replying
+            init_replyf(io, &req, "{\"result\": \"ok\", \"protocol\": \"framed\"}");
+            io->framed = true;
         } else if (strstr(cmd, "system ") == cmd) {
-            // write - write a file at any path, with any permissions
-            init_cmd_system(cmd, testio_in, testio_out);
+            // system - run a shell command
+            init_cmd_system(io, &req);
         } else if (strstr(cmd, "write ") == cmd) {
-            // run   - run a shell command
-            init_cmd_write(cmd, testio_in, testio_out);
+            // write  - write a file at any path, with any permissions
+            init_cmd_write(io, &req);
+        } else if (strstr(cmd, "read ") == cmd) {
+            // read   - read a file, or a part of it, at any path
+            init_cmd_read(io, &req);
+        } else if (strstr(cmd, "stat ") == cmd || strstr(cmd, "lstat ") == cmd) {
+            // stat   - get status of a file, lstat doesn't follow symlinks
+            init_cmd_stat(io, &req);
+        } else if (strstr(cmd, "listdir ") == cmd) {
+            // listdir - list names of entries of a directory
+            init_cmd_listdir(io, &req);
+        } else if (strstr(cmd, "exec ") == cmd) {
+            // exec   - run a program directly, with given arguments and environment
+            init_cmd_exec(io, &req);
+        } else if (strstr(cmd, "sh-server ") == cmd) {
+            // sh-server - (re)start the shell server with the given prelude
+            init_cmd_sh_server(io, &req);
+        } else if (strstr(cmd, "sh-run ") == cmd) {
+            // sh-run - run a shell script in the shell server
+            init_cmd_sh_run(io, &req);
+        } else if (strcmp(cmd, "sh-batch") == 0) {
+            // sh-batch - run many scripts in the shell server, each one from the checkpoint
+            init_cmd_sh_batch(io, &req);
+        } else if (strstr(cmd, "spawn ") == cmd) {
+            // spawn  - start a shell command as a job, reply with the job id
+            init_cmd_spawn(io, &req);
+        } else if (strstr(cmd, "wait ") == cmd) {
+            // wait   - wait for a job to exit, reply with its exit status
+            init_cmd_wait(io, &req);
+        } else if (strstr(cmd, "kill ") == cmd) {
+            // kill   - send a signal (SIGTERM by default) to a job
+            init_cmd_kill(io, &req);
+        } else if (strcmp(cmd, "checkpoint") == 0 || strcmp(cmd, "restore") == 0) {
+            // checkpoint - start recording changes to the file system in an overlay
+            // restore    - throw away changes since the checkpoint, and all processes
+            init_cmd_checkpoint(io, &req);
         } else if (strcmp(cmd, "shell") == 0) {
-            // shell - spawn a shell attached to test I/O, for interactive debugging
-            init_cmd_shell(cmd, testio_in, testio_out);
+            // shell  - spawn a shell attached to test I/O, for interactive debugging
+            init_cmd_shell(io, &req);
         } else {
-            fprintf(testio_out, "{\"result\": \"bad-request\"}\n");
+            init_replyf(io, &req, "{\"result\": \"bad-request\"}");
         }
-        fflush(testio_out);
+        init_skip_request_data(io, &req);
+        fflush(io->out);
     }
-    if (cmd != NULL) {
-        free(cmd);
+    if (req.cmd != NULL) {
+        free(req.cmd);
     }
 }
 
-static FILE* init_open_testio(const char* testio_devname)
+// Connect to the host over AF_VSOCK, assuming the host is listening on the
+// given port. The transport driver is loaded on demand when it is modular.
+static int init_connect_vsock(unsigned int port)
+{
+    int sock_fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0 && errno == EAFNOSUPPORT) {
+        if (system("modprobe -q vmw_vsock_virtio_transport") != 0) {
+            init_logf("cannot load vsock transport module\n");
+        }
+        sock_fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (sock_fd < 0) {
+        init_dief("cannot create vsock socket: %m\n");
+    }
+    struct sockaddr_vm addr = {
+        .svm_family = AF_VSOCK,
+        .svm_cid = VMADDR_CID_HOST,
+        .svm_port = port,
+    };
+    if (connect(sock_fd, (struct sockaddr*)&addr, sizeof addr) < 0) {
+        init_dief("cannot connect to vsock port %u: %m\n", port);
+    }
+    return sock_fd;
+}
+
+// Open the serial port /dev/<testio_devname>. Emulated serial ports are
+// switched to raw mode, virtio-serial ports are not terminals and are used
+// as-is.
+static int init_open_serial(const char* testio_devname)
 {
     char testio_path[PATH_MAX];
     if (snprintf(testio_path, sizeof testio_path, "/dev/%s", testio_devname) >= sizeof testio_path) {
@@ -207,6 +1865,9 @@ static FILE* init_open_testio(const char* testio_devname)
     if (testio_fd < 0) {
         init_dief("cannot open serial port %s: %m\n", testio_path);
     }
+    if (!isatty(testio_fd)) {
+        return testio_fd;
+    }
     // Enable exclusive mode on the testio serial port. In case some tests
     // accidentally tries to use it and clobber the python-init interaction.
     if (ioctl(testio_fd, TIOCEXCL) < 0) {
@@ -221,6 +1882,22 @@ static FILE* init_open_testio(const char* testio_devname)
     if (ioctl(testio_fd, TCSETS, &t) < 0) {
         init_dief("cannot set serial port settings: %m\n");
     }
+    return testio_fd;
+}
+
+static FILE* init_open_testio(const char* testio_devname)
+{
+    int testio_fd;
+    unsigned int port;
+    char c;
+    if (strstr(testio_devname, "vsock:") == testio_devname) {
+        if (sscanf(testio_devname, "vsock:%u%c", &port, &c) != 1) {
+            init_dief("cannot parse vsock port in %s\n", testio_devname);
+        }
+        testio_fd = init_connect_vsock(port);
+    } else {
+        testio_fd = init_open_serial(testio_devname);
+    }
     // Wrap the file descriptor in FILE for convenience.
     FILE* f = fdopen(testio_fd, "rb+");
     if (f == NULL) {
@@ -309,6 +1986,11 @@ static void init_logf(const char* fmt, ...)
 
 static void init_exit_qemu(int code)
 {
+    // Run from the build tree, as by "make check-init", there is no qemu to
+    // exit and the IO port belongs to the host.
+    if (getpid() != 1) {
+        exit(code);
+    }
     // Allow access into space of IO ports at the address of isa-debug-exit
     // device that is exposed by QEMU.
     if (ioperm(0xf4, sizeof(long) * 8, 1) < 0) {
@@ -0,0 +1,45 @@
+#!/bin/sh -e
+
+# Check the decisions of the ext4-state helper on small filesystem images.
+
+if ! command -v mke2fs >/dev/null || ! command -v tune2fs >/dev/null; then
+	echo "Skipping ext4-state tests, e2fsprogs is not installed"
+	exit 0
+fi
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+img="$work/writable.img"
+
+mke2fs -q -F -t ext4 -L writable "$img" 16M
+
+echo "Testing ext4-state skips a clean filesystem"
+set -x
+test "$(./src/ext4-state "$img")" = "clean"
+set +x
+
+echo "Testing ext4-state checks a filesystem with errors"
+tune2fs -E force_fsck "$img" >/dev/null
+set -x
+test "$(./src/ext4-state "$img" || true)" = "check: errors recorded"
+set +x
+e2fsck -fy "$img" >/dev/null 2>&1
+
+echo "Testing ext4-state checks a filesystem that is due by mount count"
+tune2fs -C 30 "$img" >/dev/null
+set -x
+test "$(./src/ext4-state "$img" || true)" = "check: mounted 30 times without a check"
+test "$(./src/ext4-state -m 31 "$img")" = "clean"
+set +x
+tune2fs -C 5 -c 5 "$img" >/dev/null
+set -x
+test "$(./src/ext4-state -m 31 "$img" || true)" = "check: mounted 5 times without a check"
+set +x
+tune2fs -C 0 -c -1 "$img" >/dev/null
+
+echo "Testing ext4-state checks a damaged superblock"
+printf 'x' | dd of="$img" bs=1 seek=1300 conv=notrunc 2>/dev/null
+set -x
+test "$(./src/ext4-state "$img" || true)" = "check: bad superblock checksum"
+test "$(./src/ext4-state /dev/null || true)" = "check: cannot read the superblock: short read"
+set +x
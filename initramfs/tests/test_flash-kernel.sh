@@ -0,0 +1,40 @@
+#!/bin/sh -e
+
+# Check that the flash-kernel helper writes boot images exactly, writing
+# only the blocks that changed and leaving the rest of the partition alone.
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+img="$work/boot.img"
+part="$work/recovery"
+
+# an image that ends mid block, on a larger partition
+dd if=/dev/urandom of="$img" bs=1000 count=3000 2>/dev/null
+dd if=/dev/urandom of="$part" bs=1M count=4 2>/dev/null
+cp "$part" "$work/old"
+
+echo "Testing flash-kernel writes the image and keeps the rest"
+set -x
+./src/flash-kernel "$img" "$part" 2>"$work/log"
+cmp -n 3000000 "$img" "$part"
+cmp -i 3000000 "$part" "$work/old"
+set +x
+
+echo "Testing flash-kernel writes only the blocks that differ"
+set -x
+./src/flash-kernel "$img" "$part" 2>"$work/log"
+grep -q "wrote 0 of 733 blocks" "$work/log"
+set +x
+printf 'changed' | dd of="$img" bs=1 seek=1500000 conv=notrunc 2>/dev/null
+set -x
+./src/flash-kernel "$img" "$part" 2>"$work/log"
+grep -q "wrote 1 of 733 blocks" "$work/log"
+cmp -n 3000000 "$img" "$part"
+set +x
+
+echo "Testing flash-kernel refuses an image larger than the partition"
+truncate -s 1M "$work/small"
+set -x
+if ./src/flash-kernel "$img" "$work/small" 2>/dev/null; then exit 1; fi
+cmp "$work/small" /dev/zero 2>&1 | grep -q EOF
+set +x
@@ -0,0 +1,48 @@
+#!/bin/sh -e
+
+# Check the readahead lists of the mount-snap helper. Mounting needs root and
+# loop devices, which is left to the spread tests.
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+snap="$work/core.snap"
+
+echo "Testing mount-snap records the cached ranges of a snap"
+dd if=/dev/zero of="$snap" bs=4096 count=64 2>/dev/null
+dd if="$snap" of=/dev/null bs=4096 count=4 2>/dev/null
+./src/mount-snap record "$snap" > "$work/list"
+set -x
+# every line is an offset and a length in whole pages
+test -z "$(grep -Ev '^[0-9]+ [0-9]+$' "$work/list")"
+test "$(awk '{ n += $2 } END { print n % 4096 }' "$work/list")" = 0
+set +x
+
+echo "Testing mount-snap records a list to a file"
+./src/mount-snap record "$snap" "$work/file-list"
+set -x
+test "$(cat "$work/file-list")" = "$(./src/mount-snap record "$snap")"
+test ! -e "$work/.file-list.tmp"
+set +x
+
+echo "Testing mount-snap records a list in the background"
+set -x
+./src/mount-snap record -w 1 "$snap" "$work/later-list"
+test ! -e "$work/later-list"
+set +x
+for _ in 1 2 3 4 5 6 7 8 9 10; do
+	[ -e "$work/later-list" ] && break
+	sleep 1
+done
+set -x
+test -z "$(grep -Ev '^[0-9]+ [0-9]+$' "$work/later-list")"
+set +x
+
+echo "Testing mount-snap refuses a bad command line"
+set -x
+if ./src/mount-snap "$snap" 2>/dev/null; then exit 1; fi
+if ./src/mount-snap -p "$work/list" 2>/dev/null; then exit 1; fi
+if ./src/mount-snap record "$work/missing" 2>/dev/null; then exit 1; fi
+if ./src/mount-snap -b 2>/dev/null; then exit 1; fi
+if ./src/mount-snap record -w 1 "$snap" 2>/dev/null; then exit 1; fi
+if ./src/mount-snap record "$snap" "$work/missing/list" 2>/dev/null; then exit 1; fi
+set +x
@@ -0,0 +1,52 @@
+#!/bin/sh -e
+
+# Check that the resize-writable helper grows the last partition of GPT and
+# MBR disk images that were made larger after they were partitioned. Images
+# are not block devices, so the kernel is not told and exit code 3 (table
+# written, kernel not told) does not come up here.
+
+if ! command -v sfdisk >/dev/null; then
+	echo "Skipping resize-writable tests, sfdisk is not installed"
+	exit 0
+fi
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+img="$work/disk.img"
+
+# Print the size of partition $2 of the image $1, in sectors.
+part_size()
+{
+	sfdisk --dump "$1" 2>/dev/null | grep "^$1$2 " | sed 's/.*size= *\([0-9]*\).*/\1/'
+}
+
+for label in gpt dos; do
+	rm -f "$img"
+	truncate -s 4M "$img"
+	printf 'label: %s\nstart=2048, size=2048\nstart=4096, size=2048\n' "$label" | \
+		sfdisk --quiet "$img"
+	truncate -s 64M "$img"
+
+	echo "Testing resize-writable grows partition 2 of a $label disk"
+	set -x
+	./src/resize-writable part "$img" 2
+	test "$(part_size "$img" 2)" -gt 120000
+	test "$(part_size "$img" 1)" = 2048
+	sfdisk --verify "$img" >/dev/null
+	set +x
+
+	echo "Testing resize-writable leaves a full $label disk alone"
+	rc=0
+	./src/resize-writable part "$img" 2 || rc=$?
+	set -x
+	test "$rc" = 2
+	set +x
+
+	echo "Testing resize-writable doesn't grow into partition 2 of a $label disk"
+	rc=0
+	./src/resize-writable part "$img" 1 || rc=$?
+	set -x
+	test "$rc" = 2
+	test "$(part_size "$img" 1)" = 2048
+	set +x
+done
@@ -0,0 +1,24 @@
+#!/bin/sh -e
+
+# Check the modes of the sync-path helper and its failures.
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+echo data > "$work/file"
+
+echo "Testing sync-path syncs files, filesystems and directories"
+set -x
+./src/sync-path "$work/file"
+./src/sync-path -f "$work/file" "$work"
+./src/sync-path -p "$work/file" "$work/not-created-yet"
+set +x
+
+echo "Testing sync-path fails for missing paths but syncs the others"
+set -x
+rc=0
+./src/sync-path "$work/missing" "$work/file" 2>"$work/log" || rc=$?
+test "$rc" = 1
+grep -q "cannot open $work/missing" "$work/log"
+if ./src/sync-path -p "$work/missing/file" 2>/dev/null; then exit 1; fi
+if ./src/sync-path 2>/dev/null; then exit 1; fi
+set +x
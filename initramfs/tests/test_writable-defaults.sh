@@ -0,0 +1,96 @@
+#!/bin/sh -e
+
+# shellcheck disable=SC2034
+scriptsroot=./scripts
+# shellcheck disable=SC1091
+. scripts/ubuntu-core-rootfs
+
+# Check that the writable-defaults helper does the same as the cp loop of
+# handle_writable_defaults, over a writable that already has some of the
+# defaults, and that it resumes an interrupted copy.
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+make_root()
+{
+	data="$1/writable/system-data"
+	defaults="$data/_writable_defaults"
+	mkdir -p "$defaults/etc/ssh" "$defaults/var/lib/empty" "$data/etc/ssh"
+	echo config > "$defaults/etc/ssh/sshd_config"
+	chmod 0600 "$defaults/etc/ssh/sshd_config"
+	echo hidden > "$defaults/etc/.hidden"
+	echo top > "$defaults/.top-hidden"
+	ln -s ssh/sshd_config "$defaults/etc/link"
+	dd if=/dev/urandom of="$defaults/var/lib/blob" bs=64k count=4 2>/dev/null
+	ln "$defaults/var/lib/blob" "$defaults/var/lib/blob-link"
+	chmod 0750 "$defaults/etc"
+	echo old > "$data/etc/ssh/sshd_config"
+	echo mine > "$data/etc/ssh/extra"
+}
+
+# Everything copied, with times and hard links. The times of the directories
+# that both get entries added differ, the source is left alone anyway.
+list_root()
+{
+	(cd "$1/writable/system-data" && find . -mindepth 1 -path ./_writable_defaults -prune -o \
+		-printf '%p %y %m %n %s %l %T@\n' | sort)
+}
+
+make_root "$work/shell"
+cp -a "$work/shell" "$work/native"
+
+rootmnt="$work/shell"
+helpersdir=/nonexistent
+handle_writable_defaults
+
+rootmnt="$work/native"
+helpersdir=./src
+handle_writable_defaults
+
+echo "Testing writable-defaults does the same as the cp loop"
+set -x
+test -e "$work/native/writable/system-data/_writable_defaults/.done"
+test "$(list_root "$work/native")" = "$(list_root "$work/shell")"
+cmp "$work/native/writable/system-data/var/lib/blob" \
+	"$work/shell/writable/system-data/var/lib/blob"
+test "$(stat -c %i "$work/native/writable/system-data/var/lib/blob")" = \
+	"$(stat -c %i "$work/native/writable/system-data/var/lib/blob-link")"
+set +x
+
+# Only where the tools and the file system of the tests support them.
+touch "$work/xattr-probe"
+if command -v setfattr >/dev/null && setfattr -n user.test -v yes "$work/xattr-probe" 2>/dev/null; then
+	echo "Testing writable-defaults copies extended attributes"
+	data="$work/xattr/writable/system-data"
+	mkdir -p "$data/_writable_defaults/etc"
+	echo config > "$data/_writable_defaults/etc/config"
+	setfattr -n user.test -v file "$data/_writable_defaults/etc/config"
+	setfattr -n user.test -v dir "$data/_writable_defaults/etc"
+	set -x
+	./src/writable-defaults "$data/_writable_defaults" "$data"
+	test "$(getfattr --only-values -n user.test "$data/etc/config")" = file
+	test "$(getfattr --only-values -n user.test "$data/etc")" = dir
+	set +x
+fi
+
+echo "Testing writable-defaults resumes an interrupted copy"
+data="$work/native/writable/system-data"
+rm "$data/_writable_defaults/.done"
+# a file cut short, and a copied one that must be left alone
+truncate -s 1000 "$data/var/lib/blob"
+ino="$(stat -c %i "$data/etc/ssh/sshd_config")"
+set -x
+./src/writable-defaults "$data/_writable_defaults" "$data"
+test -e "$data/_writable_defaults/.done"
+cmp "$data/var/lib/blob" "$work/shell/writable/system-data/var/lib/blob"
+test "$(stat -c %i "$data/etc/ssh/sshd_config")" = "$ino"
+test "$(list_root "$work/native")" = "$(list_root "$work/shell")"
+set +x
+
+echo "Testing writable-defaults does nothing once done"
+rm "$data/var/lib/blob"
+set -x
+./src/writable-defaults "$data/_writable_defaults" "$data"
+test ! -e "$data/var/lib/blob"
+set +x
@@ -0,0 +1,116 @@
+#!/bin/sh -e
+
+# shellcheck disable=SC2034
+scriptsroot=./scripts
+# shellcheck disable=SC1091
+. scripts/ubuntu-core-rootfs
+
+# Check that the writable-paths helper does the same as the shell loop of
+# handle_writable_paths. This doesn't use /etc entries, which are mounted
+# right away.
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+cat > "$work/writable-paths" <<EOF
+# comment
+/var/tmp    none          temporary   none        defaults
+/var/lib    auto          persistent  none        none
+/var/log    log           persistent  transition  none
+/var/cache  auto          synced      none        none
+/home       user-data     persistent  none        noexec
+/srv/file   auto          persistent  none        none
+/srv/moved  auto          persistent  transition  none
+/missing    auto          persistent  none        none
+/short      auto          persistent
+relative    auto          persistent  none        none
+EOF
+
+make_root()
+{
+	root="$1"
+	mkdir -p "$root/var/tmp" "$root/var/lib/snapd" "$root/var/log/apt" \
+		"$root/var/cache/apt/archives" "$root/home" "$root/srv" \
+		"$root/relative" "$root/writable/system-data/var/cache/apt"
+	chmod 1777 "$root/var/tmp"
+	chmod 0700 "$root/var/lib"
+	echo log > "$root/var/log/apt/history.log"
+	echo cache > "$root/var/cache/apt/pkgcache.bin"
+	echo kept > "$root/writable/system-data/var/cache/apt/pkgcache.bin"
+	echo new > "$root/var/cache/apt/archives/lock"
+	ln -s ../pkgcache.bin "$root/var/cache/apt/archives/link"
+	echo file > "$root/srv/file"
+	chmod 0640 "$root/srv/file"
+	echo moved > "$root/srv/moved"
+	touch "$root/fstab"
+}
+
+list_root()
+{
+	(cd "$1" && find . -path ./fstab -prune -o -printf '%p %y %m %s %l\n' | sort)
+}
+
+make_root "$work/shell"
+make_root "$work/native"
+
+rootmnt="$work/shell"
+helpersdir=/nonexistent
+handle_writable_paths "$work/writable-paths" "$work/shell/fstab"
+
+rootmnt="$work/native"
+helpersdir=./src
+handle_writable_paths "$work/writable-paths" "$work/native/fstab"
+
+echo "Testing the writable-paths helper makes the same fstab"
+set -x
+cat "$work/native/fstab"
+cmp "$work/shell/fstab" "$work/native/fstab"
+test "$(wc -l < "$work/native/fstab")" = 7
+set +x
+
+echo "Testing the writable-paths helper makes the same writable tree"
+list_root "$work/shell" > "$work/shell.list"
+list_root "$work/native" > "$work/native.list"
+set -x
+diff -u "$work/shell.list" "$work/native.list"
+test "$(cat "$work/native/writable/system-data/var/cache/apt/pkgcache.bin")" = kept
+test "$(cat "$work/native/writable/log/apt/history.log")" = log
+test "$(cat "$work/native/writable/system-data/srv/moved")" = moved
+test -e "$work/native/writable/system-data/var/cache/apt/archives/lock"
+test -L "$work/native/writable/system-data/var/cache/apt/archives/link"
+set +x
+
+echo "Testing the writable-paths helper fails before changing anything"
+rm -rf "$work/native"
+make_root "$work/native"
+rootmnt="$work/native"
+set -x
+if ./src/writable-paths "$rootmnt" "$work/writable-paths" /nonexistent/fstab; then
+	exit 1
+fi
+test ! -e "$work/native/writable/system-data/var/lib"
+set +x
+
+echo "Testing synced paths are synced once per core snap revision"
+rm -rf "$work/native"
+make_root "$work/native"
+rootmnt="$work/native"
+helpersdir=./src
+synced="$work/native/writable/system-data/var/cache/apt"
+snap_core=core_1.snap
+handle_writable_paths "$work/writable-paths" "$work/native/fstab"
+set -x
+grep -qx "core_1.snap /var/cache" "$work/native/writable/.synced-paths"
+test "$(wc -l < "$work/native/writable/.synced-paths")" = 1
+rm "$synced/archives/lock"
+set +x
+handle_writable_paths "$work/writable-paths" "$work/native/fstab"
+set -x
+test ! -e "$synced/archives/lock"
+set +x
+snap_core=core_2.snap
+handle_writable_paths "$work/writable-paths" "$work/native/fstab"
+set -x
+test -e "$synced/archives/lock"
+grep -qx "core_2.snap /var/cache" "$work/native/writable/.synced-paths"
+set +x